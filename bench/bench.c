@@ -0,0 +1,308 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark harness: runs dos33util commands over the corpus made by
+ * mkcorpus and prints one JSON object per line with ops/sec, syscalls and
+ * peak RSS. Mutating commands work on a fresh copy of the image for each
+ * run, the copy is not timed. Syscalls are counted in one extra traced run
+ * so the tracing does not slow the timed ones. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+// Defines
+#define IMAGE_SIZE (35 * 16 * 256)
+
+// Structs
+struct Sop {
+	char	*name;
+	int		mutates;
+	int		needsProbe;
+};
+
+struct Sresult {
+	double	seconds;
+	long	peakRss;
+	long	syscalls;
+	int		failures;
+};
+
+// Constants
+const static struct Sop ops[] = {
+	{"CATALOG",		0, 0},
+	{"DUMP",		0, 0},
+	{"LOAD",		0, 1},
+	{"SAVE",		1, 0},
+	{"DELETE",		1, 1},
+	{"UNDELETE",	1, 1},
+	{"INIT",		1, 0},
+};
+const static int numOps = sizeof(ops) / sizeof(struct Sop);
+const static char *images[] = {
+	"empty", "full", "fragmented", "maxcatalog", "manysmall", "fewlarge",
+};
+const static int numImages = sizeof(images) / sizeof(char *);
+
+// Variables
+static char		*dos33util;
+static char		*corpusDir;
+static char		workDir[FILENAME_MAX + 16];
+
+/*****************************************************************************/
+static double now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*****************************************************************************/
+static int copyFile(char *from, char *to) {
+	char	buffer[IMAGE_SIZE];
+	FILE	*in, *out;
+	size_t	n;
+
+	in = fopen(from, "rb");
+	if (NULL == in) {
+		return -1;
+	}
+	out = fopen(to, "wb");
+	if (NULL == out) {
+		fclose(in);
+		return -1;
+	}
+	while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+		fwrite(buffer, 1, n, out);
+	}
+	fclose(in);
+	return fclose(out);
+}
+
+/*****************************************************************************/
+static void childExec(char **args, int trace) {
+	int fd;
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+	}
+#ifdef __linux__
+	if (trace) {
+		ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+	}
+#endif
+	execv(args[0], args);
+	_exit(127);
+}
+
+/*****************************************************************************/
+static long countSyscalls(pid_t pid, int *status) {
+	long	count = -1;
+#ifdef __linux__
+	int		sig, entering = 1;
+
+	// Stopped at exec, from now on stop at every syscall entry and exit
+	if (waitpid(pid, status, 0) < 0 || !WIFSTOPPED(*status)) {
+		return -1;
+	}
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+		(void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+	count = 0;
+	sig = 0;
+	while (ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig) == 0) {
+		if (waitpid(pid, status, 0) < 0 || WIFEXITED(*status) ||
+				WIFSIGNALED(*status)) {
+			break;
+		}
+		sig = 0;
+		if (WSTOPSIG(*status) == (SIGTRAP | 0x80)) {
+			count += entering;
+			entering = !entering;
+		} else {
+			sig = WSTOPSIG(*status);
+		}
+	}
+#endif
+	return count;
+}
+
+/*****************************************************************************/
+static int runCommand(char **args, int trace, struct Sresult *res) {
+	struct rusage	usage;
+	double			start;
+	pid_t			pid;
+	int				status = 0;
+	long			syscalls;
+
+	start = now();
+	pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+	if (pid == 0) {
+		childExec(args, trace);
+	}
+	if (trace) {
+		syscalls = countSyscalls(pid, &status);
+		if (!WIFEXITED(status) && !WIFSIGNALED(status)) {
+			waitpid(pid, &status, 0);
+		}
+		res->syscalls = syscalls;
+		return 0;
+	}
+	if (wait4(pid, &status, 0, &usage) < 0) {
+		return -1;
+	}
+	res->seconds += now() - start;
+	if (usage.ru_maxrss > res->peakRss) {
+		res->peakRss = usage.ru_maxrss;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		++res->failures;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+static int prepare(const struct Sop *op, const char *image, char **args) {
+	static char		source[FILENAME_MAX + 32], work[FILENAME_MAX + 32];
+	static char		input[FILENAME_MAX + 32], output[FILENAME_MAX + 32];
+	char			*delArgs[5];
+	struct Sresult	ignored;
+	int				n = 0;
+
+	snprintf(source, sizeof(source), "%s/%s.dsk", corpusDir, image);
+	snprintf(work, sizeof(work), "%s/work.dsk", workDir);
+	snprintf(input, sizeof(input), "%s/files/input", corpusDir);
+	snprintf(output, sizeof(output), "%s/probe", workDir);
+	args[n++] = dos33util;
+	if (0 == strcmp(op->name, "SAVE")) {
+		args[n++] = "-r";
+		args[n++] = "-t";
+		args[n++] = "T";
+		args[n++] = "-a";
+		args[n++] = "0";
+	}
+	args[n++] = op->mutates ? work : source;
+	args[n++] = op->name;
+	if (0 == strcmp(op->name, "SAVE")) {
+		args[n++] = input;
+		args[n++] = "NEW";
+	} else if (op->needsProbe) {
+		args[n++] = "PROBE";
+		if (0 == strcmp(op->name, "LOAD")) {
+			args[n++] = output;
+		}
+	}
+	args[n] = NULL;
+	if (!op->mutates) {
+		return 0;
+	}
+	if (0 == strcmp(op->name, "INIT")) {
+		unlink(work);
+		return 0;
+	}
+	if (copyFile(source, work) < 0) {
+		fprintf(stderr, "Error copying '%s'\n", source);
+		return -1;
+	}
+	if (0 == strcmp(op->name, "UNDELETE")) {
+		delArgs[0] = dos33util;
+		delArgs[1] = work;
+		delArgs[2] = "DELETE";
+		delArgs[3] = "PROBE";
+		delArgs[4] = NULL;
+		memset(&ignored, 0, sizeof(ignored));
+		runCommand(delArgs, 0, &ignored);
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+static void bench(const struct Sop *op, const char *image, int iterations) {
+	struct Sresult	res;
+	char			*args[16];
+	int				i;
+
+	memset(&res, 0, sizeof(res));
+	res.syscalls = -1;
+	for (i = 0; i < iterations; i++) {
+		if (prepare(op, image, args) < 0) {
+			return;
+		}
+		runCommand(args, 0, &res);
+	}
+	if (prepare(op, image, args) == 0) {
+		runCommand(args, 1, &res);
+	}
+	printf("{\"op\":\"%s\",\"image\":\"%s\",\"iterations\":%d,"
+		"\"failures\":%d,\"ops_per_sec\":%.1f,\"mean_us\":%.1f,"
+		"\"syscalls\":%ld,\"peak_rss_kb\":%ld}\n",
+		op->name, image, iterations, res.failures,
+		res.seconds > 0 ? iterations / res.seconds : 0.0,
+		iterations ? res.seconds * 1e6 / iterations : 0.0,
+		res.syscalls, res.peakRss);
+	fflush(stdout);
+}
+
+/*****************************************************************************/
+int main(int argc, char **argv) {
+	int i, j, iterations = 100;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <dos33util> <corpus_dir> [iterations]\n",
+			argv[0]);
+		return 1;
+	}
+	dos33util = argv[1];
+	corpusDir = argv[2];
+	if (argc > 3) {
+		iterations = atoi(argv[3]);
+	}
+	snprintf(workDir, sizeof(workDir), "%s/work", corpusDir);
+	mkdir(workDir, 0777);
+	for (i = 0; i < numOps; i++) {
+		// INIT does not depend on the image
+		if (0 == strcmp(ops[i].name, "INIT")) {
+			bench(&ops[i], "none", iterations);
+			continue;
+		}
+		for (j = 0; j < numImages; j++) {
+			if (ops[i].needsProbe && 0 == strcmp(images[j], "empty")) {
+				continue;
+			}
+			bench(&ops[i], images[j], iterations);
+		}
+	}
+	return 0;
+}
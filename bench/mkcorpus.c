@@ -0,0 +1,174 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/* Synthetic image corpus for the benchmarks. Every image is built by
+ * dos33util itself from a BATCH script, with file contents from a fixed
+ * seed so the corpus is the same on every run. All images but 'empty'
+ * hold a 1 sector file named PROBE for the harness to work on. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Defines
+#define BYTES_PER_SECTOR 256
+
+// Variables
+static char				*dos33util;
+static char				*outDir;
+static unsigned int		seed = 0x12345678;
+
+/*****************************************************************************/
+static unsigned int nextRandom() {
+	// xorshift32
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/*****************************************************************************/
+static int makeFile(char *name, int sectors) {
+	char	path[FILENAME_MAX + 16];
+	FILE	*f;
+	int		i;
+
+	snprintf(path, sizeof(path), "%s/files/%s", outDir, name);
+	f = fopen(path, "wb");
+	if (NULL == f) {
+		fprintf(stderr, "Error opening '%s' for write.\n", path);
+		return -1;
+	}
+	for (i = 0; i < sectors * BYTES_PER_SECTOR; i++) {
+		fputc(nextRandom() & 0xFF, f);
+	}
+	fclose(f);
+	return 0;
+}
+
+/*****************************************************************************/
+static void saveLine(FILE *script, char *name, int sectors) {
+	makeFile(name, sectors);
+	fprintf(script, "SAVE -r -t T -a 0 %s/files/%s %s\n", outDir, name, name);
+}
+
+/*****************************************************************************/
+static FILE *beginImage(char *image) {
+	char	path[FILENAME_MAX + 16];
+	FILE	*script;
+
+	snprintf(path, sizeof(path), "%s/%s.txt", outDir, image);
+	script = fopen(path, "w");
+	if (NULL == script) {
+		fprintf(stderr, "Error opening '%s' for write.\n", path);
+		exit(1);
+	}
+	fprintf(script, "INIT\n");
+	if (strcmp(image, "empty") != 0) {
+		saveLine(script, "PROBE", 1);
+	}
+	return script;
+}
+
+/*****************************************************************************/
+static int endImage(char *image, FILE *script) {
+	char	command[FILENAME_MAX * 4];
+
+	fclose(script);
+	snprintf(command, sizeof(command), "%s %s/%s.dsk BATCH %s/%s.txt",
+		dos33util, outDir, image, outDir, image);
+	if (system(command) != 0) {
+		fprintf(stderr, "Error building image '%s'\n", image);
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+int main(int argc, char **argv) {
+	char	path[FILENAME_MAX + 16], name[32];
+	FILE	*script;
+	int		i, errors = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <dos33util> <output_dir>\n", argv[0]);
+		return 1;
+	}
+	dos33util = argv[1];
+	outDir = argv[2];
+	mkdir(outDir, 0777);
+	snprintf(path, sizeof(path), "%s/files", outDir);
+	mkdir(path, 0777);
+	// Input for the SAVE benchmark
+	makeFile("input", 16);
+
+	// Only VTOC and catalog
+	script = beginImage("empty");
+	errors += endImage("empty", script) < 0;
+
+	// All 528 sectors used: PROBE 2, 4 x (128 + 2), filler 5 + 1
+	script = beginImage("full");
+	for (i = 0; i < 4; i++) {
+		snprintf(name, sizeof(name), "BIG%d", i);
+		saveLine(script, name, 128);
+	}
+	saveLine(script, "FILLER", 5);
+	errors += endImage("full", script) < 0;
+
+	// Small files with every other one deleted, then larger files that
+	// have to be spread over the holes
+	script = beginImage("fragmented");
+	for (i = 0; i < 80; i++) {
+		snprintf(name, sizeof(name), "S%03d", i);
+		saveLine(script, name, 1 + i % 4);
+	}
+	for (i = 0; i < 80; i += 2) {
+		fprintf(script, "DELETE S%03d\n", i);
+	}
+	for (i = 0; i < 10; i++) {
+		snprintf(name, sizeof(name), "L%03d", i);
+		saveLine(script, name, 20);
+	}
+	errors += endImage("fragmented", script) < 0;
+
+	// All 105 catalog entries in use
+	script = beginImage("maxcatalog");
+	for (i = 0; i < 104; i++) {
+		snprintf(name, sizeof(name), "C%03d", i);
+		saveLine(script, name, 1);
+	}
+	errors += endImage("maxcatalog", script) < 0;
+
+	script = beginImage("manysmall");
+	for (i = 0; i < 60; i++) {
+		snprintf(name, sizeof(name), "M%03d", i);
+		saveLine(script, name, 2);
+	}
+	errors += endImage("manysmall", script) < 0;
+
+	// Each one needs two T/S lists
+	script = beginImage("fewlarge");
+	for (i = 0; i < 3; i++) {
+		snprintf(name, sizeof(name), "LARGE%d", i);
+		saveLine(script, name, 140);
+	}
+	errors += endImage("fewlarge", script) < 0;
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "dos33.h"
+
+// Defines
+#define ARCHIVE_HEADER_SIZE 8
+#define ARCHIVE_POOL_NAME "sectors.pool"
+#define ARCHIVE_HASH_NAME "sectors.hash"
+
+// Structs
+struct SarchiveIndex;
+
+/* Archived image (.dar): a header with its geometry and a reference per
+ * sector into the pool of unique sectors that every archived image of the
+ * same directory shares. Reference 0 is a zeroed sector, which is never
+ * stored, n is the n-th sector of the pool. index is the one of the pool
+ * hashes shared by every image of the directory */
+struct Sarchive {
+    int             open;
+    int             tracks;
+    int             sectors;
+    char            dir[FILENAME_MAX];
+    FILE            *pool;
+    struct SarchiveIndex *index;
+    unsigned int    refs[MAX_TRACKS * MAX_SECTORS_PER_TRACK];
+};
+
+// Prototipes
+int archiveProbe(const unsigned char *head, int headLen);
+int archiveOpen(struct Sarchive *ar, const char *filename, FILE *f,
+    FILE *err);
+int archiveCreate(struct Sarchive *ar, const char *filename, int tracks,
+    int sectors);
+long archiveReadTrack(struct Sarchive *ar, int track, unsigned char *data,
+    FILE *err);
+long archiveStore(struct Sarchive *ar, const unsigned char *data,
+    const unsigned char *dirty, int tracks, int sectors, int all, int sync,
+    FILE *err);
+long archiveWrite(struct Sarchive *ar, FILE *f);
+void archiveFree(struct Sarchive *ar);
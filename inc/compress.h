@@ -0,0 +1,52 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+// Defines
+#define COMPRESS_PROBE_SIZE 16
+
+// Enums
+enum {
+    COMPRESS_NONE = 0,
+    COMPRESS_GZIP,
+    COMPRESS_ZLIB,
+};
+
+// Structs
+
+/* Compressed image being read, inflated into memory only as far as it has
+ * been asked for */
+struct Scompress;
+
+// Prototipes
+int compressProbe(const unsigned char *head, int headLen);
+int compressExtension(const char *filename);
+struct Scompress *compressOpen(FILE *f, int kind, FILE *err);
+long compressRead(struct Scompress *z, long pos, unsigned char *data,
+    long len);
+FILE *compressStream(struct Scompress *z);
+int compressWrite(int kind, FILE *f, const unsigned char *data, long size,
+    FILE *err);
+void compressFree(struct Scompress *z);
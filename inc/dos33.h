@@ -28,11 +28,14 @@
 #define WORD(__h, __l) (((__h & 0xFF) << 8) | (__l & 0xFF))
 #define TRACKS_PER_DISK 35
 #define SECTORS_PER_TRACK 16
+#define MAX_TRACKS 50
+#define MAX_SECTORS_PER_TRACK 32
 #define BYTES_PER_SECTOR 256
 #define VTOC_TRACK  17
 #define VTOC_SECTOR 0
 #define FILE_NAME_SIZE     30
 #define TSL_MAX_NUMBER      122
+#define CATALOG_ENTRIES     7
 
 // Structs
 #pragma pack(push, 1)
@@ -57,7 +60,7 @@ struct Svtoc {
     char            numTracks;
     char            sectorsPerTrack;
     short           bytesPerSector;
-    unsigned char   bitmap[50][4];
+    unsigned char   bitmap[MAX_TRACKS][4];
 };
 
 struct ScatalogHeader {
@@ -88,4 +91,5 @@ struct ScatalogEntry {
     struct Sts          nextTs;
     int                 entryNum;
     struct SfileEntry   fileEntry;
+    unsigned char       visited[MAX_TRACKS * MAX_SECTORS_PER_TRACK / 8];
 };
@@ -0,0 +1,165 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "dos33.h"
+#include "image.h"
+
+// Defines
+#define MAX_WORKERS 64
+#define CAT_HASH_SIZE 256
+
+// Enums
+
+/* Results of the public functions, a message with the details has been
+ * written to the error stream of the image */
+enum {
+    DOS33_OK = 0,
+    DOS33_ERR_ARGS = -1,
+    DOS33_ERR_IO = -2,
+    DOS33_ERR_NOT_FOUND = -3,
+    DOS33_ERR_EXISTS = -4,
+    DOS33_ERR_LOCKED = -5,
+    DOS33_ERR_FULL = -6,
+    DOS33_ERR_CATALOG_FULL = -7,
+    DOS33_ERR_CORRUPT = -8,
+    DOS33_ERR_MEMORY = -9,
+    DOS33_ERR_GEOMETRY = -10,
+};
+
+/* How CATALOG lists the files, dos33Escape() quotes strings for each */
+enum {
+    DOS33_FORMAT_TEXT = 0,
+    DOS33_FORMAT_JSON,
+    DOS33_FORMAT_CSV,
+    DOS33_FORMAT_TSV,
+};
+
+enum {
+    CAT_FREE = 0,
+    CAT_LIVE,
+    CAT_DELETED,
+};
+
+enum {
+    SECTOR_VTOC = 0,
+    SECTOR_CATALOG,
+    SECTOR_TSL,
+    SECTOR_DATA,
+    SECTOR_KINDS,
+};
+
+// Structs
+struct ScatSlot {
+    struct Sts      ts;
+    int             slot;
+    int             state;
+    int             next;
+    char            name[FILE_NAME_SIZE + 1];
+};
+
+/* Catalog entries in chain order (position), hashed by name. Buckets and
+ * next hold position + 1, zero ends a chain. Free slots (never used or
+ * deleted) are a bitmap so the first one is found without a catalog walk.
+ * failed tells it could not be allocated, the image is not written then */
+struct ScatIndex {
+    int             built;
+    int             failed;
+    int             numSlots;
+    struct ScatSlot *slots;
+    int             buckets[CAT_HASH_SIZE];
+    unsigned int    *freeMap;
+    int             sectorPos[IMAGE_MAX_SECTORS];
+};
+
+struct Sphase {
+    double          wall;
+    double          cpu;
+};
+
+/* Counters of one run (command or BATCH) over one image */
+struct Sstats {
+    unsigned long       reads[SECTOR_KINDS];
+    unsigned long       writes[SECTOR_KINDS];
+    unsigned long       catEntries;
+    unsigned long       bitmapScans;
+    struct SimageStats  image;
+    struct Sphase       command;
+    struct Sphase       commit;
+};
+
+/* One disk image and everything known about it. Nothing is shared between
+ * handles, so different threads may each work on their own. The options
+ * (force to formatSectors) apply to the next commands and may be changed
+ * between them. The geometry of an open image is the one of its VTOC,
+ * dos33Format() uses formatTracks by formatSectors, zero for the usual
+ * 35 by 16. SAVE reads in when its file is '-' */
+struct Sdos33 {
+    char                    filename[FILENAME_MAX];
+    struct Simage           image;
+    struct Svtoc            vtoc;
+    struct ScatalogEntry    catEntry;
+    struct ScatIndex        catIndex;
+    int                     force;
+    int                     raw;
+    int                     address;
+    char                    type;
+    int                     repair;
+    int                     format;
+    int                     formatTracks;
+    int                     formatSectors;
+    int                     threads;
+    FILE                    *in;
+    FILE                    *out;
+    FILE                    *err;
+    struct Sstats           stats;
+};
+
+// Prototipes
+void dos33Setup(struct Sdos33 *d, const char *filename, FILE *out, FILE *err);
+int dos33Open(struct Sdos33 *d);
+int dos33Flush(struct Sdos33 *d);
+int dos33Close(struct Sdos33 *d);
+void dos33Discard(struct Sdos33 *d);
+const char *dos33ErrorString(int error);
+int dos33Escape(char *out, const char *s, int format);
+void dos33ParseHostFilename(struct Sdos33 *d, char *inputFilename,
+    char *appleFilename, char *fileType, int *fileAddress);
+int dos33Catalog(struct Sdos33 *d);
+int dos33Dump(struct Sdos33 *d);
+int dos33Verify(struct Sdos33 *d);
+int dos33Recover(struct Sdos33 *d, int restore);
+int dos33Optimize(struct Sdos33 *d, char *bootFilename);
+int dos33Archive(struct Sdos33 *d, char *dirname);
+int dos33Unarchive(struct Sdos33 *d, char *filename);
+int dos33Load(struct Sdos33 *d, char *appleFilename, char *outputFilename);
+int dos33LoadAll(struct Sdos33 *d, char *dirname);
+int dos33Save(struct Sdos33 *d, char *inputFilename, char *appleFilename);
+int dos33SaveDir(struct Sdos33 *d, char *dirname);
+int dos33Sync(struct Sdos33 *d, char *dirname);
+int dos33Delete(struct Sdos33 *d, char *appleFilename);
+int dos33Undelete(struct Sdos33 *d, char *appleFilename);
+int dos33Lock(struct Sdos33 *d, char *appleFilename, int lock);
+int dos33Rename(struct Sdos33 *d, char *appleFilename, char *newAppleFilename);
+int dos33Format(struct Sdos33 *d, char *dosFilename);
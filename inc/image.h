@@ -0,0 +1,121 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "dos33.h"
+#include "nibble.h"
+#include "archive.h"
+#include "compress.h"
+
+// Defines
+#define IMAGE_MAX_SECTORS (MAX_TRACKS * MAX_SECTORS_PER_TRACK)
+#define IMG2_HEADER_SIZE 64
+
+// Enums
+enum {
+    IMAGE_DURABILITY_NONE = 0,
+    IMAGE_DURABILITY_FSYNC,
+    IMAGE_DURABILITY_ATOMIC,
+};
+
+enum {
+    IMAGE_ORDER_DOS = 0,
+    IMAGE_ORDER_PRODOS,
+};
+
+// Structs
+
+/* Counters of one image, kept until the next imageOpen()/imageCreate() */
+struct SimageStats {
+    unsigned long   hits;
+    unsigned long   misses;
+    unsigned long   flushed;
+    unsigned long   seeks;
+    unsigned long   bytesRead;
+    unsigned long   bytesWritten;
+};
+
+/* Disk image cached in memory, tracks by sectors per track big. Tracks are
+ * read on first use, one that can't be read is marked failed and never used
+ * or written back, its sectors count in invalid. Sectors are accessed by
+ * pointer and only the ones marked dirty are written back, in
+ * track/sector order, on imageClose(). A sector outside the disk is counted
+ * in invalid and served from scratch: a zeroed one to read, another one to
+ * throw writes away. Nibble and WOZ images are decoded a track at a time
+ * into the same cache, state tells the sectors that could not be read or
+ * can't be rewritten, and fixedSectors is their only sectors per track.
+ * Sectors are cached in DOS order, perm tells where each one is in a track
+ * of the file. The data of a 2IMG starts at dataOffset and is dataLength
+ * long (-1 up to the end), its header and trailing chunks are kept in
+ * head and tail. An archived image reads its sectors from the pool of its
+ * archive and stores the changed ones there before its references. A
+ * compressed image is inflated as its tracks are needed from gz, and is
+ * compressed again whole when written. imageFlush() writes back like
+ * imageClose() and keeps the image open */
+struct Simage {
+    char            filename[FILENAME_MAX];
+    FILE            *file;
+    FILE            *err;
+    unsigned char   *data;
+    int             tracks;
+    int             sectors;
+    int             created;
+    unsigned char   loaded[MAX_TRACKS];
+    unsigned char   failed[MAX_TRACKS];
+    unsigned char   dirty[IMAGE_MAX_SECTORS];
+    unsigned char   state[IMAGE_MAX_SECTORS];
+    int             fixedSectors;
+    int             order;
+    int             orderFixed;
+    unsigned char   perm[MAX_SECTORS_PER_TRACK];
+    long            dataOffset;
+    long            dataLength;
+    unsigned char   *head;
+    long            headSize;
+    unsigned char   *tail;
+    long            tailSize;
+    struct Snibble  nib;
+    struct Sarchive ar;
+    int             compressed;
+    struct Scompress *gz;
+    unsigned char   scratch[2][BYTES_PER_SECTOR];
+    int             invalid;
+    struct SimageStats stats;
+};
+
+// Prototipes
+int imageOpen(struct Simage *img, const char *filename, FILE *err);
+int imageCreate(struct Simage *img, const char *filename, FILE *err,
+    int tracks, int sectors);
+int imageSetGeometry(struct Simage *img, int tracks, int sectors);
+int imageSetOrder(struct Simage *img, int order);
+int imageOffset(struct Simage *img, int track, int sector);
+int imageExport(struct Simage *img, const char *filename);
+int imageFlush(struct Simage *img);
+int imageClose(struct Simage *img);
+void imageDiscard(struct Simage *img);
+int imageLoadAll(struct Simage *img);
+int imageSetDurability(const char *mode);
+unsigned char *imageSector(struct Simage *img, int track, int sector);
+unsigned char *imageSectorW(struct Simage *img, int track, int sector);
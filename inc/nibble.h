@@ -0,0 +1,77 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include "dos33.h"
+
+// Defines
+#define NIB_TRACK_SIZE 6656
+
+// Enums
+enum {
+    NIBBLE_NONE = 0,
+    NIBBLE_NIB,
+    NIBBLE_WOZ1,
+    NIBBLE_WOZ2,
+};
+
+/* State of a decoded sector */
+enum {
+    NIBBLE_SECTOR_OK = 0,
+    NIBBLE_SECTOR_BAD,
+    NIBBLE_SECTOR_READONLY,
+};
+
+// Structs
+
+/* Bitstream of one track in the raw file and the bit where the data field
+ * of each logical sector starts, -1 when it can't be rewritten in place */
+struct SnibbleTrack {
+    long            offset;
+    int             bits;
+    int             dataBit[MAX_SECTORS_PER_TRACK];
+};
+
+/* Nibble (.nib) or WOZ image, kept raw in memory. A .nib track is a
+ * bitstream too, of whole bytes, so both are decoded the same way */
+struct Snibble {
+    int                 kind;
+    unsigned char       *raw;
+    long                size;
+    int                 tracks;
+    int                 sectors;
+    struct SnibbleTrack track[MAX_TRACKS];
+};
+
+// Prototipes
+int nibbleProbe(const char *filename, const unsigned char *head, int headLen,
+    long size);
+int nibbleOpen(struct Snibble *nib, int kind, FILE *f, long size, FILE *err);
+int nibbleCreate(struct Snibble *nib, int tracks, FILE *err);
+int nibbleReadTrack(struct Snibble *nib, int track, unsigned char *data,
+    unsigned char *state);
+int nibbleWriteSector(struct Snibble *nib, int track, int sector,
+    const unsigned char *data);
+int nibbleSave(struct Snibble *nib, FILE *f);
+void nibbleFree(struct Snibble *nib);
@@ -23,14 +23,17 @@
 #pragma once
 
 #include <stdlib.h>
+#include <stdio.h>
 
 // Prototipes
-int diskOffset(unsigned char track, unsigned char sector);
-int checkAppleFilename(char *filename);
-int truncateFilename(char *out, char *in);
+int diskOffset(int track, int sector, int tracks, int sectors);
+int checkAppleFilename(FILE *err, char *filename);
+int truncateFilename(FILE *err, char *out, char *in);
 char *dos33FilenameToAscii(char *dest, unsigned char *src, int len);
+void dos33AsciiToFilename(unsigned char *dest, char *src);
 char dos33TypeToLetter(int value);
 int dos33LetterToType(char type, int lock);
 int dos33TypeToHex(int value);
 int dos33HexToType(int value);
 int findFirstOne(unsigned char byte);
+int splitArgs(char *line, char **argv, int max);
@@ -0,0 +1,506 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/file.h>
+#endif
+#include "dos33.h"
+#include "archive.h"
+
+// Defines
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_HASH_SIZE 8
+#define ARCHIVE_INDEX_MIN 1024
+#define ARCHIVE_PATH_MAX (FILENAME_MAX + 16)
+#define FNV_OFFSET 0xCBF29CE484222325ULL
+#define FNV_PRIME 0x100000001B3ULL
+
+// Structs
+
+/* Hashes of the pool sectors, open addressing, ref 0 is an empty slot.
+ * One per archive directory, kept for the life of the process, so each
+ * store only reads the hashes added since count, the pool sectors known */
+struct SarchiveIndex {
+	char				dir[FILENAME_MAX];
+	pthread_mutex_t		lock;
+	long				count;
+	unsigned long long	*keys;
+	unsigned int		*refs;
+	unsigned int		mask;
+	unsigned int		used;
+	struct SarchiveIndex *next;
+};
+
+// Constants
+static const unsigned char archiveMagic[4] = { 'D', 'S', 'A', 'R' };
+static const unsigned char zeroSector[BYTES_PER_SECTOR];
+
+// Variables
+static struct SarchiveIndex	*archiveIndexes = NULL;
+static pthread_mutex_t		archiveIndexesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Private functions
+
+/*****************************************************************************/
+static unsigned long long archiveHash(const unsigned char *p) {
+	unsigned long long	h = FNV_OFFSET, w;
+	int					i;
+
+	// FNV-1a a word at a time, a match is compared byte by byte anyway
+	for (i = 0; i < BYTES_PER_SECTOR; i += 8) {
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * FNV_PRIME;
+		h ^= h >> 32;
+	}
+	return h;
+}
+
+/*****************************************************************************/
+static unsigned long long getLe(const unsigned char *p, int bytes) {
+	unsigned long long v = 0;
+
+	while (bytes-- > 0) {
+		v = (v << 8) | p[bytes];
+	}
+	return v;
+}
+
+/*****************************************************************************/
+static void putLe(unsigned char *p, unsigned long long value, int bytes) {
+	while (bytes-- > 0) {
+		*p++ = value & 0xFF;
+		value >>= 8;
+	}
+}
+
+/*****************************************************************************/
+static void archivePath(char *path, struct Sarchive *ar, const char *name) {
+	snprintf(path, ARCHIVE_PATH_MAX, "%s/%s", ar->dir, name);
+}
+
+/*****************************************************************************/
+static void archiveSetDir(struct Sarchive *ar, const char *filename) {
+	char *slash;
+
+	strncpy(ar->dir, filename, FILENAME_MAX - 1);
+	slash = strrchr(ar->dir, '/');
+	if (NULL == slash) {
+		strcpy(ar->dir, ".");
+	} else if (slash == ar->dir) {
+		ar->dir[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+}
+
+/*****************************************************************************/
+static int archiveTruncate(FILE *f, long length) {
+	fflush(f);
+#ifdef _WIN32
+	return _chsize(_fileno(f), length);
+#else
+	return ftruncate(fileno(f), length);
+#endif
+}
+
+/*****************************************************************************/
+static int archiveSync(FILE *f, int sync) {
+	if (fflush(f) != 0) {
+		return -1;
+	}
+	if (!sync) {
+		return 0;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(f));
+#else
+	return fsync(fileno(f));
+#endif
+}
+
+/*****************************************************************************/
+static int archiveIndexAdd(struct SarchiveIndex *idx, unsigned long long key,
+		unsigned int ref) {
+	unsigned long long	*keys;
+	unsigned int		*refs, size, i, j;
+
+	// Kept at most half full so probes stay short
+	if ((idx->used + 1) * 2 > idx->mask + 1) {
+		size = idx->keys ? (idx->mask + 1) * 2 : ARCHIVE_INDEX_MIN;
+		keys = (unsigned long long *)malloc(size * sizeof(*keys));
+		refs = (unsigned int *)calloc(size, sizeof(*refs));
+		if (NULL == keys || NULL == refs) {
+			free(keys);
+			free(refs);
+			return -1;
+		}
+		for (i = 0; idx->keys && i <= idx->mask; i++) {
+			if (idx->refs[i] == 0) {
+				continue;
+			}
+			for (j = idx->keys[i] & (size - 1); refs[j] != 0;
+					j = (j + 1) & (size - 1))
+				;
+			keys[j] = idx->keys[i];
+			refs[j] = idx->refs[i];
+		}
+		free(idx->keys);
+		free(idx->refs);
+		idx->keys = keys;
+		idx->refs = refs;
+		idx->mask = size - 1;
+	}
+	for (i = key & idx->mask; idx->refs[i] != 0; i = (i + 1) & idx->mask)
+		;
+	idx->keys[i] = key;
+	idx->refs[i] = ref;
+	++idx->used;
+	return 0;
+}
+
+/*****************************************************************************/
+static void archiveIndexReset(struct SarchiveIndex *idx) {
+	free(idx->keys);
+	free(idx->refs);
+	idx->keys = NULL;
+	idx->refs = NULL;
+	idx->mask = 0;
+	idx->used = 0;
+	idx->count = 0;
+}
+
+/*****************************************************************************/
+static struct SarchiveIndex *archiveIndexGet(struct Sarchive *ar) {
+	struct SarchiveIndex *idx;
+
+	if (NULL != ar->index) {
+		return ar->index;
+	}
+	pthread_mutex_lock(&archiveIndexesLock);
+	for (idx = archiveIndexes; NULL != idx; idx = idx->next) {
+		if (0 == strcmp(idx->dir, ar->dir)) {
+			break;
+		}
+	}
+	if (NULL == idx) {
+		idx = (struct SarchiveIndex *)calloc(1, sizeof(*idx));
+		if (NULL != idx) {
+			strcpy(idx->dir, ar->dir);
+			pthread_mutex_init(&idx->lock, NULL);
+			idx->next = archiveIndexes;
+			archiveIndexes = idx;
+		}
+	}
+	pthread_mutex_unlock(&archiveIndexesLock);
+	ar->index = idx;
+	return idx;
+}
+
+/*****************************************************************************/
+static int archiveReadRef(FILE *pool, unsigned int ref, unsigned char *data) {
+	fseek(pool, (long)(ref - 1) * BYTES_PER_SECTOR, SEEK_SET);
+	return fread(data, 1, BYTES_PER_SECTOR, pool) == BYTES_PER_SECTOR;
+}
+
+/*****************************************************************************/
+static long archiveIndexLoad(struct SarchiveIndex *idx, FILE *pool,
+		FILE *hash) {
+	unsigned char	buf[BYTES_PER_SECTOR];
+	long			count, n, k;
+
+	fseek(pool, 0, SEEK_END);
+	count = ftell(pool) / BYTES_PER_SECTOR;
+	fseek(hash, 0, SEEK_END);
+	n = ftell(hash) / ARCHIVE_HASH_SIZE;
+	// A crash may leave half a sector in the pool, or hashes of sectors
+	// that never got there
+	if (ftell(pool) != count * BYTES_PER_SECTOR &&
+			archiveTruncate(pool, count * BYTES_PER_SECTOR) < 0) {
+		return -1;
+	}
+	if (n > count) {
+		n = count;
+	}
+	if (ftell(hash) != n * ARCHIVE_HASH_SIZE &&
+			archiveTruncate(hash, n * ARCHIVE_HASH_SIZE) < 0) {
+		return -1;
+	}
+	// Pools only grow, a shorter one has been replaced since
+	if (count < idx->count) {
+		archiveIndexReset(idx);
+	}
+	k = (idx->count < n) ? idx->count : n;
+	fseek(hash, k * ARCHIVE_HASH_SIZE, SEEK_SET);
+	for (; k < n; k++) {
+		if (fread(buf, 1, ARCHIVE_HASH_SIZE, hash) != ARCHIVE_HASH_SIZE ||
+				archiveIndexAdd(idx, getLe(buf, ARCHIVE_HASH_SIZE), k + 1) < 0) {
+			return -1;
+		}
+	}
+	// Sectors stored by a run that didn't get to write their hashes
+	for (; k < count; k++) {
+		if (!archiveReadRef(pool, k + 1, buf) || (k >= idx->count &&
+				archiveIndexAdd(idx, archiveHash(buf), k + 1) < 0)) {
+			return -1;
+		}
+		putLe(buf, archiveHash(buf), ARCHIVE_HASH_SIZE);
+		fseek(hash, 0, SEEK_END);
+		if (fwrite(buf, 1, ARCHIVE_HASH_SIZE, hash) != ARCHIVE_HASH_SIZE) {
+			return -1;
+		}
+	}
+	idx->count = count;
+	return count;
+}
+
+// Public functions
+
+/*****************************************************************************/
+int archiveProbe(const unsigned char *head, int headLen) {
+	return headLen >= 4 && 0 == memcmp(head, archiveMagic, 4);
+}
+
+/*****************************************************************************/
+int archiveOpen(struct Sarchive *ar, const char *filename, FILE *f,
+		FILE *err) {
+	unsigned char	head[ARCHIVE_HEADER_SIZE], ref[4];
+	int				i;
+
+	memset(ar, 0, sizeof(*ar));
+	fseek(f, 0, SEEK_SET);
+	if (fread(head, 1, sizeof(head), f) != sizeof(head) ||
+			head[4] != ARCHIVE_VERSION || head[6] < 1 ||
+			head[6] > MAX_TRACKS || head[7] < 1 ||
+			head[7] > MAX_SECTORS_PER_TRACK) {
+		fprintf(err, "Error: invalid archived image header\n");
+		return -1;
+	}
+	ar->tracks = head[6];
+	ar->sectors = head[7];
+	for (i = 0; i < ar->tracks * ar->sectors; i++) {
+		if (fread(ref, 1, sizeof(ref), f) != sizeof(ref)) {
+			fprintf(err, "Error: archived image too short\n");
+			return -1;
+		}
+		ar->refs[i] = getLe(ref, sizeof(ref));
+	}
+	archiveSetDir(ar, filename);
+	ar->open = 1;
+	return 0;
+}
+
+/*****************************************************************************/
+int archiveCreate(struct Sarchive *ar, const char *filename, int tracks,
+		int sectors) {
+	memset(ar, 0, sizeof(*ar));
+	ar->tracks = tracks;
+	ar->sectors = sectors;
+	archiveSetDir(ar, filename);
+	ar->open = 1;
+	return 0;
+}
+
+/*****************************************************************************/
+long archiveReadTrack(struct Sarchive *ar, int track, unsigned char *data,
+		FILE *err) {
+	char	path[ARCHIVE_PATH_MAX];
+	long	bytes = 0;
+	int		s, i, run;
+
+	for (s = 0; s < ar->sectors; s += run) {
+		run = 1;
+		i = track * ar->sectors + s;
+		if (track >= ar->tracks || ar->refs[i] == 0) {
+			memset(data + s * BYTES_PER_SECTOR, 0, BYTES_PER_SECTOR);
+			continue;
+		}
+		// The pool is opened the first time a sector is needed from it
+		if (NULL == ar->pool) {
+			archivePath(path, ar, ARCHIVE_POOL_NAME);
+			ar->pool = fopen(path, "rb");
+			if (NULL == ar->pool) {
+				fprintf(err, "Error opening archive pool: %s\n", path);
+				return -1;
+			}
+		}
+		// Sectors archived together are usually next to each other
+		while (s + run < ar->sectors &&
+				ar->refs[i + run] == ar->refs[i] + run) {
+			++run;
+		}
+		fseek(ar->pool, (long)(ar->refs[i] - 1) * BYTES_PER_SECTOR,
+			SEEK_SET);
+		if (fread(data + s * BYTES_PER_SECTOR, 1, run * BYTES_PER_SECTOR,
+				ar->pool) != (size_t)run * BYTES_PER_SECTOR) {
+			fprintf(err, "Error: archive pool too short\n");
+			return -1;
+		}
+		bytes += run * BYTES_PER_SECTOR;
+	}
+	return bytes;
+}
+
+/*****************************************************************************/
+long archiveStore(struct Sarchive *ar, const unsigned char *data,
+		const unsigned char *dirty, int tracks, int sectors, int all,
+		int sync, FILE *err) {
+	char					path[ARCHIVE_PATH_MAX];
+	unsigned char			buf[BYTES_PER_SECTOR];
+	const unsigned char		*p;
+	struct SarchiveIndex	*idx = NULL;
+	unsigned long long		key;
+	unsigned int			ref, j;
+	FILE					*pool = NULL, *hash = NULL;
+	long					count = 0, bytes = 0;
+	int						i, need = 0;
+
+	for (i = 0; i < tracks * sectors && !need; i++) {
+		need = (all || dirty[i]) &&
+			memcmp(data + i * BYTES_PER_SECTOR, zeroSector, BYTES_PER_SECTOR);
+	}
+	if (need) {
+		// Stores of this process go one at a time, before the file lock
+		idx = archiveIndexGet(ar);
+		if (NULL == idx) {
+			fprintf(err, "Error allocating archive index\n");
+			return -1;
+		}
+		pthread_mutex_lock(&idx->lock);
+		archivePath(path, ar, ARCHIVE_POOL_NAME);
+		pool = fopen(path, "a+b");
+		archivePath(path, ar, ARCHIVE_HASH_NAME);
+		hash = fopen(path, "a+b");
+		if (NULL == pool || NULL == hash) {
+			fprintf(err, "Error opening archive pool in %s\n", ar->dir);
+			bytes = -1;
+			goto out;
+		}
+#ifndef _WIN32
+		// Images of one archive may be written by several threads or
+		// processes at once, each one appends under the lock
+		flock(fileno(pool), LOCK_EX);
+#endif
+		count = archiveIndexLoad(idx, pool, hash);
+		if (count < 0) {
+			fprintf(err, "Error reading archive pool in %s\n", ar->dir);
+			bytes = -1;
+			goto out;
+		}
+	}
+	for (i = 0; i < tracks * sectors; i++) {
+		if (!all && !dirty[i]) {
+			continue;
+		}
+		p = data + i * BYTES_PER_SECTOR;
+		if (0 == memcmp(p, zeroSector, BYTES_PER_SECTOR)) {
+			ar->refs[i] = 0;
+			continue;
+		}
+		key = archiveHash(p);
+		ref = 0;
+		for (j = key & idx->mask; NULL != idx->refs && idx->refs[j] != 0;
+				j = (j + 1) & idx->mask) {
+			if (idx->keys[j] == key &&
+					archiveReadRef(pool, idx->refs[j], buf) &&
+					0 == memcmp(p, buf, BYTES_PER_SECTOR)) {
+				ref = idx->refs[j];
+				break;
+			}
+		}
+		if (ref == 0) {
+			putLe(buf, key, ARCHIVE_HASH_SIZE);
+			fseek(pool, 0, SEEK_END);
+			fseek(hash, 0, SEEK_END);
+			if (fwrite(p, 1, BYTES_PER_SECTOR, pool) != BYTES_PER_SECTOR ||
+					fwrite(buf, 1, ARCHIVE_HASH_SIZE, hash) !=
+					ARCHIVE_HASH_SIZE ||
+					archiveIndexAdd(idx, key, count + 1) < 0) {
+				fprintf(err, "Error writing archive pool in %s\n", ar->dir);
+				bytes = -1;
+				goto out;
+			}
+			ref = ++count;
+			idx->count = count;
+			bytes += BYTES_PER_SECTOR + ARCHIVE_HASH_SIZE;
+		}
+		ar->refs[i] = ref;
+	}
+	// The pool is on disk before any image refers to what was added
+	if (need && (archiveSync(pool, sync) < 0 || archiveSync(hash, sync) < 0)) {
+		fprintf(err, "Error writing archive pool in %s\n", ar->dir);
+		bytes = -1;
+	}
+	ar->tracks = tracks;
+	ar->sectors = sectors;
+out:
+	if (NULL != pool) {
+		fclose(pool);
+	}
+	if (NULL != hash) {
+		fclose(hash);
+	}
+	if (NULL != idx) {
+		// Not sure what got to the pool, read it all again next time
+		if (bytes < 0) {
+			archiveIndexReset(idx);
+		}
+		pthread_mutex_unlock(&idx->lock);
+	}
+	return bytes;
+}
+
+/*****************************************************************************/
+long archiveWrite(struct Sarchive *ar, FILE *f) {
+	unsigned char	head[ARCHIVE_HEADER_SIZE], ref[4];
+	int				i;
+
+	memset(head, 0, sizeof(head));
+	memcpy(head, archiveMagic, 4);
+	head[4] = ARCHIVE_VERSION;
+	head[6] = ar->tracks;
+	head[7] = ar->sectors;
+	if (fwrite(head, 1, sizeof(head), f) != sizeof(head)) {
+		return -1;
+	}
+	for (i = 0; i < ar->tracks * ar->sectors; i++) {
+		putLe(ref, ar->refs[i], sizeof(ref));
+		if (fwrite(ref, 1, sizeof(ref), f) != sizeof(ref)) {
+			return -1;
+		}
+	}
+	return sizeof(head) + (long)ar->tracks * ar->sectors * sizeof(ref);
+}
+
+/*****************************************************************************/
+void archiveFree(struct Sarchive *ar) {
+	if (NULL != ar->pool) {
+		fclose(ar->pool);
+		ar->pool = NULL;
+	}
+}
@@ -0,0 +1,288 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include "compress.h"
+
+// Defines
+#define COMPRESS_CHUNK 65536
+#define COMPRESS_MIN_SIZE (256 * 1024)
+#define COMPRESS_MAX_HINT (64L * 1024 * 1024)
+#define ZLIB_WINDOW 15
+#define GZIP_WINDOW (ZLIB_WINDOW + 16)
+#define AUTO_WINDOW (ZLIB_WINDOW + 32)
+
+// Structs
+struct Scompress {
+    int             kind;
+    int             done;
+    FILE            *file;
+    FILE            *err;
+    z_stream        zs;
+    unsigned char   in[COMPRESS_CHUNK];
+    unsigned char   *data;
+    long            size;
+    long            filled;
+};
+
+// Private functions
+
+/*****************************************************************************/
+static int compressGrow(struct Scompress *z) {
+	unsigned char *data;
+
+	data = (unsigned char *)realloc(z->data, z->size * 2);
+	if (NULL == data) {
+		fprintf(z->err, "Error allocating image buffer\n");
+		return -1;
+	}
+	z->data = data;
+	z->size *= 2;
+	return 0;
+}
+
+/*****************************************************************************/
+static int compressInput(struct Scompress *z) {
+	size_t n;
+
+	if (z->zs.avail_in > 0) {
+		return 1;
+	}
+	n = fread(z->in, 1, sizeof(z->in), z->file);
+	if (n == 0 && ferror(z->file)) {
+		fprintf(z->err, "Error on I/O\n");
+		return -1;
+	}
+	z->zs.next_in = z->in;
+	z->zs.avail_in = n;
+	return n > 0;
+}
+
+/*****************************************************************************/
+static int compressFill(struct Scompress *z, long upto) {
+	int r;
+
+	// Inflated only up to what has been asked for, a catalog is read
+	// without going through the tracks after it
+	while (!z->done && (upto < 0 || z->filled < upto)) {
+		if (z->filled == z->size && compressGrow(z) < 0) {
+			return -1;
+		}
+		r = compressInput(z);
+		if (r < 0) {
+			return -1;
+		}
+		if (r == 0) {
+			fprintf(z->err, "Error: compressed image is truncated\n");
+			return -1;
+		}
+		z->zs.next_out = z->data + z->filled;
+		z->zs.avail_out = z->size - z->filled;
+		r = inflate(&z->zs, Z_NO_FLUSH);
+		z->filled = z->size - z->zs.avail_out;
+		if (r == Z_STREAM_END) {
+			// gzip allows several members one after the other
+			r = compressInput(z);
+			if (r < 0) {
+				return -1;
+			}
+			if (r == 0 || z->kind != COMPRESS_GZIP || z->zs.next_in[0] != 0x1F) {
+				z->done = 1;
+			} else {
+				inflateReset(&z->zs);
+			}
+		} else if (r != Z_OK && r != Z_BUF_ERROR) {
+			fprintf(z->err, "Error: compressed image is corrupt\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Public functions
+
+/*****************************************************************************/
+int compressProbe(const unsigned char *head, int headLen) {
+	unsigned char	out[COMPRESS_PROBE_SIZE * 8];
+	z_stream		zs;
+	int				r;
+
+	if (headLen >= 3 && head[0] == 0x1F && head[1] == 0x8B && head[2] == 8) {
+		return COMPRESS_GZIP;
+	}
+	// Deflate with a window of 32K at most and a valid check value, then
+	// the start of the stream has to inflate, a boot sector rarely does
+	if (headLen >= 2 && (head[0] & 0x8F) == 0x08 && (head[0] >> 4) <= 7 &&
+			((head[0] << 8) | head[1]) % 31 == 0) {
+		memset(&zs, 0, sizeof(zs));
+		if (inflateInit2(&zs, ZLIB_WINDOW) != Z_OK) {
+			return COMPRESS_NONE;
+		}
+		zs.next_in = (unsigned char *)head;
+		zs.avail_in = headLen;
+		zs.next_out = out;
+		zs.avail_out = sizeof(out);
+		r = inflate(&zs, Z_NO_FLUSH);
+		inflateEnd(&zs);
+		if (r == Z_OK || r == Z_STREAM_END || r == Z_BUF_ERROR) {
+			return COMPRESS_ZLIB;
+		}
+	}
+	return COMPRESS_NONE;
+}
+
+/*****************************************************************************/
+int compressExtension(const char *filename) {
+	const char *dot = strrchr(filename, '.');
+
+	if (NULL != dot && 0 == strcasecmp(dot, ".gz")) {
+		return COMPRESS_GZIP;
+	}
+	if (NULL != dot && 0 == strcasecmp(dot, ".zlib")) {
+		return COMPRESS_ZLIB;
+	}
+	return COMPRESS_NONE;
+}
+
+/*****************************************************************************/
+struct Scompress *compressOpen(FILE *f, int kind, FILE *err) {
+	struct Scompress	*z;
+	unsigned char		tail[4];
+	long				hint = 0;
+
+	z = (struct Scompress *)calloc(1, sizeof(struct Scompress));
+	if (NULL == z) {
+		fprintf(err, "Error allocating image buffer\n");
+		return NULL;
+	}
+	z->kind = kind;
+	z->file = f;
+	z->err = err;
+	// A gzip trailer tells the size of its data
+	if (kind == COMPRESS_GZIP && fseek(f, -4, SEEK_END) == 0 &&
+			fread(tail, 1, sizeof(tail), f) == sizeof(tail)) {
+		hint = tail[0] | (tail[1] << 8) | (tail[2] << 16) |
+			((long)tail[3] << 24);
+	}
+	z->size = (hint > COMPRESS_MIN_SIZE && hint < COMPRESS_MAX_HINT) ?
+		hint : COMPRESS_MIN_SIZE;
+	z->data = (unsigned char *)malloc(z->size);
+	if (NULL == z->data || inflateInit2(&z->zs, AUTO_WINDOW) != Z_OK) {
+		fprintf(err, "Error allocating image buffer\n");
+		free(z->data);
+		free(z);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_SET);
+	return z;
+}
+
+/*****************************************************************************/
+long compressRead(struct Scompress *z, long pos, unsigned char *data,
+		long len) {
+	if (compressFill(z, pos + len) < 0) {
+		return -1;
+	}
+	if (pos >= z->filled) {
+		return 0;
+	}
+	if (len > z->filled - pos) {
+		len = z->filled - pos;
+	}
+	memcpy(data, z->data + pos, len);
+	return len;
+}
+
+/*****************************************************************************/
+FILE *compressStream(struct Scompress *z) {
+	FILE *f;
+
+	// For the kinds of image that are parsed from a file as a whole
+	if (compressFill(z, -1) < 0) {
+		return NULL;
+	}
+#ifdef _WIN32
+	f = tmpfile();
+	if (NULL != f && (fwrite(z->data, 1, z->filled, f) != (size_t)z->filled ||
+			fseek(f, 0, SEEK_SET) != 0)) {
+		fclose(f);
+		f = NULL;
+	}
+#else
+	// The buffer is never empty, it is at least COMPRESS_MIN_SIZE
+	f = fmemopen(z->data, z->filled ? z->filled : 1, "rb");
+#endif
+	if (NULL == f) {
+		fprintf(z->err, "Error allocating image buffer\n");
+	}
+	return f;
+}
+
+/*****************************************************************************/
+int compressWrite(int kind, FILE *f, const unsigned char *data, long size,
+		FILE *err) {
+	unsigned char	out[COMPRESS_CHUNK];
+	z_stream		zs;
+	size_t			n;
+	int				r;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			(kind == COMPRESS_GZIP) ? GZIP_WINDOW : ZLIB_WINDOW, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		fprintf(err, "Error allocating image buffer\n");
+		return -1;
+	}
+	zs.next_in = (unsigned char *)data;
+	zs.avail_in = size;
+	do {
+		zs.next_out = out;
+		zs.avail_out = sizeof(out);
+		r = deflate(&zs, Z_FINISH);
+		n = sizeof(out) - zs.avail_out;
+		if (n > 0 && fwrite(out, 1, n, f) != n) {
+			r = Z_ERRNO;
+		}
+	} while (r == Z_OK);
+	deflateEnd(&zs);
+	if (r != Z_STREAM_END) {
+		fprintf(err, "Error on I/O\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+void compressFree(struct Scompress *z) {
+	if (NULL == z) {
+		return;
+	}
+	inflateEnd(&z->zs);
+	if (NULL != z->file) {
+		fclose(z->file);
+	}
+	free(z->data);
+	free(z);
+}
@@ -0,0 +1,3095 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * 
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>    /* toupper() */
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "dos33.h"
+#include "utils.h"
+#include "image.h"
+#include "dos33lib.h"
+
+// Enums
+/* Owner of a sector while VERIFY walks the disk, files are their catalog
+ * position + 1 */
+enum {
+	VERIFY_FREE = 0,
+	VERIFY_VTOC = -1,
+	VERIFY_CATALOG = -2,
+};
+
+/* What SCAN and RECOVER know of each sector */
+enum {
+	RECOVER_USED = 1,
+	RECOVER_TSL = 2,
+	RECOVER_LINKED = 4,
+};
+
+// Structs
+struct SsaveItem {
+	char		hostFilename[FILENAME_MAX];
+	char		appleFilename[FILENAME_MAX];
+	char		type;
+	int			address;
+	int			length;
+	int			dataSectors;
+	int			catPos;
+	int			unchanged;
+	struct Sts	oldTsList;
+	char		*buffer;
+};
+
+struct SloadItem {
+	char		outputFilename[FILENAME_MAX];
+	int			type;
+	int			numSectors;
+	struct Sts	*sectors;
+};
+
+struct SloadPool {
+	pthread_mutex_t		lock;
+	unsigned long		dataReads;
+	struct Sdos33		*d;
+	struct SloadItem	*items;
+	int					count;
+	int					next;
+	int					errors;
+};
+
+/* Run of adjacent sectors on one track */
+struct Sextent {
+	int			track;
+	int			sector;
+	int			count;
+};
+
+/* Output of a command gathered to be written at once */
+struct Sbuffer {
+	char		*data;
+	size_t		len;
+	size_t		size;
+	int			failed;
+};
+
+// Private functions
+
+/*****************************************************************************/
+static void statsTakeImage(struct Sdos33 *d) {
+	d->stats.image.hits += d->image.stats.hits;
+	d->stats.image.misses += d->image.stats.misses;
+	d->stats.image.flushed += d->image.stats.flushed;
+	d->stats.image.seeks += d->image.stats.seeks;
+	d->stats.image.bytesRead += d->image.stats.bytesRead;
+	d->stats.image.bytesWritten += d->image.stats.bytesWritten;
+	memset(&d->image.stats, 0, sizeof(d->image.stats));
+}
+
+/*****************************************************************************/
+static unsigned char *dos33ReadSector(struct Sdos33 *d, int kind, int track,
+		int sector) {
+	++d->stats.reads[kind];
+	return imageSector(&d->image, track, sector);
+}
+
+/*****************************************************************************/
+static unsigned char *dos33WriteSector(struct Sdos33 *d, int kind, int track,
+		int sector) {
+	++d->stats.writes[kind];
+	return imageSectorW(&d->image, track, sector);
+}
+
+/*****************************************************************************/
+static int dos33ReadVtoc(struct Sdos33 *d) {
+	memcpy(&d->vtoc, dos33ReadSector(d, SECTOR_VTOC, VTOC_TRACK, VTOC_SECTOR),
+		sizeof(d->vtoc));
+	// Clear catalog entry
+	memset(&d->catEntry, 0, sizeof(d->catEntry));
+	return 0;
+}
+
+/*****************************************************************************/
+static int dos33SaveVtoc(struct Sdos33 *d) {
+	// An unchanged VTOC is not written again
+	if (memcmp(dos33ReadSector(d, SECTOR_VTOC, VTOC_TRACK, VTOC_SECTOR),
+			&d->vtoc, sizeof(d->vtoc)) != 0) {
+		memcpy(dos33WriteSector(d, SECTOR_VTOC, VTOC_TRACK, VTOC_SECTOR),
+			&d->vtoc, sizeof(d->vtoc));
+	}
+	// Clear catalog entry
+	memset(&d->catEntry, 0, sizeof(d->catEntry));
+	return 0;
+}
+
+/*****************************************************************************/
+static void dos33AllocTs(struct Sdos33 *d, int track, int sector) {
+	int bit;
+
+	// A broken T/S list must not write outside the bitmap
+	if (imageOffset(&d->image, track, sector) < 0) {
+		return;
+	}
+	// Each track is a big endian 32 bit mask, sectors are left aligned
+	bit = 32 - d->image.sectors + sector;
+	d->vtoc.bitmap[track][3 - bit / 8] &= ~(1 << (bit % 8));
+}
+
+/*****************************************************************************/
+static void dos33ReleaseTs(struct Sdos33 *d, int track, int sector) {
+	int bit;
+
+	if (imageOffset(&d->image, track, sector) < 0) {
+		return;
+	}
+	bit = 32 - d->image.sectors + sector;
+	d->vtoc.bitmap[track][3 - bit / 8] |= 1 << (bit % 8);
+}
+
+/*****************************************************************************/
+static unsigned int dos33BitmapMask(struct Sdos33 *d, int track) {
+	unsigned char *b = d->vtoc.bitmap[track];
+
+	// Bit n set means sector n free
+	return (((unsigned int)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3]) >>
+		(32 - d->image.sectors);
+}
+
+/*****************************************************************************/
+static unsigned int dos33TrackFree(struct Sdos33 *d, int track) {
+	++d->stats.bitmapScans;
+	return dos33BitmapMask(d, track);
+}
+
+/*****************************************************************************/
+static int dos33GetFreeSpace(struct Sdos33 *d) {
+	int i, sectors_free = 0;
+
+	for(i = 0; i < d->image.tracks; i++) {
+		sectors_free += __builtin_popcount(dos33TrackFree(d, i));
+	}
+
+	return sectors_free * BYTES_PER_SECTOR;
+}
+
+/*****************************************************************************/
+static int dos33AllocRuns(struct Sdos33 *d, int track, int count,
+		struct Sextent *ext) {
+	unsigned int	free;
+	int				s, len, bestStart, bestLen, n = 0;
+
+	free = dos33TrackFree(d, track);
+	while (count > 0) {
+		// Smallest run that holds everything, otherwise the longest one
+		bestStart = -1;
+		bestLen = 0;
+		for (s = 0; s < d->image.sectors; s += len ? len : 1) {
+			for (len = 0; s + len < d->image.sectors &&
+					(free & (1u << (s + len))); len++)
+				;
+			if (len == 0) {
+				continue;
+			}
+			if ((len >= count && (bestLen < count || len < bestLen)) ||
+					(bestLen < count && len > bestLen)) {
+				bestStart = s;
+				bestLen = len;
+			}
+		}
+		if (bestLen > count) {
+			bestLen = count;
+		}
+		ext[n].track = track;
+		ext[n].sector = bestStart;
+		ext[n].count = bestLen;
+		for (s = bestStart; s < bestStart + bestLen; s++) {
+			dos33AllocTs(d, track, s);
+			free &= ~(1u << s);
+		}
+		count -= bestLen;
+		++n;
+	}
+	return n;
+}
+
+/*****************************************************************************/
+static int dos33AllocExtents(struct Sdos33 *d, struct Sextent *ext,
+		int count) {
+	int order[MAX_TRACKS], freeCount[MAX_TRACKS];
+	char seen[MAX_TRACKS];
+	int i, t, n, numTracks, want, take, total, startTrack, steps;
+	int tracks = d->image.tracks;
+	char trackDir;
+
+	// Originally used to keep things near center of disk for speed
+	// We can use to avoid fragmentation possibly
+	startTrack = (unsigned char)d->vtoc.lastAllocTrack % tracks;
+	trackDir = d->vtoc.allocDirection;
+
+	if ((trackDir != 1) && (trackDir != -1)) {
+		fprintf(d->err,"ERROR! Invalid track dir %i\n", trackDir);
+		return DOS33_ERR_CORRUPT;
+	}
+
+	if (((startTrack > VTOC_TRACK) && (trackDir != 1)) ||
+		((startTrack < VTOC_TRACK) && (trackDir != -1))) {
+		fprintf(d->err,
+			"Warning! Non-optimal values for track dir t=%i d=%i!\n",
+			startTrack, trackDir);
+	}
+
+	// Tracks in the order DOS visits them, handling overflows
+	memset(seen, 0, sizeof(seen));
+	numTracks = 0;
+	total = 0;
+	steps = 0;
+	t = startTrack;
+	do {
+		if (!seen[t]) {
+			seen[t] = 1;
+			order[numTracks++] = t;
+			freeCount[t] = __builtin_popcount(dos33TrackFree(d, t));
+			total += freeCount[t];
+		}
+		t += trackDir;
+		if (t < 0) {
+			t = VTOC_TRACK;
+			trackDir = 1;
+		}
+		if (t >= tracks) {
+			t = VTOC_TRACK;
+			trackDir = -1;
+		}
+	} while (numTracks < tracks && ++steps < 3 * tracks);
+	if (total < count) {
+		fprintf(d->err, "No room left!\n");
+		return DOS33_ERR_FULL;
+	}
+
+	// Fill whole tracks first and put a tail on the first track that
+	// holds it, so a file spans as few tracks as possible
+	n = 0;
+	while (count > 0) {
+		want = (count < d->image.sectors) ? count : d->image.sectors;
+		t = -1;
+		for (i = 0; i < numTracks; i++) {
+			if (freeCount[order[i]] >= want) {
+				t = order[i];
+				break;
+			}
+			if (freeCount[order[i]] > 0 &&
+					(t < 0 || freeCount[order[i]] > freeCount[t])) {
+				t = order[i];
+			}
+		}
+		take = (freeCount[t] < count) ? freeCount[t] : count;
+		n += dos33AllocRuns(d, t, take, &ext[n]);
+		freeCount[t] -= take;
+		count -= take;
+		/* store new track/direction info */
+		d->vtoc.lastAllocTrack = t;
+		if (t > VTOC_TRACK) {
+			d->vtoc.allocDirection = 1;
+		} else {
+			d->vtoc.allocDirection = -1;
+		}
+	}
+	return n;
+}
+
+/*****************************************************************************/
+static int dos33AllocSectors(struct Sdos33 *d, struct Sts *list, int count) {
+	struct Sextent	*ext;
+	int				i, j, n, numExt;
+
+	if (count == 0) {
+		return DOS33_OK;
+	}
+	ext = (struct Sextent *)malloc(count * sizeof(struct Sextent));
+	if (NULL == ext) {
+		fprintf(d->err, "Error allocating memory\n");
+		return DOS33_ERR_MEMORY;
+	}
+	numExt = dos33AllocExtents(d, ext, count);
+	n = 0;
+	for (i = 0; i < numExt; i++) {
+		for (j = 0; j < ext[i].count; j++) {
+			list[n].track = ext[i].track;
+			list[n].sector = ext[i].sector + j;
+			++n;
+		}
+	}
+	free(ext);
+	return (numExt < 0) ? numExt : DOS33_OK;
+}
+
+/*****************************************************************************/
+static int dos33Visit(struct Sdos33 *d, unsigned char *visited,
+		struct Sts ts) {
+	int off = imageOffset(&d->image, ts.track, ts.sector);
+
+	// Outside the disk is left to the read, which reports it
+	if (off < 0) {
+		return 1;
+	}
+	off /= BYTES_PER_SECTOR;
+	if (visited[off / 8] & (1 << (off % 8))) {
+		fprintf(d->err, "Error: chain loops at %02X/%02X\n", ts.track,
+			ts.sector);
+		++d->image.invalid;
+		return 0;
+	}
+	visited[off / 8] |= 1 << (off % 8);
+	return 1;
+}
+
+/*****************************************************************************/
+static int dos33GetNextCatEntry(struct Sdos33 *d) {
+	unsigned char			*sector;
+	struct ScatalogHeader	*header;
+
+	if (d->catEntry.actTs.track == 0 ||
+			d->catEntry.entryNum == CATALOG_ENTRIES) {
+		if (d->catEntry.entryNum == CATALOG_ENTRIES) {
+			// Last entry of the last catalog sector
+			if (d->catEntry.nextTs.track == 0) {
+				return 0;
+			}
+			d->catEntry.actTs.track = d->catEntry.nextTs.track;
+			d->catEntry.actTs.sector = d->catEntry.nextTs.sector;
+		} else {
+			d->catEntry.actTs.track = d->vtoc.catalog.track;
+			d->catEntry.actTs.sector = d->vtoc.catalog.sector;
+		}
+		if (!dos33Visit(d, d->catEntry.visited, d->catEntry.actTs)) {
+			return 0;
+		}
+		header = (struct ScatalogHeader *)dos33ReadSector(d, SECTOR_CATALOG,
+			d->catEntry.actTs.track, d->catEntry.actTs.sector);
+		d->catEntry.nextTs.track = header->nextTs.track;
+		d->catEntry.nextTs.sector = header->nextTs.sector;
+		d->catEntry.entryNum = 0;
+	}
+	sector = dos33ReadSector(d, SECTOR_CATALOG, d->catEntry.actTs.track,
+		d->catEntry.actTs.sector);
+	memcpy(&d->catEntry.fileEntry, sector + sizeof(struct ScatalogHeader) +
+		d->catEntry.entryNum * sizeof(struct SfileEntry),
+		sizeof(d->catEntry.fileEntry));
+	++d->catEntry.entryNum;
+	++d->stats.catEntries;
+	if (d->catEntry.fileEntry.TsList.track == 0) {
+		return 0;
+	}
+	return 1;
+}
+
+/*****************************************************************************/
+static char *dos33EntryName(char *name, struct SfileEntry *entry) {
+	int i, nl;
+
+	nl = FILE_NAME_SIZE;
+	if (entry->TsList.track == 0xFF) {
+		--nl;
+	}
+	dos33FilenameToAscii(name, entry->name, nl);
+	// convert inverse chars
+	for(i = 0; name[i] != '\0'; i++) {
+		if (name[i] < 0x20) {
+			name[i] += 0x40;
+		}
+	}
+	return name;
+}
+
+/*****************************************************************************/
+static unsigned int catIndexHash(const char *name) {
+	unsigned int h = 2166136261u;
+
+	// FNV-1a over the lower case name, lookups are case insensitive
+	while (*name) {
+		h ^= (unsigned char)tolower((unsigned char)*name++);
+		h *= 16777619u;
+	}
+	return h & (CAT_HASH_SIZE - 1);
+}
+
+/*****************************************************************************/
+static struct SfileEntry *catIndexEntry(struct Sdos33 *d, int pos) {
+	return (struct SfileEntry *)(dos33ReadSector(d, SECTOR_CATALOG,
+		d->catIndex.slots[pos].ts.track, d->catIndex.slots[pos].ts.sector) +
+		sizeof(struct ScatalogHeader) +
+		d->catIndex.slots[pos].slot * sizeof(struct SfileEntry));
+}
+
+/*****************************************************************************/
+static void catIndexReset(struct Sdos33 *d) {
+	int failed = d->catIndex.failed;
+
+	// A failed build is told until the image is discarded
+	free(d->catIndex.slots);
+	free(d->catIndex.freeMap);
+	memset(&d->catIndex, 0, sizeof(d->catIndex));
+	d->catIndex.failed = failed;
+}
+
+/*****************************************************************************/
+static void catIndexUnlink(struct Sdos33 *d, int pos) {
+	int *p;
+
+	p = &d->catIndex.buckets[catIndexHash(d->catIndex.slots[pos].name)];
+	while (*p != 0) {
+		if (*p - 1 == pos) {
+			*p = d->catIndex.slots[pos].next;
+			return;
+		}
+		p = &d->catIndex.slots[*p - 1].next;
+	}
+}
+
+/*****************************************************************************/
+static void catIndexUpdate(struct Sdos33 *d, int pos) {
+	struct ScatSlot		*cs = &d->catIndex.slots[pos];
+	struct SfileEntry	*entry = catIndexEntry(d, pos);
+	unsigned int		h;
+
+	if (cs->state != CAT_FREE) {
+		catIndexUnlink(d, pos);
+	}
+	if (entry->TsList.track == 0) {
+		cs->state = CAT_FREE;
+	} else if (entry->TsList.track == 0xFF) {
+		cs->state = CAT_DELETED;
+	} else {
+		cs->state = CAT_LIVE;
+	}
+	// Deleted entries are free for new files but keep their name
+	if (cs->state == CAT_LIVE) {
+		d->catIndex.freeMap[pos / 32] &= ~(1u << (pos % 32));
+	} else {
+		d->catIndex.freeMap[pos / 32] |= 1u << (pos % 32);
+	}
+	if (cs->state != CAT_FREE) {
+		dos33EntryName(cs->name, entry);
+		h = catIndexHash(cs->name);
+		cs->next = d->catIndex.buckets[h];
+		d->catIndex.buckets[h] = pos + 1;
+	}
+}
+
+/*****************************************************************************/
+static int catIndexBuild(struct Sdos33 *d) {
+	struct Sts				ts;
+	struct ScatalogHeader	*header;
+	int						e, off, guard = 0;
+	int						numSectors = d->image.tracks * d->image.sectors;
+
+	catIndexReset(d);
+	memset(d->catIndex.sectorPos, 0xFF, sizeof(d->catIndex.sectorPos));
+	d->catIndex.slots = (struct ScatSlot *)calloc(
+		numSectors * CATALOG_ENTRIES, sizeof(struct ScatSlot));
+	d->catIndex.freeMap = (unsigned int *)calloc(
+		(numSectors * CATALOG_ENTRIES + 31) / 32, sizeof(unsigned int));
+	if (NULL == d->catIndex.slots || NULL == d->catIndex.freeMap) {
+		fprintf(d->err, "Error allocating memory\n");
+		// Left empty, lookups find nothing and the command fails
+		catIndexReset(d);
+		d->catIndex.failed = 1;
+		return DOS33_ERR_MEMORY;
+	}
+	ts = d->vtoc.catalog;
+	// Each catalog sector is visited once, a loop in the chain ends it
+	while (ts.track != 0 && guard++ < numSectors) {
+		off = imageOffset(&d->image, ts.track, ts.sector);
+		if (off < 0) {
+			fprintf(d->err, "Error: catalog sector %02X/%02X outside the disk\n",
+				ts.track, ts.sector);
+			++d->image.invalid;
+			break;
+		}
+		if (d->catIndex.sectorPos[off / BYTES_PER_SECTOR] >= 0) {
+			break;
+		}
+		d->catIndex.sectorPos[off / BYTES_PER_SECTOR] = d->catIndex.numSlots;
+		for (e = 0; e < CATALOG_ENTRIES; e++) {
+			d->catIndex.slots[d->catIndex.numSlots].ts = ts;
+			d->catIndex.slots[d->catIndex.numSlots].slot = e;
+			catIndexUpdate(d, d->catIndex.numSlots++);
+		}
+		d->stats.catEntries += CATALOG_ENTRIES;
+		header = (struct ScatalogHeader *)dos33ReadSector(d, SECTOR_CATALOG,
+			ts.track, ts.sector);
+		ts = header->nextTs;
+	}
+	d->catIndex.built = 1;
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int catIndexFind(struct Sdos33 *d, char *filename, int file_deleted) {
+	int pos, found = -1;
+
+	if (!d->catIndex.built) {
+		catIndexBuild(d);
+	}
+	pos = d->catIndex.buckets[catIndexHash(filename)];
+	while (pos != 0) {
+		--pos;
+		if (d->catIndex.slots[pos].state ==
+				(file_deleted ? CAT_DELETED : CAT_LIVE)
+				&& 0 == strcasecmp(filename, d->catIndex.slots[pos].name)) {
+			// First one in catalog order wins
+			if (found < 0 || pos < found) {
+				found = pos;
+			}
+		}
+		pos = d->catIndex.slots[pos].next;
+	}
+	return found;
+}
+
+/*****************************************************************************/
+static int catIndexFindFree(struct Sdos33 *d) {
+	int i;
+
+	if (!d->catIndex.built) {
+		catIndexBuild(d);
+	}
+	for (i = 0; i * 32 < d->catIndex.numSlots; i++) {
+		if (d->catIndex.freeMap[i] != 0) {
+			return i * 32 + __builtin_ctz(d->catIndex.freeMap[i]);
+		}
+	}
+	return -1;
+}
+
+/*****************************************************************************/
+static int catIndexCountFree(struct Sdos33 *d) {
+	int i, n = 0;
+
+	if (!d->catIndex.built) {
+		catIndexBuild(d);
+	}
+	for (i = 0; i * 32 < d->catIndex.numSlots; i++) {
+		n += __builtin_popcount(d->catIndex.freeMap[i]);
+	}
+	return n;
+}
+
+/*****************************************************************************/
+static void dos33WriteCatEntry(struct Sdos33 *d, int pos,
+		struct SfileEntry *entry) {
+	if (memcmp(catIndexEntry(d, pos), entry, sizeof(*entry)) == 0) {
+		return;
+	}
+	memcpy(catIndexEntry(d, pos), entry, sizeof(*entry));
+	dos33WriteSector(d, SECTOR_CATALOG, d->catIndex.slots[pos].ts.track,
+		d->catIndex.slots[pos].ts.sector);
+	catIndexUpdate(d, pos);
+}
+
+/*****************************************************************************/
+static void dos33LoadCatEntry(struct Sdos33 *d, int pos) {
+	struct ScatalogHeader *header;
+
+	d->catEntry.actTs = d->catIndex.slots[pos].ts;
+	d->catEntry.entryNum = d->catIndex.slots[pos].slot + 1;
+	header = (struct ScatalogHeader *)dos33ReadSector(d, SECTOR_CATALOG,
+		d->catEntry.actTs.track, d->catEntry.actTs.sector);
+	d->catEntry.nextTs = header->nextTs;
+	memcpy(&d->catEntry.fileEntry, catIndexEntry(d, pos),
+		sizeof(d->catEntry.fileEntry));
+}
+
+/*****************************************************************************/
+static int dos33SaveActCatEntry(struct Sdos33 *d) {
+	int pos;
+
+	if (d->catEntry.actTs.track == 0 || !d->catIndex.built) {
+		return 0;
+	}
+	pos = imageOffset(&d->image, d->catEntry.actTs.track,
+		d->catEntry.actTs.sector);
+	if (pos < 0) {
+		return 0;
+	}
+	pos = d->catIndex.sectorPos[pos / BYTES_PER_SECTOR];
+	if (pos < 0) {
+		return 0;
+	}
+	dos33WriteCatEntry(d, pos + d->catEntry.entryNum - 1,
+		&d->catEntry.fileEntry);
+	return 1;
+}
+
+/*****************************************************************************/
+static int dos33CheckFileExists(struct Sdos33 *d, char *filename,
+		int file_deleted) {
+	int pos;
+
+	dos33ReadVtoc(d);
+	pos = catIndexFind(d, filename, file_deleted);
+	if (pos < 0) {
+		return 0;
+	}
+	dos33LoadCatEntry(d, pos);
+	return 1;
+}
+
+/*****************************************************************************/
+static int dos33FindEmptyEntry(struct Sdos33 *d) {
+	int pos;
+
+	dos33ReadVtoc(d);
+	pos = catIndexFindFree(d);
+	if (pos < 0) {
+		return 0;
+	}
+	dos33LoadCatEntry(d, pos);
+	return 1;
+}
+
+/*****************************************************************************/
+static void bufferPut(struct Sbuffer *b, const char *data, size_t len) {
+	char *p;
+
+	if (b->failed) {
+		return;
+	}
+	if (b->len + len + 1 > b->size) {
+		p = (char *)realloc(b->data, (b->len + len + 1) * 2);
+		if (NULL == p) {
+			b->failed = 1;
+			return;
+		}
+		b->data = p;
+		b->size = (b->len + len + 1) * 2;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+/*****************************************************************************/
+static void bufferPrintf(struct Sbuffer *b, const char *fmt, ...) {
+	char	line[256];
+	va_list	args;
+	int		n;
+
+	va_start(args, fmt);
+	n = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+	if (n >= 0) {
+		bufferPut(b, line, (n < sizeof(line)) ? n : sizeof(line) - 1);
+	}
+}
+
+/*****************************************************************************/
+static void catalogField(struct Sbuffer *b, const char *s, int format) {
+	char	*field;
+	int		n;
+
+	n = dos33Escape(NULL, s, format);
+	field = (char *)malloc(n + 1);
+	if (NULL == field) {
+		b->failed = 1;
+		return;
+	}
+	dos33Escape(field, s, format);
+	bufferPut(b, field, n);
+	free(field);
+}
+
+/*****************************************************************************/
+static int cmdCatalog(struct Sdos33 *d) {
+	struct SfileEntry	*entry = &d->catEntry.fileEntry;
+	struct Sbuffer		b;
+	struct Sts			tsl;
+	char				name[FILENAME_MAX], shown[FILENAME_MAX * 2];
+	const char			*sep;
+	int					i, n, deleted, locked;
+
+	// Listing goes to a buffer, written at once when complete
+	memset(&b, 0, sizeof(b));
+	sep = (d->format == DOS33_FORMAT_TSV) ? "\t" : ",";
+	dos33ReadVtoc(d);
+	if (d->format == DOS33_FORMAT_TEXT) {
+		bufferPrintf(&b, "DISK VOLUME %d\n\n", d->vtoc.diskVolume);
+	} else if (d->format != DOS33_FORMAT_JSON) {
+		bufferPrintf(&b, "image%svolume%sdeleted%slocked%stype%stype_hex%s"
+			"sectors%sname%stsl_track%stsl_sector%scatalog_track%s"
+			"catalog_sector%scatalog_entry\n", sep, sep, sep, sep, sep, sep,
+			sep, sep, sep, sep, sep, sep);
+	}
+	while (dos33GetNextCatEntry(d)) {
+		// A deleted file keeps the track of its T/S list in the last byte
+		// of its name
+		deleted = (entry->TsList.track == 0xFF);
+		locked = (entry->type & 0x80) != 0;
+		tsl.track = deleted ? entry->name[FILE_NAME_SIZE - 1] :
+			entry->TsList.track;
+		tsl.sector = entry->TsList.sector;
+		dos33FilenameToAscii(name, entry->name,
+			deleted ? FILE_NAME_SIZE - 1 : FILE_NAME_SIZE);
+		// convert inverse chars
+		for(i = n = 0; name[i] != '\0'; i++) {
+			if (name[i] < 0x20) {
+				shown[n++] = '^';
+				shown[n++] = name[i] + 0x40;
+			} else {
+				shown[n++] = name[i];
+			}
+		}
+		shown[n] = '\0';
+		if (d->format == DOS33_FORMAT_TEXT) {
+			bufferPrintf(&b, "%c%c%c %.3i ", deleted ? '#' : ' ',
+				locked ? '*' : ' ', dos33TypeToLetter(entry->type),
+				entry->size);
+			bufferPut(&b, shown, n);
+			bufferPut(&b, "\n", 1);
+			continue;
+		}
+		if (d->format == DOS33_FORMAT_JSON) {
+			bufferPut(&b, "{\"image\":", 9);
+			catalogField(&b, d->filename, d->format);
+			bufferPrintf(&b, ",\"volume\":%d,\"deleted\":%s,\"locked\":%s,"
+				"\"type\":\"%c\",\"type_hex\":\"%02X\",\"sectors\":%d,"
+				"\"name\":", d->vtoc.diskVolume, deleted ? "true" : "false",
+				locked ? "true" : "false", dos33TypeToLetter(entry->type),
+				entry->type & 0x7F, entry->size);
+			catalogField(&b, shown, d->format);
+			bufferPrintf(&b, ",\"tsl\":{\"track\":%d,\"sector\":%d},"
+				"\"catalog\":{\"track\":%d,\"sector\":%d,\"entry\":%d}}\n",
+				tsl.track, tsl.sector, d->catEntry.actTs.track,
+				d->catEntry.actTs.sector, d->catEntry.entryNum - 1);
+			continue;
+		}
+		catalogField(&b, d->filename, d->format);
+		bufferPrintf(&b, "%s%d%s%d%s%d%s%c%s%02X%s%d%s", sep,
+			d->vtoc.diskVolume, sep, deleted, sep, locked, sep,
+			dos33TypeToLetter(entry->type), sep, entry->type & 0x7F, sep,
+			entry->size, sep);
+		catalogField(&b, shown, d->format);
+		bufferPrintf(&b, "%s%d%s%d%s%d%s%d%s%d\n", sep, tsl.track, sep,
+			tsl.sector, sep, d->catEntry.actTs.track, sep,
+			d->catEntry.actTs.sector, sep, d->catEntry.entryNum - 1);
+	}
+	if (b.failed) {
+		fprintf(d->err, "Error allocating memory\n");
+		free(b.data);
+		return DOS33_ERR_MEMORY;
+	}
+	if (b.len > 0 && fwrite(b.data, 1, b.len, d->out) != b.len) {
+		fprintf(d->err, "Error on I/O\n");
+		free(b.data);
+		return DOS33_ERR_IO;
+	}
+	free(b.data);
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int dos33FileSectors(struct Sdos33 *d, struct Sts tsList,
+		struct Sts *list, int max) {
+	unsigned char		*tsl;
+	struct StslHeader	*header;
+	struct Sts			*dataTs, nextTs;
+	int					tslPointer, n = 0;
+	unsigned char		visited[IMAGE_MAX_SECTORS / 8];
+
+	memset(visited, 0, sizeof(visited));
+	nextTs.track = tsList.track;
+	nextTs.sector = tsList.sector;
+	while (dos33Visit(d, visited, nextTs)) {
+		// Read TSL
+		tsl = dos33ReadSector(d, SECTOR_TSL, nextTs.track, nextTs.sector);
+		header = (struct StslHeader *)tsl;
+		dataTs = (struct Sts *)(tsl + sizeof(struct StslHeader));
+		nextTs.track = header->nextTs.track;
+		nextTs.sector = header->nextTs.sector;
+		tslPointer = 0;
+		while(tslPointer < TSL_MAX_NUMBER && n < max) {
+			if (dataTs[tslPointer].track == 0 && dataTs[tslPointer].sector == 0) {
+				break;
+			}
+			list[n++] = dataTs[tslPointer++];
+		}
+		if (n == max || (nextTs.track == 0 && nextTs.sector == 0)) {
+			break;
+		}
+	}
+	return n;
+}
+
+/*****************************************************************************/
+static int dos33WriteHostFile(struct Sdos33 *d, char *outputFilename,
+		int fileType, struct Sts *sectors, int numSectors,
+		unsigned long *dataReads) {
+	char			tempStr[FILENAME_MAX + 8];
+	unsigned char	*data;
+	int				fileSize, offset, aux, i, n, skip;
+	FILE			*outputFile = NULL;
+
+	// process file, the header lives in the first data sector
+	aux = 0;
+	offset = 0;
+	fileSize = numSectors * BYTES_PER_SECTOR;
+	if (numSectors > 0) {
+		data = imageSector(&d->image, sectors[0].track, sectors[0].sector);
+		switch(dos33TypeToLetter(fileType)) {
+			case 'A':
+			case 'I':
+				aux = 0x0801;
+				fileSize = WORD(data[1], data[0]);
+				offset = 2;
+				break;
+
+			case 'B':
+				aux = WORD(data[1], data[0]);
+				fileSize = WORD(data[3], data[2]);
+				offset = 4;
+				break;
+		}
+	}
+	// Never trust the header beyond the sectors really read
+	if (fileSize + offset > numSectors * BYTES_PER_SECTOR) {
+		fileSize = numSectors * BYTES_PER_SECTOR - offset;
+		if (fileSize < 0) {
+			fileSize = 0;
+		}
+	}
+	if (0 == strcmp(outputFilename, "-")) {
+		outputFile = d->out;
+	} else {
+		if (d->raw) {
+			strcpy(tempStr, outputFilename);
+		} else {
+			snprintf(tempStr, sizeof(tempStr), "%s#%02X%04X", outputFilename, 
+				dos33TypeToHex(fileType), aux);
+		}
+		outputFile = fopen(tempStr, "wb");
+		if (NULL == outputFile) {
+			fprintf(d->err,"Error opening '%s' for write.\n", tempStr);
+			return DOS33_ERR_IO;
+		}
+	}
+	// Stream the sectors straight from the image
+	if (d->raw) {
+		fileSize += offset;
+		skip = 0;
+	} else {
+		skip = offset;
+	}
+	for (i = 0; i < numSectors && fileSize > 0; i++) {
+		data = imageSector(&d->image, sectors[i].track, sectors[i].sector);
+		++*dataReads;
+		n = BYTES_PER_SECTOR - skip;
+		if (n > fileSize) {
+			n = fileSize;
+		}
+		if (fwrite(data + skip, 1, n, outputFile) != n) {
+			break;
+		}
+		fileSize -= n;
+		skip = 0;
+	}
+	if (outputFile == d->out) {
+		if (fflush(outputFile) != 0 || fileSize > 0) {
+			fprintf(d->err, "Error on I/O\n");
+			return DOS33_ERR_IO;
+		}
+		return DOS33_OK;
+	}
+	if (fclose(outputFile) != 0 || fileSize > 0) {
+		fprintf(d->err, "Error on I/O\n");
+		return DOS33_ERR_IO;
+	}
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int cmdLoad(struct Sdos33 *d, char *appleFilename,
+		char *outputFilename) {
+	struct Sts			dataTs[IMAGE_MAX_SECTORS];
+	int					n, numSectors = d->image.tracks * d->image.sectors;
+
+	if (!dos33CheckFileExists(d, appleFilename, 0)) {
+		fprintf(d->err, "Apple filename not found.\n");
+		return DOS33_ERR_NOT_FOUND;
+	}
+	// Size in catalog includes the T/S lists, no file is bigger than the disk
+	n = d->catEntry.fileEntry.size;
+	if (n <= 0 || n > numSectors) {
+		n = numSectors;
+	}
+	n = dos33FileSectors(d, d->catEntry.fileEntry.TsList, dataTs, n);
+	return dos33WriteHostFile(d, outputFilename, d->catEntry.fileEntry.type,
+		dataTs, n, &d->stats.reads[SECTOR_DATA]);
+}
+
+/*****************************************************************************/
+static void *loadAllWorker(void *arg) {
+	struct SloadPool	*pool = (struct SloadPool *)arg;
+	struct SloadItem	*item;
+	unsigned long		reads = 0;
+	int					r;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		item = NULL;
+		if (pool->next < pool->count) {
+			item = &pool->items[pool->next++];
+		}
+		pthread_mutex_unlock(&pool->lock);
+		if (NULL == item) {
+			break;
+		}
+		// Image is only read here, so workers can share the handle
+		r = dos33WriteHostFile(pool->d, item->outputFilename, item->type,
+			item->sectors, item->numSectors, &reads);
+		if (r < 0) {
+			pthread_mutex_lock(&pool->lock);
+			++pool->errors;
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->dataReads += reads;
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/*****************************************************************************/
+static int cmdLoadAll(struct Sdos33 *d, char *dirname) {
+	struct SloadPool	pool;
+	struct SloadItem	*item;
+	pthread_t			workers[MAX_WORKERS];
+	struct stat			st;
+	char				name[FILE_NAME_SIZE + 1], *p;
+	int					maxItems = 0, numWorkers, i, n, r = DOS33_OK;
+	int					numSectors = d->image.tracks * d->image.sectors;
+
+#ifdef _WIN32
+	if (stat(dirname, &st) < 0 && mkdir(dirname) < 0) {
+#else
+	if (stat(dirname, &st) < 0 && mkdir(dirname, 0777) < 0) {
+#endif
+		fprintf(d->err, "Error creating directory %s\n", dirname);
+		return DOS33_ERR_IO;
+	}
+	memset(&pool, 0, sizeof(pool));
+	pool.d = d;
+	// One catalog pass collects the data sectors of every live file
+	dos33ReadVtoc(d);
+	while (dos33GetNextCatEntry(d)) {
+		if (d->catEntry.fileEntry.TsList.track == 0xFF) {
+			continue;
+		}
+		if (pool.count == maxItems) {
+			item = (struct SloadItem *)realloc(pool.items,
+				(maxItems + 32) * sizeof(struct SloadItem));
+			if (NULL == item) {
+				fprintf(d->err, "Error allocating memory\n");
+				r = DOS33_ERR_MEMORY;
+				goto out;
+			}
+			pool.items = item;
+			maxItems += 32;
+		}
+		item = &pool.items[pool.count];
+		dos33EntryName(name, &d->catEntry.fileEntry);
+		// Keep the name usable as a host filename
+		for (p = name; *p != '\0'; p++) {
+			if (*p == '/' || *p == '\\') {
+				*p = '_';
+			}
+		}
+		snprintf(item->outputFilename, FILENAME_MAX, "%s/%s", dirname, name);
+		item->type = d->catEntry.fileEntry.type;
+		// Same bound as LOAD, the size in the catalog may be wrong
+		n = d->catEntry.fileEntry.size;
+		if (n <= 0 || n > numSectors) {
+			n = numSectors;
+		}
+		item->sectors = (struct Sts *)malloc(n * sizeof(struct Sts));
+		if (NULL == item->sectors) {
+			fprintf(d->err, "Error allocating memory\n");
+			r = DOS33_ERR_MEMORY;
+			goto out;
+		}
+		++pool.count;
+		item->numSectors = dos33FileSectors(d, d->catEntry.fileEntry.TsList,
+			item->sectors, n);
+	}
+	// Decode and write the host files concurrently, the caller's thread
+	// counts as one of them
+	numWorkers = d->threads;
+	if (numWorkers < 1) {
+		numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (numWorkers > pool.count) {
+		numWorkers = pool.count;
+	}
+	if (numWorkers > MAX_WORKERS) {
+		numWorkers = MAX_WORKERS;
+	}
+	if (numWorkers < 1) {
+		numWorkers = 1;
+	}
+	// Workers must not load tracks behind each other's back
+	if (imageLoadAll(&d->image) < 0) {
+		r = DOS33_ERR_IO;
+		goto out;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	for (i = 0; i < numWorkers - 1; i++) {
+		if (pthread_create(&workers[i], NULL, loadAllWorker, &pool) != 0) {
+			break;
+		}
+	}
+	numWorkers = i;
+	// Main thread helps as well, so it works even without threads
+	loadAllWorker(&pool);
+	for (i = 0; i < numWorkers; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&pool.lock);
+	d->stats.reads[SECTOR_DATA] += pool.dataReads;
+	if (pool.errors) {
+		r = DOS33_ERR_IO;
+	}
+out:
+	for (i = 0; i < pool.count; i++) {
+		free(pool.items[i].sectors);
+	}
+	free(pool.items);
+	return r;
+}
+
+/*****************************************************************************/
+static void dos33ReleaseFileSectors(struct Sdos33 *d, struct Sts tsList) {
+	int					tslPointer;
+	unsigned char		*tsl;
+	struct StslHeader	*header;
+	struct Sts			nextTs, *dataTs;
+	unsigned char		visited[IMAGE_MAX_SECTORS / 8];
+
+	memset(visited, 0, sizeof(visited));
+	nextTs.track = tsList.track;
+	nextTs.sector = tsList.sector;
+	while (dos33Visit(d, visited, nextTs)) {
+		// Read TSL
+		tsl = dos33ReadSector(d, SECTOR_TSL, nextTs.track, nextTs.sector);
+		header = (struct StslHeader *)tsl;
+		dataTs = (struct Sts *)(tsl + sizeof(struct StslHeader));
+		// Release TSL TS
+		dos33ReleaseTs(d, nextTs.track, nextTs.sector);
+		//
+		nextTs.track = header->nextTs.track;
+		nextTs.sector = header->nextTs.sector;
+		tslPointer = 0;
+		while(tslPointer < TSL_MAX_NUMBER) {
+			if (dataTs[tslPointer].track == 0 && dataTs[tslPointer].sector == 0) {
+				break;
+			}
+			// Release data TS
+			dos33ReleaseTs(d, dataTs[tslPointer].track,
+				dataTs[tslPointer].sector);
+			++tslPointer;
+		}
+		if (nextTs.track == 0 && nextTs.sector == 0) {
+			break;
+		}
+	}
+}
+
+/*****************************************************************************/
+static int dos33DeleteFile(struct Sdos33 *d, char *appleFilename) {
+	if (!dos33CheckFileExists(d, appleFilename, 0)) {
+		fprintf(d->err, 
+			"Error! File %s does not exist or already deleted.\n", 
+			appleFilename);
+		return DOS33_ERR_NOT_FOUND;
+	}
+	if (d->catEntry.fileEntry.type & 0x80) {
+       fprintf(d->err, "File is locked! Unlock before deleting!\n");
+       return DOS33_ERR_LOCKED;
+	}
+	dos33ReleaseFileSectors(d, d->catEntry.fileEntry.TsList);
+	// Save track to last name char and mark as deleted
+	d->catEntry.fileEntry.name[FILE_NAME_SIZE-1] =
+		d->catEntry.fileEntry.TsList.track;
+	d->catEntry.fileEntry.TsList.track = 0xFF;
+	dos33SaveActCatEntry(d);
+	dos33SaveVtoc(d);
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int dos33UndeleteFile(struct Sdos33 *d, char *appleFilename) {
+	int					tslPointer;
+	unsigned char		*tsl;
+	struct StslHeader	*header;
+	struct Sts			nextTs, *dataTs;
+	unsigned char		visited[IMAGE_MAX_SECTORS / 8];
+
+	if (!dos33CheckFileExists(d, appleFilename, 1)) {
+		fprintf(d->err, 
+			"Error! File %s does not exist or not deleted.\n", 
+			appleFilename);
+		return DOS33_ERR_NOT_FOUND;
+	}
+	// Restore TSL track
+	d->catEntry.fileEntry.TsList.track =
+		d->catEntry.fileEntry.name[FILE_NAME_SIZE-1];
+	if (d->catEntry.fileEntry.TsList.track >= d->image.tracks) {
+		fprintf(d->err, "Error undeleting file, track > %d\n",
+			d->image.tracks);
+		return DOS33_ERR_CORRUPT;
+	}
+	d->catEntry.fileEntry.name[FILE_NAME_SIZE-1] = ' ' | 0x80;
+	memset(visited, 0, sizeof(visited));
+	nextTs.track = d->catEntry.fileEntry.TsList.track;
+	nextTs.sector = d->catEntry.fileEntry.TsList.sector;
+	while (dos33Visit(d, visited, nextTs)) {
+		// Read TSL
+		tsl = dos33ReadSector(d, SECTOR_TSL, nextTs.track, nextTs.sector);
+		header = (struct StslHeader *)tsl;
+		dataTs = (struct Sts *)(tsl + sizeof(struct StslHeader));
+		// Re-alloc TSL TS
+		dos33AllocTs(d, nextTs.track, nextTs.sector);
+		//
+		nextTs.track = header->nextTs.track;
+		nextTs.sector = header->nextTs.sector;
+		tslPointer = 0;
+		while(tslPointer < TSL_MAX_NUMBER) {
+			if (dataTs[tslPointer].track == 0 && dataTs[tslPointer].sector == 0) {
+				break;
+			}
+			// Re-alloc data TS
+			dos33AllocTs(d, dataTs[tslPointer].track,
+				dataTs[tslPointer].sector);
+			++tslPointer;
+		}
+		if (nextTs.track == 0 && nextTs.sector == 0) {
+			break;
+		}
+	}
+	dos33SaveActCatEntry(d);
+	dos33SaveVtoc(d);
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int checkSaveArgs(struct Sdos33 *d, char *appleFilename, char fileType,
+		int fileAddress) {
+	if (!d->raw && fileAddress == -1) {
+		fprintf(d->err, "Error! no raw mode needs an address.\n");
+		return 0;
+	}
+	if (fileAddress < 0 || fileAddress > 0xFFFF) {
+		fprintf(d->err,"Error! invalid address.\n");
+		return 0;
+	}
+	if (fileType == '?') {
+		fprintf(d->err,"Error! type unknown.\n");
+		return 0;
+	}
+	if (!checkAppleFilename(d->err, appleFilename)) {
+		return 0;
+	}
+	return 1;
+}
+
+/*****************************************************************************/
+static void parseHostFilename(struct Sdos33 *d, char *inputFilename,
+		char *appleFilename, char *fileType, int *fileAddress) {
+	char	*p;
+	int		typeHex, removeSuffix;
+
+	// Try get type and auxiliary value from filename
+	removeSuffix = 0;
+	if (!d->raw) {
+		p = strrchr(inputFilename, '#');
+		if (p) {			
+			sscanf(p+1,"%2X%4X", &typeHex, fileAddress);
+			removeSuffix = 1;
+			*fileType = dos33TypeToLetter(dos33HexToType(typeHex));
+		}
+	}
+	if (NULL == appleFilename) {
+		return;
+	}
+	p = inputFilename + (strlen(inputFilename) - 1);
+	while(p != inputFilename) {
+		if (*p == '/' || *p == '\\') {
+			++p;
+			break;
+		}
+		--p;
+	}
+	truncateFilename(d->err, appleFilename, p);
+	if (removeSuffix) {
+		appleFilename[strlen(appleFilename) - 7] = '\0';
+	}
+}
+
+/*****************************************************************************/
+static int dos33HeaderSize(char fileType) {
+	switch(fileType) {
+		case 'A':
+		case 'I':
+			return 2;
+
+		case 'B':
+			return 4;
+
+		default:
+			return 0;
+	}
+}
+
+/*****************************************************************************/
+static void dos33FillHeader(char *buffer, char fileType, int fileAddress,
+		int length) {
+	switch(fileType) {
+		case 'A':
+		case 'I':
+			buffer[0] = LOW(length);
+			buffer[1] = HIGH(length);
+			break;
+
+		case 'B':
+			buffer[0] = LOW(fileAddress);
+			buffer[1] = HIGH(fileAddress);
+			buffer[2] = LOW(length);
+			buffer[3] = HIGH(length);
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*****************************************************************************/
+static int dos33TslCount(int dataSectors) {
+	if (dataSectors == 0) {
+		return 1;
+	}
+	return (dataSectors + TSL_MAX_NUMBER - 1) / TSL_MAX_NUMBER;
+}
+
+/*****************************************************************************/
+static void dos33WriteFileSectors(struct Sdos33 *d, struct Sts *sectors,
+		int dataSectors, char *buffer) {
+	unsigned char		*tsl;
+	struct StslHeader	*header;
+	struct Sts			*pairs;
+	int					i, k, n, tslCount;
+
+	// Sectors come in allocation order: each T/S list followed by the
+	// data sectors it points to
+	tslCount = dos33TslCount(dataSectors);
+	for (k = 0; k < tslCount; k++) {
+		n = dataSectors - k * TSL_MAX_NUMBER;
+		if (n > TSL_MAX_NUMBER) {
+			n = TSL_MAX_NUMBER;
+		}
+		tsl = dos33WriteSector(d, SECTOR_TSL, sectors[0].track,
+			sectors[0].sector);
+		memset(tsl, 0, BYTES_PER_SECTOR);
+		header = (struct StslHeader *)tsl;
+		pairs = (struct Sts *)(tsl + sizeof(struct StslHeader));
+		if (k + 1 < tslCount) {
+			header->nextTs = sectors[1 + n];
+		}
+		header->offset = k * TSL_MAX_NUMBER;
+		for (i = 0; i < n; i++) {
+			pairs[i] = sectors[1 + i];
+			memcpy(dos33WriteSector(d, SECTOR_DATA, pairs[i].track,
+				pairs[i].sector), buffer, BYTES_PER_SECTOR);
+			buffer += BYTES_PER_SECTOR;
+		}
+		sectors += 1 + n;
+	}
+}
+
+/*****************************************************************************/
+static void closeInput(struct Sdos33 *d, FILE *inputFile) {
+	if (inputFile != d->in) {
+		fclose(inputFile);
+	}
+}
+
+/*****************************************************************************/
+static int cmdSave(struct Sdos33 *d, char *inputFilename,
+		char *appleFilename) {
+	FILE				*inputFile;
+	int					r, length, fileSize, offset, maxSize;
+	int					freeSpace, neededSectors, sizeInSectors;
+	struct Sts			*sectors;
+	char				*buffer;
+
+	//printf("SAVE: file %s, applefile %s, address %d, type: %c\n", inputFilename, appleFilename, address, type);
+	if (!checkSaveArgs(d, appleFilename, d->type, d->address)) {
+		return DOS33_ERR_ARGS;
+	}
+	if (0 == strcmp(inputFilename, "-")) {
+		inputFile = d->in;
+	} else {
+		inputFile = fopen(inputFilename, "rb");
+		if (NULL == inputFile) {
+			fprintf(d->err,"Error opening '%s' for read.\n", inputFilename);
+			return DOS33_ERR_IO;
+		}
+	}
+	if (dos33CheckFileExists(d, appleFilename, 0)) {
+		fprintf(d->err, "Warning! %s exists!\n", appleFilename);
+		if (!d->force) {
+			fprintf(d->out, "Exiting early...\n");
+			closeInput(d, inputFile);
+			return DOS33_ERR_EXISTS;
+		}
+		fprintf(d->err, "Deleting previous version...\n");
+		r = dos33DeleteFile(d, appleFilename);
+		if (r < 0) {
+			closeInput(d, inputFile);
+			return r;
+		}
+	}
+	if (!dos33FindEmptyEntry(d)) {
+		fprintf(d->err, "Error! Catalog is full\n");
+		closeInput(d, inputFile);
+		return DOS33_ERR_CATALOG_FULL;
+	}
+	// Read the input once, a pipe has no size to ask for. Nothing bigger
+	// than the free space can be saved, so memory stays bounded by it
+	offset = d->raw ? 0 : dos33HeaderSize(d->type);
+	freeSpace = dos33GetFreeSpace(d);
+	maxSize = freeSpace + BYTES_PER_SECTOR;
+	buffer = (char *)calloc(1, maxSize + BYTES_PER_SECTOR);
+	if (NULL == buffer) {
+		fprintf(d->err, "Error allocating memory\n");
+		closeInput(d, inputFile);
+		return DOS33_ERR_MEMORY;
+	}
+	length = fread(buffer + offset, 1, maxSize - offset, inputFile);
+	r = ferror(inputFile);
+	closeInput(d, inputFile);
+	if (r) {
+		fprintf(d->err, "Error on I/O\n");
+		free(buffer);
+		return DOS33_ERR_IO;
+	}
+	fileSize = length + offset;
+	// Round up to whole sectors, plus a T/S list every 122 data sectors
+	sizeInSectors = (fileSize / BYTES_PER_SECTOR) +
+		((fileSize % BYTES_PER_SECTOR) != 0);
+	neededSectors = sizeInSectors + dos33TslCount(sizeInSectors);
+	// Check for free space, a full buffer means the input goes on
+	if (neededSectors * BYTES_PER_SECTOR > freeSpace) {
+		fprintf(d->err, "Error! Not enough free space "
+				"on disk image (need %s%d, have %d)\n",
+				(fileSize == maxSize) ? "more than " : "",
+				neededSectors * BYTES_PER_SECTOR, freeSpace);
+		free(buffer);
+		return DOS33_ERR_FULL;
+	}
+	// Length header is patched in now that the size is known, raw files
+	// already carry theirs
+	if (!d->raw) {
+		dos33FillHeader(buffer, d->type, d->address, length);
+	}
+	// Plan every T/S list and data sector at once, then build the lists
+	// and copy the data in one ordered pass
+	sectors = (struct Sts *)malloc(neededSectors * sizeof(struct Sts));
+	r = (NULL == sectors) ? DOS33_ERR_MEMORY :
+		dos33AllocSectors(d, sectors, neededSectors);
+	if (r < 0) {
+		free(sectors);
+		free(buffer);
+		return r;
+	}
+	dos33WriteFileSectors(d, sectors, sizeInSectors, buffer);
+	d->catEntry.fileEntry.TsList = sectors[0];
+	d->catEntry.fileEntry.type = dos33LetterToType(d->type, 0);
+	d->catEntry.fileEntry.size = neededSectors;
+	dos33AsciiToFilename(d->catEntry.fileEntry.name, appleFilename);
+	free(sectors);
+	free(buffer);
+	dos33SaveActCatEntry(d);
+	dos33SaveVtoc(d);
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int compareSaveItems(const void *a, const void *b) {
+	return strcasecmp(((const struct SsaveItem *)a)->appleFilename,
+		((const struct SsaveItem *)b)->appleFilename);
+}
+
+/*****************************************************************************/
+static int saveItemUnchanged(struct Sdos33 *d, struct SsaveItem *item,
+		struct Sts *list) {
+	struct SfileEntry	*entry = catIndexEntry(d, item->catPos);
+	int					i, n, total;
+
+	// Same type and sectors, then the bytes of the file as SAVE would
+	// write them. The rest of its last sector is left out, DOS doesn't
+	// clear it
+	if ((entry->type & 0x7F) != dos33LetterToType(item->type, 0) ||
+			item->dataSectors >= d->image.tracks * d->image.sectors ||
+			entry->size != item->dataSectors +
+			dos33TslCount(item->dataSectors)) {
+		return 0;
+	}
+	n = dos33FileSectors(d, entry->TsList, list, item->dataSectors + 1);
+	if (n != item->dataSectors) {
+		return 0;
+	}
+	total = item->length + (d->raw ? 0 : dos33HeaderSize(item->type));
+	for (i = 0; i < n; i++) {
+		if (memcmp(item->buffer + i * BYTES_PER_SECTOR,
+				dos33ReadSector(d, SECTOR_DATA, list[i].track, list[i].sector),
+				(total - i * BYTES_PER_SECTOR < BYTES_PER_SECTOR) ?
+				total - i * BYTES_PER_SECTOR : BYTES_PER_SECTOR) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*****************************************************************************/
+static int cmdSaveDir(struct Sdos33 *d, char *dirname, int sync) {
+	DIR						*dir;
+	struct dirent			*de;
+	struct stat				st;
+	FILE					*inputFile;
+	struct SsaveItem		*items = NULL, *item, key;
+	struct Sts				*sectors = NULL, *next, *list = NULL;
+	struct SfileEntry		*entry, newEntry;
+	char					path[FILENAME_MAX];
+	int						*removed = NULL;
+	int						count = 0, maxItems = 0, numRemoved = 0;
+	int						freeSlots = 0, newFiles = 0, replaced = 0;
+	int						neededSectors = 0, freeSectors, offset;
+	int						i, e, r = DOS33_ERR_ARGS;
+
+	// Gather host files, type and address come from the #TTAAAA suffix
+	// or from the command line options
+	dir = opendir(dirname);
+	if (NULL == dir) {
+		fprintf(d->err,"Error opening directory '%s'.\n", dirname);
+		return DOS33_ERR_IO;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+		if (count == maxItems) {
+			item = (struct SsaveItem *)realloc(items,
+				(maxItems + 32) * sizeof(struct SsaveItem));
+			if (NULL == item) {
+				fprintf(d->err, "Error allocating memory\n");
+				r = DOS33_ERR_MEMORY;
+				closedir(dir);
+				goto out;
+			}
+			items = item;
+			maxItems += 32;
+		}
+		item = &items[count++];
+		memset(item, 0, sizeof(*item));
+		strcpy(item->hostFilename, path);
+		item->type = d->type;
+		item->address = d->address;
+		parseHostFilename(d, path, item->appleFilename, &item->type,
+			&item->address);
+		item->length = st.st_size;
+		item->dataSectors = item->length;
+		if (!d->raw) {
+			item->dataSectors += dos33HeaderSize(item->type);
+		}
+		item->dataSectors = (item->dataSectors + BYTES_PER_SECTOR - 1) /
+			BYTES_PER_SECTOR;
+		if (!checkSaveArgs(d, item->appleFilename, item->type,
+				item->address)) {
+			fprintf(d->err, "Error in '%s'\n", path);
+			closedir(dir);
+			goto out;
+		}
+	}
+	closedir(dir);
+	// An empty directory leaves an image with no files to SYNC
+	if (count == 0 && !sync) {
+		r = DOS33_OK;
+		goto out;
+	}
+	if (count > 0) {
+		qsort(items, count, sizeof(struct SsaveItem), compareSaveItems);
+	}
+	for (i = 1; i < count; i++) {
+		if (0 == strcasecmp(items[i - 1].appleFilename,
+				items[i].appleFilename)) {
+			fprintf(d->err, "Error! '%s' and '%s' both save as %s\n",
+				items[i - 1].hostFilename, items[i].hostFilename,
+				items[i].appleFilename);
+			goto out;
+		}
+	}
+
+	// Read every host file before touching the image
+	for (i = 0; i < count; i++) {
+		item = &items[i];
+		item->buffer = (char *)calloc(item->dataSectors + 1, BYTES_PER_SECTOR);
+		if (NULL == item->buffer) {
+			fprintf(d->err, "Error allocating memory\n");
+			r = DOS33_ERR_MEMORY;
+			goto out;
+		}
+		offset = d->raw ? 0 : dos33HeaderSize(item->type);
+		inputFile = fopen(item->hostFilename, "rb");
+		if (NULL == inputFile) {
+			fprintf(d->err,"Error opening '%s' for read.\n",
+				item->hostFilename);
+			r = DOS33_ERR_IO;
+			goto out;
+		}
+		e = fread(item->buffer + offset, 1, item->length, inputFile);
+		fclose(inputFile);
+		if (e != item->length) {
+			fprintf(d->err, "Error on I/O\n");
+			r = DOS33_ERR_IO;
+			goto out;
+		}
+		if (!d->raw) {
+			dos33FillHeader(item->buffer, item->type, item->address,
+				item->length);
+		}
+	}
+
+	// Match existing names through the catalog index
+	dos33ReadVtoc(d);
+	list = (struct Sts *)malloc(d->image.tracks * d->image.sectors *
+		sizeof(struct Sts));
+	if (NULL == list) {
+		fprintf(d->err, "Error allocating memory\n");
+		r = DOS33_ERR_MEMORY;
+		goto out;
+	}
+	for (i = 0; i < count; i++) {
+		item = &items[i];
+		item->catPos = catIndexFind(d, item->appleFilename, 0);
+		if (item->catPos < 0) {
+			neededSectors += item->dataSectors +
+				dos33TslCount(item->dataSectors);
+			++newFiles;
+			continue;
+		}
+		// SYNC leaves files that are already the same alone
+		if (sync && saveItemUnchanged(d, item, list)) {
+			item->unchanged = 1;
+			continue;
+		}
+		if (!d->force && !sync) {
+			fprintf(d->err, "Error! %s exists!\n", item->appleFilename);
+			r = DOS33_ERR_EXISTS;
+			goto out;
+		}
+		entry = catIndexEntry(d, item->catPos);
+		if (entry->type & 0x80) {
+			fprintf(d->err, "Error! %s is locked!\n", item->appleFilename);
+			r = DOS33_ERR_LOCKED;
+			goto out;
+		}
+		// Replaced files keep their catalog slot
+		item->oldTsList = entry->TsList;
+		neededSectors += item->dataSectors + dos33TslCount(item->dataSectors);
+		++replaced;
+	}
+	// and SYNC deletes the files the directory doesn't have
+	if (sync) {
+		removed = (int *)malloc(d->catIndex.numSlots * sizeof(int));
+		if (NULL == removed) {
+			fprintf(d->err, "Error allocating memory\n");
+			r = DOS33_ERR_MEMORY;
+			goto out;
+		}
+		for (e = 0; e < d->catIndex.numSlots; e++) {
+			if (d->catIndex.slots[e].state != CAT_LIVE) {
+				continue;
+			}
+			strcpy(key.appleFilename, d->catIndex.slots[e].name);
+			if (count > 0 && NULL != bsearch(&key, items, count,
+					sizeof(struct SsaveItem), compareSaveItems)) {
+				continue;
+			}
+			if (catIndexEntry(d, e)->type & 0x80) {
+				fprintf(d->err, "Error! %s is locked!\n",
+					d->catIndex.slots[e].name);
+				r = DOS33_ERR_LOCKED;
+				goto out;
+			}
+			removed[numRemoved++] = e;
+		}
+	}
+	freeSlots = catIndexCountFree(d) + numRemoved;
+	if (newFiles > freeSlots) {
+		fprintf(d->err, "Error! Not enough catalog entries "
+				"(need %d, have %d)\n", newFiles, freeSlots);
+		r = DOS33_ERR_CATALOG_FULL;
+		goto out;
+	}
+
+	// Release replaced and removed files in the in-memory VTOC only, then
+	// check space
+	for (i = 0; i < count; i++) {
+		if (items[i].catPos >= 0 && !items[i].unchanged) {
+			dos33ReleaseFileSectors(d, items[i].oldTsList);
+		}
+	}
+	for (i = 0; i < numRemoved; i++) {
+		dos33ReleaseFileSectors(d, catIndexEntry(d, removed[i])->TsList);
+	}
+	freeSectors = dos33GetFreeSpace(d) / BYTES_PER_SECTOR;
+	if (neededSectors > freeSectors) {
+		fprintf(d->err, "Error! Not enough free space "
+				"on disk image (need %d, have %d)\n",
+				neededSectors * BYTES_PER_SECTOR,
+				freeSectors * BYTES_PER_SECTOR);
+		dos33ReadVtoc(d);
+		r = DOS33_ERR_FULL;
+		goto out;
+	}
+
+	// Plan every sector in one bitmap pass and lay the files out in order
+	sectors = (struct Sts *)malloc((neededSectors + 1) * sizeof(struct Sts));
+	r = (NULL == sectors) ? DOS33_ERR_MEMORY :
+		dos33AllocSectors(d, sectors, neededSectors);
+	if (r < 0) {
+		dos33ReadVtoc(d);
+		goto out;
+	}
+	// Removed files are deleted as DELETE does, their slots may be reused
+	for (i = 0; i < numRemoved; i++) {
+		memcpy(&newEntry, catIndexEntry(d, removed[i]), sizeof(newEntry));
+		newEntry.name[FILE_NAME_SIZE - 1] = newEntry.TsList.track;
+		newEntry.TsList.track = 0xFF;
+		dos33WriteCatEntry(d, removed[i], &newEntry);
+	}
+	next = sectors;
+	for (i = 0; i < count; i++) {
+		item = &items[i];
+		if (item->unchanged) {
+			continue;
+		}
+		if (item->catPos < 0) {
+			item->catPos = catIndexFindFree(d);
+		}
+		dos33WriteFileSectors(d, next, item->dataSectors, item->buffer);
+		memset(&newEntry, 0, sizeof(newEntry));
+		newEntry.TsList = next[0];
+		newEntry.type = dos33LetterToType(item->type, 0);
+		newEntry.size = item->dataSectors + dos33TslCount(item->dataSectors);
+		dos33AsciiToFilename(newEntry.name, item->appleFilename);
+		dos33WriteCatEntry(d, item->catPos, &newEntry);
+		next += newEntry.size;
+	}
+	dos33SaveVtoc(d);
+	if (sync) {
+		fprintf(d->out, "%d saved, %d replaced, %d deleted, %d unchanged\n",
+			newFiles, replaced, numRemoved,
+			count - newFiles - replaced);
+	}
+	r = DOS33_OK;
+
+out:
+	for (i = 0; i < count; i++) {
+		free(items[i].buffer);
+	}
+	free(items);
+	free(sectors);
+	free(list);
+	free(removed);
+	return r;
+}
+
+/*****************************************************************************/
+static char *verifyOwnerName(char *name, int owner,
+		char (*names)[FILE_NAME_SIZE + 1]) {
+	if (owner == VERIFY_VTOC) {
+		strcpy(name, "VTOC");
+	} else if (owner == VERIFY_CATALOG) {
+		strcpy(name, "catalog");
+	} else {
+		strcpy(name, names[owner - 1]);
+	}
+	return name;
+}
+
+/*****************************************************************************/
+static int cmdVerify(struct Sdos33 *d) {
+	struct Sts				ts, prevTs, *pairs;
+	struct ScatalogHeader	*header;
+	struct StslHeader		*tslHeader;
+	struct SfileEntry		*entry;
+	struct Sts				*catSectors;
+	char					(*names)[FILE_NAME_SIZE + 1];
+	char					other[FILE_NAME_SIZE + 1];
+	int						*owner;
+	int						numSectors = d->image.tracks * d->image.sectors;
+	int						numCat = 0, problems = 0, fixed = 0;
+	int						c, e, p, t, s, off, file, count, used, isFree;
+
+	dos33ReadVtoc(d);
+	owner = (int *)calloc(numSectors, sizeof(int));
+	catSectors = (struct Sts *)malloc(numSectors * sizeof(struct Sts));
+	names = malloc(numSectors * CATALOG_ENTRIES * sizeof(*names));
+	if (NULL == owner || NULL == catSectors || NULL == names) {
+		fprintf(d->err, "Error allocating memory\n");
+		free(owner);
+		free(catSectors);
+		free(names);
+		return DOS33_ERR_MEMORY;
+	}
+	// Every sector is owned once at most, so the whole walk is linear
+	owner[imageOffset(&d->image, VTOC_TRACK, VTOC_SECTOR) /
+		BYTES_PER_SECTOR] = VERIFY_VTOC;
+	ts = d->vtoc.catalog;
+	prevTs.track = 0;
+	while (ts.track != 0) {
+		off = imageOffset(&d->image, ts.track, ts.sector);
+		if (off < 0 || owner[off / BYTES_PER_SECTOR] != VERIFY_FREE) {
+			fprintf(d->out, "T/S %02X/%02X: catalog %s\n", ts.track,
+				ts.sector, (off < 0) ? "pointer outside the disk" :
+				"chain loops");
+			++problems;
+			// The chain is cut before it, the VTOC pointer is left alone
+			if (d->repair && prevTs.track != 0) {
+				header = (struct ScatalogHeader *)dos33WriteSector(d,
+					SECTOR_CATALOG, prevTs.track, prevTs.sector);
+				header->nextTs.track = 0;
+				header->nextTs.sector = 0;
+				++fixed;
+			}
+			break;
+		}
+		owner[off / BYTES_PER_SECTOR] = VERIFY_CATALOG;
+		catSectors[numCat++] = ts;
+		header = (struct ScatalogHeader *)dos33ReadSector(d, SECTOR_CATALOG,
+			ts.track, ts.sector);
+		prevTs = ts;
+		ts = header->nextTs;
+	}
+	// T/S lists and data of each live file
+	for (c = 0; c < numCat; c++) {
+		for (e = 0; e < CATALOG_ENTRIES; e++) {
+			entry = (struct SfileEntry *)(dos33ReadSector(d, SECTOR_CATALOG,
+				catSectors[c].track, catSectors[c].sector) +
+				sizeof(struct ScatalogHeader) + e * sizeof(struct SfileEntry));
+			file = c * CATALOG_ENTRIES + e + 1;
+			if (entry->TsList.track == 0 || entry->TsList.track == 0xFF) {
+				continue;
+			}
+			dos33EntryName(names[file - 1], entry);
+			count = 0;
+			ts = entry->TsList;
+			prevTs.track = 0;
+			while (ts.track != 0 || ts.sector != 0) {
+				off = imageOffset(&d->image, ts.track, ts.sector);
+				if (off < 0 || owner[off / BYTES_PER_SECTOR] != VERIFY_FREE) {
+					if (off < 0) {
+						fprintf(d->out, "T/S %02X/%02X: T/S list of %s outside "
+							"the disk\n", ts.track, ts.sector, names[file - 1]);
+					} else if (owner[off / BYTES_PER_SECTOR] == file) {
+						fprintf(d->out, "T/S %02X/%02X: T/S list of %s loops\n",
+							ts.track, ts.sector, names[file - 1]);
+					} else {
+						fprintf(d->out, "T/S %02X/%02X: T/S list of %s also "
+							"used by %s\n", ts.track, ts.sector,
+							names[file - 1], verifyOwnerName(other,
+							owner[off / BYTES_PER_SECTOR], names));
+					}
+					++problems;
+					// Only a later T/S list can end the chain
+					if (d->repair && prevTs.track != 0) {
+						tslHeader = (struct StslHeader *)dos33WriteSector(d,
+							SECTOR_TSL, prevTs.track, prevTs.sector);
+						tslHeader->nextTs.track = 0;
+						tslHeader->nextTs.sector = 0;
+						++fixed;
+					}
+					break;
+				}
+				owner[off / BYTES_PER_SECTOR] = file;
+				++count;
+				tslHeader = (struct StslHeader *)dos33ReadSector(d, SECTOR_TSL,
+					ts.track, ts.sector);
+				pairs = (struct Sts *)((unsigned char *)tslHeader +
+					sizeof(struct StslHeader));
+				// Random access files have holes, every pair is looked at
+				for (p = 0; p < TSL_MAX_NUMBER; p++) {
+					if (pairs[p].track == 0) {
+						continue;
+					}
+					off = imageOffset(&d->image, pairs[p].track,
+						pairs[p].sector);
+					if (off >= 0 && owner[off / BYTES_PER_SECTOR] == VERIFY_FREE) {
+						owner[off / BYTES_PER_SECTOR] = file;
+						++count;
+						continue;
+					}
+					++problems;
+					// Listed twice by the file itself, not a cross-link
+					if (off >= 0 && owner[off / BYTES_PER_SECTOR] == file) {
+						fprintf(d->out, "T/S %02X/%02X: used twice by %s\n",
+							pairs[p].track, pairs[p].sector, names[file - 1]);
+						continue;
+					}
+					if (off >= 0) {
+						fprintf(d->out, "T/S %02X/%02X: data of %s also used "
+							"by %s\n", pairs[p].track, pairs[p].sector,
+							names[file - 1], verifyOwnerName(other,
+							owner[off / BYTES_PER_SECTOR], names));
+						continue;
+					}
+					fprintf(d->out, "T/S %02X/%02X: data of %s outside the "
+						"disk\n", pairs[p].track, pairs[p].sector,
+						names[file - 1]);
+					if (d->repair) {
+						pairs = (struct Sts *)(dos33WriteSector(d, SECTOR_TSL,
+							ts.track, ts.sector) + sizeof(struct StslHeader));
+						pairs[p].track = 0;
+						pairs[p].sector = 0;
+						++fixed;
+					}
+				}
+				prevTs = ts;
+				ts = tslHeader->nextTs;
+			}
+			if (entry->size != count) {
+				fprintf(d->out, "%s: size is %d, chain has %d sectors\n",
+					names[file - 1], entry->size, count);
+				++problems;
+				if (d->repair) {
+					entry = (struct SfileEntry *)(dos33WriteSector(d,
+						SECTOR_CATALOG, catSectors[c].track,
+						catSectors[c].sector) + sizeof(struct ScatalogHeader) +
+						e * sizeof(struct SfileEntry));
+					entry->size = count;
+					++fixed;
+				}
+			}
+		}
+	}
+	// Reachable sectors against the bitmap. DOS tracks and the catalog
+	// track are reserved as a whole, they can't leak
+	for (t = 0; t < d->image.tracks; t++) {
+		for (s = 0; s < d->image.sectors; s++) {
+			used = owner[t * d->image.sectors + s] != VERIFY_FREE;
+			isFree = (dos33BitmapMask(d, t) >> s) & 1;
+			if (used && isFree) {
+				fprintf(d->out, "T/S %02X/%02X: used by %s but free in "
+					"bitmap\n", t, s, verifyOwnerName(other,
+					owner[t * d->image.sectors + s], names));
+				++problems;
+				if (d->repair) {
+					dos33AllocTs(d, t, s);
+					++fixed;
+				}
+			} else if (!used && !isFree && t > 2 && t != VTOC_TRACK) {
+				fprintf(d->out, "T/S %02X/%02X: allocated but not used\n",
+					t, s);
+				++problems;
+				if (d->repair) {
+					dos33ReleaseTs(d, t, s);
+					++fixed;
+				}
+			}
+		}
+	}
+	if (fixed > 0) {
+		dos33SaveVtoc(d);
+		// Catalog may have changed under the index
+		catIndexReset(d);
+	}
+	if (problems == 0) {
+		fprintf(d->out, "No problems found\n");
+	} else if (d->repair) {
+		fprintf(d->out, "%d problems found, %d repaired\n", problems, fixed);
+	} else {
+		fprintf(d->out, "%d problems found\n", problems);
+	}
+	free(owner);
+	free(catSectors);
+	free(names);
+	return (problems > fixed) ? DOS33_ERR_CORRUPT : DOS33_OK;
+}
+
+/*****************************************************************************/
+static int recoverValidTs(struct Sdos33 *d, struct Sts ts, int allowEnd) {
+	// Files never get sectors of track 0 or of the catalog track
+	if (ts.track == 0 && ts.sector == 0) {
+		return allowEnd;
+	}
+	return ts.track != 0 && ts.track != VTOC_TRACK &&
+		ts.track < d->image.tracks && ts.sector < d->image.sectors;
+}
+
+/*****************************************************************************/
+static int recoverIsTsl(struct Sdos33 *d, unsigned char *p) {
+	struct StslHeader	*header = (struct StslHeader *)p;
+	struct Sts			*pairs = (struct Sts *)(p + sizeof(struct StslHeader));
+	int					i, offset, data = 0;
+
+	// DOS leaves the unused header bytes zeroed, counts the offset in
+	// whole T/S lists and points at valid sectors only
+	offset = (unsigned short)header->offset;
+	if (offset % TSL_MAX_NUMBER != 0 ||
+			offset >= d->image.tracks * d->image.sectors) {
+		return 0;
+	}
+	for (i = 0; i < sizeof(struct StslHeader); i++) {
+		if (p[i] != 0 && (i < 1 || i > 2) && (i < 5 || i > 6)) {
+			return 0;
+		}
+	}
+	if (!recoverValidTs(d, header->nextTs, 1)) {
+		return 0;
+	}
+	for (i = 0; i < TSL_MAX_NUMBER; i++) {
+		if (pairs[i].track == 0 && pairs[i].sector == 0) {
+			continue;
+		}
+		if (!recoverValidTs(d, pairs[i], 0)) {
+			return 0;
+		}
+		++data;
+	}
+	// An empty one can't be told from a zeroed sector
+	return data > 0;
+}
+
+/*****************************************************************************/
+static int recoverChain(struct Sdos33 *d, struct Sts ts, unsigned char *state,
+		int first, struct Sts *list, int *reused, int *broken) {
+	struct StslHeader	*header;
+	struct Sts			*pairs;
+	unsigned char		visited[IMAGE_MAX_SECTORS / 8];
+	int					i, off, n = 0;
+
+	// Sectors of the chain, T/S lists and data, go to list. With first
+	// >= 0 the chain is broken at the first sector that does not look like
+	// the next T/S list of a file, first being the offset of the first one
+	memset(visited, 0, sizeof(visited));
+	*reused = 0;
+	*broken = 1;
+	while (ts.track != 0 || ts.sector != 0) {
+		off = imageOffset(&d->image, ts.track, ts.sector);
+		if (off < 0) {
+			return n;
+		}
+		off /= BYTES_PER_SECTOR;
+		if (visited[off / 8] & (1 << (off % 8))) {
+			return n;
+		}
+		visited[off / 8] |= 1 << (off % 8);
+		header = (struct StslHeader *)dos33ReadSector(d, SECTOR_TSL, ts.track,
+			ts.sector);
+		if (first >= 0 && (!(state[off] & RECOVER_TSL) ||
+				(unsigned short)header->offset != first)) {
+			return n;
+		}
+		list[n++] = ts;
+		*reused += (state[off] & RECOVER_USED) != 0;
+		pairs = (struct Sts *)((unsigned char *)header +
+			sizeof(struct StslHeader));
+		for (i = 0; i < TSL_MAX_NUMBER; i++) {
+			off = imageOffset(&d->image, pairs[i].track, pairs[i].sector);
+			if (pairs[i].track == 0 || off < 0) {
+				continue;
+			}
+			list[n++] = pairs[i];
+			*reused += (state[off / BYTES_PER_SECTOR] & RECOVER_USED) != 0;
+		}
+		if (first >= 0) {
+			first += TSL_MAX_NUMBER;
+		}
+		ts = header->nextTs;
+	}
+	*broken = 0;
+	return n;
+}
+
+/*****************************************************************************/
+static void recoverClaim(struct Sdos33 *d, unsigned char *state,
+		struct Sts *list, int n, int alloc) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		state[imageOffset(&d->image, list[i].track, list[i].sector) /
+			BYTES_PER_SECTOR] |= RECOVER_USED;
+		if (alloc) {
+			dos33AllocTs(d, list[i].track, list[i].sector);
+		}
+	}
+}
+
+/*****************************************************************************/
+static int cmdRecover(struct Sdos33 *d, int restore) {
+	struct SfileEntry	entry;
+	struct StslHeader	*header;
+	struct Sts			ts, *list;
+	unsigned char		*state;
+	char				name[FILE_NAME_SIZE + 1];
+	int					numSectors = d->image.tracks * d->image.sectors;
+	int					deleted = 0, orphans = 0, recoverable = 0;
+	int					restored = 0;
+	int					i, n, pos, off, offset, reused, broken;
+
+	dos33ReadVtoc(d);
+	state = (unsigned char *)calloc(numSectors, 1);
+	// A T/S list names each of its sectors at most once per pair
+	list = (struct Sts *)malloc(numSectors * (TSL_MAX_NUMBER + 1) *
+		sizeof(struct Sts));
+	if (NULL == state || NULL == list) {
+		fprintf(d->err, "Error allocating memory\n");
+		free(state);
+		free(list);
+		return DOS33_ERR_MEMORY;
+	}
+	// One pass over the disk: what the bitmap says is in use, and what
+	// looks like a T/S list
+	for (i = 0; i < numSectors; i++) {
+		ts.track = i / d->image.sectors;
+		ts.sector = i % d->image.sectors;
+		if (!((dos33BitmapMask(d, ts.track) >> ts.sector) & 1)) {
+			state[i] |= RECOVER_USED;
+		}
+		if (recoverValidTs(d, ts, 0) && recoverIsTsl(d,
+				dos33ReadSector(d, SECTOR_DATA, ts.track, ts.sector))) {
+			state[i] |= RECOVER_TSL;
+		}
+	}
+	// A T/S list another one leads to does not start a file
+	for (i = 0; i < numSectors; i++) {
+		if (!(state[i] & RECOVER_TSL)) {
+			continue;
+		}
+		header = (struct StslHeader *)dos33ReadSector(d, SECTOR_TSL,
+			i / d->image.sectors, i % d->image.sectors);
+		off = imageOffset(&d->image, header->nextTs.track,
+			header->nextTs.sector);
+		if (off >= 0 && (state[off / BYTES_PER_SECTOR] & RECOVER_TSL) &&
+				(unsigned short)((struct StslHeader *)dos33ReadSector(d,
+				SECTOR_TSL, header->nextTs.track,
+				header->nextTs.sector))->offset ==
+				(unsigned short)header->offset + TSL_MAX_NUMBER) {
+			state[off / BYTES_PER_SECTOR] |= RECOVER_LINKED;
+		}
+	}
+	// The catalog and the live files own their sectors, whatever the
+	// bitmap says
+	if (!d->catIndex.built && catIndexBuild(d) < 0) {
+		free(state);
+		free(list);
+		return DOS33_ERR_MEMORY;
+	}
+	for (pos = 0; pos < d->catIndex.numSlots; pos++) {
+		ts = d->catIndex.slots[pos].ts;
+		state[imageOffset(&d->image, ts.track, ts.sector) /
+			BYTES_PER_SECTOR] |= RECOVER_USED;
+		if (d->catIndex.slots[pos].state == CAT_LIVE) {
+			n = recoverChain(d, catIndexEntry(d, pos)->TsList, state, -1,
+				list, &reused, &broken);
+			recoverClaim(d, state, list, n, 0);
+		}
+	}
+	// Deleted files, their T/S list track is kept in the last name byte.
+	// Whatever is found recoverable is claimed, so no sector is given to
+	// two files
+	for (pos = 0; pos < d->catIndex.numSlots; pos++) {
+		if (d->catIndex.slots[pos].state != CAT_DELETED) {
+			continue;
+		}
+		++deleted;
+		memcpy(&entry, catIndexEntry(d, pos), sizeof(entry));
+		strcpy(name, d->catIndex.slots[pos].name);
+		ts.track = entry.name[FILE_NAME_SIZE - 1];
+		ts.sector = entry.TsList.sector;
+		off = imageOffset(&d->image, ts.track, ts.sector);
+		if (off < 0 || !(state[off / BYTES_PER_SECTOR] & RECOVER_TSL) ||
+				(unsigned short)((struct StslHeader *)dos33ReadSector(d,
+				SECTOR_TSL, ts.track, ts.sector))->offset != 0) {
+			fprintf(d->out, "%s: T/S list %02X/%02X overwritten, lost\n", name,
+				ts.track, ts.sector);
+			continue;
+		}
+		state[off / BYTES_PER_SECTOR] |= RECOVER_LINKED;
+		n = recoverChain(d, ts, state, 0, list, &reused, &broken);
+		fprintf(d->out, "%s: T/S list %02X/%02X, %d sectors, %d reused, %s%s\n",
+			name, ts.track, ts.sector, n, reused, broken ? "chain broken, " : "",
+			(reused > 0 || broken) ? "lost" : "recoverable");
+		if (reused > 0 || broken) {
+			continue;
+		}
+		++recoverable;
+		if (restore && catIndexFind(d, name, 0) >= 0) {
+			fprintf(d->out, "%s: not restored, a file has that name\n", name);
+			recoverClaim(d, state, list, n, 0);
+			continue;
+		}
+		recoverClaim(d, state, list, n, restore);
+		if (restore) {
+			entry.TsList.track = ts.track;
+			entry.name[FILE_NAME_SIZE - 1] = ' ' | 0x80;
+			entry.size = n;
+			dos33WriteCatEntry(d, pos, &entry);
+			fprintf(d->out, "%s: restored\n", name);
+			++restored;
+		}
+	}
+	// T/S lists no file leads to
+	for (i = 0; i < numSectors; i++) {
+		if ((state[i] & (RECOVER_TSL | RECOVER_LINKED | RECOVER_USED)) !=
+				RECOVER_TSL) {
+			continue;
+		}
+		++orphans;
+		ts.track = i / d->image.sectors;
+		ts.sector = i % d->image.sectors;
+		offset = (unsigned short)((struct StslHeader *)dos33ReadSector(d,
+			SECTOR_TSL, ts.track, ts.sector))->offset;
+		n = recoverChain(d, ts, state, offset, list, &reused, &broken);
+		if (offset > 0) {
+			fprintf(d->out, "T/S %02X/%02X: orphaned T/S list, %d sectors, "
+				"%d reused, starts %d sectors into its file, partial\n",
+				ts.track, ts.sector, n, reused, offset);
+			continue;
+		}
+		fprintf(d->out, "T/S %02X/%02X: orphaned T/S list, %d sectors, "
+			"%d reused, %s%s\n", ts.track, ts.sector, n, reused,
+			broken ? "chain broken, " : "",
+			(reused > 0 || broken) ? "lost" : "recoverable");
+		if (reused > 0 || broken) {
+			continue;
+		}
+		++recoverable;
+		if (!restore) {
+			recoverClaim(d, state, list, n, 0);
+			continue;
+		}
+		// Only a never used entry, a deleted one may still be wanted
+		for (pos = 0; pos < d->catIndex.numSlots &&
+				d->catIndex.slots[pos].state != CAT_FREE; pos++)
+			;
+		if (pos == d->catIndex.numSlots) {
+			fprintf(d->out, "T/S %02X/%02X: not restored, catalog is full\n",
+				ts.track, ts.sector);
+			recoverClaim(d, state, list, n, 0);
+			continue;
+		}
+		// Type is not known, binary lets LOAD -r get the raw sectors
+		snprintf(name, sizeof(name), "RECOVERED.%02X.%02X", ts.track,
+			ts.sector);
+		memset(&entry, 0, sizeof(entry));
+		entry.TsList = ts;
+		entry.type = 0x04;
+		dos33AsciiToFilename(entry.name, name);
+		entry.size = n;
+		dos33WriteCatEntry(d, pos, &entry);
+		recoverClaim(d, state, list, n, 1);
+		fprintf(d->out, "T/S %02X/%02X: restored as %s\n", ts.track, ts.sector,
+			name);
+		++restored;
+	}
+	if (restored > 0) {
+		dos33SaveVtoc(d);
+	}
+	fprintf(d->out, "%d deleted files, %d orphaned T/S lists, %d recoverable",
+		deleted, orphans, recoverable);
+	if (restore) {
+		fprintf(d->out, ", %d restored", restored);
+	}
+	fprintf(d->out, "\n");
+	free(state);
+	free(list);
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int optimizeTake(struct Sdos33 *d, int *newPos, int *seq, int *numSeq,
+		struct Sts ts, const char *name) {
+	int off = imageOffset(&d->image, ts.track, ts.sector);
+
+	if (off < 0 || newPos[off / BYTES_PER_SECTOR] != -1) {
+		fprintf(d->err, "Error: T/S %02X/%02X of %s is %s, run VERIFY "
+			"--repair first\n", ts.track, ts.sector, name,
+			(off < 0) ? "outside the disk" :
+			(newPos[off / BYTES_PER_SECTOR] == -3) ? "the VTOC or catalog" :
+			"used twice");
+		return 0;
+	}
+	newPos[off / BYTES_PER_SECTOR] = -2;
+	seq[(*numSeq)++] = off / BYTES_PER_SECTOR;
+	return 1;
+}
+
+/*****************************************************************************/
+static void optimizeMove(struct Sdos33 *d, int *newPos, struct Sts *ts) {
+	int n = newPos[imageOffset(&d->image, ts->track, ts->sector) /
+		BYTES_PER_SECTOR];
+
+	ts->track = n / d->image.sectors;
+	ts->sector = n % d->image.sectors;
+}
+
+/*****************************************************************************/
+static int cmdOptimize(struct Sdos33 *d, char *bootFilename) {
+	struct Sts			ts, nts, *pairs;
+	struct StslHeader	*header;
+	struct SfileEntry	entry;
+	unsigned char		*old, *isTsl;
+	unsigned int		mask;
+	int					*newPos, *seq, *slots, *files, *fileStart;
+	int					numSectors = d->image.tracks * d->image.sectors;
+	int					numFiles = 0, numSeq = 0, numSlots = 0, moved = 0;
+	int					boot = -1, f, i, n, p, t, s, pos, kind;
+
+	dos33ReadVtoc(d);
+	if (!d->catIndex.built && (n = catIndexBuild(d)) < 0) {
+		return n;
+	}
+	if (NULL != bootFilename && bootFilename[0] != '\0') {
+		boot = catIndexFind(d, bootFilename, 0);
+		if (boot < 0) {
+			fprintf(d->err, "Error! File %s does not exist.\n", bootFilename);
+			return DOS33_ERR_NOT_FOUND;
+		}
+	}
+	newPos = (int *)malloc(numSectors * sizeof(int));
+	seq = (int *)malloc(numSectors * sizeof(int));
+	slots = (int *)malloc(numSectors * sizeof(int));
+	files = (int *)malloc((d->catIndex.numSlots + 1) * sizeof(int));
+	fileStart = (int *)malloc((d->catIndex.numSlots + 1) * sizeof(int));
+	isTsl = (unsigned char *)calloc(numSectors, 1);
+	old = (unsigned char *)malloc(numSectors * BYTES_PER_SECTOR);
+	if (NULL == newPos || NULL == seq || NULL == slots || NULL == files ||
+			NULL == fileStart || NULL == isTsl || NULL == old) {
+		fprintf(d->err, "Error allocating memory\n");
+		n = DOS33_ERR_MEMORY;
+		goto out;
+	}
+	memset(newPos, 0xFF, numSectors * sizeof(int));
+	// VTOC and catalog never move nor take data, a file pointing to them
+	// fails below like one sharing a sector with another
+	newPos[imageOffset(&d->image, VTOC_TRACK, VTOC_SECTOR) /
+		BYTES_PER_SECTOR] = -3;
+	for (pos = 0; pos < d->catIndex.numSlots; pos++) {
+		newPos[imageOffset(&d->image, d->catIndex.slots[pos].ts.track,
+			d->catIndex.slots[pos].ts.sector) / BYTES_PER_SECTOR] = -3;
+	}
+	// Sectors of each live file in the order they are read: a T/S list,
+	// then its data. Nothing is touched unless every chain is sound
+	for (pos = 0; pos < d->catIndex.numSlots; pos++) {
+		if (d->catIndex.slots[pos].state != CAT_LIVE) {
+			continue;
+		}
+		fileStart[numFiles] = numSeq;
+		files[numFiles++] = pos;
+		ts = catIndexEntry(d, pos)->TsList;
+		while (ts.track != 0 || ts.sector != 0) {
+			if (!optimizeTake(d, newPos, seq, &numSeq, ts,
+					d->catIndex.slots[pos].name)) {
+				n = DOS33_ERR_CORRUPT;
+				goto out;
+			}
+			isTsl[seq[numSeq - 1]] = 1;
+			header = (struct StslHeader *)dos33ReadSector(d, SECTOR_TSL,
+				ts.track, ts.sector);
+			pairs = (struct Sts *)((unsigned char *)header +
+				sizeof(struct StslHeader));
+			// Holes of random access files stay holes
+			for (p = 0; p < TSL_MAX_NUMBER; p++) {
+				if (pairs[p].track != 0 && !optimizeTake(d, newPos, seq,
+						&numSeq, pairs[p], d->catIndex.slots[pos].name)) {
+					n = DOS33_ERR_CORRUPT;
+					goto out;
+				}
+			}
+			ts = header->nextTs;
+		}
+	}
+	fileStart[numFiles] = numSeq;
+	// Everything free or owned by a file can be reused. Tracks go up from
+	// the DOS tracks and sectors down, the order DOS 3.3 allocates them
+	// in, so its interleave puts each one two physical sectors after the
+	// one before
+	for (t = 1; t < d->image.tracks; t++) {
+		mask = dos33BitmapMask(d, t);
+		for (s = d->image.sectors - 1; s >= 0; s--) {
+			i = imageOffset(&d->image, t, s) / BYTES_PER_SECTOR;
+			if ((mask & (1u << s)) || newPos[i] == -2) {
+				slots[numSlots++] = i;
+			}
+		}
+	}
+	// The boot file goes first, right after the DOS tracks
+	n = 0;
+	for (p = 0; p < 2; p++) {
+		for (f = 0; f < numFiles; f++) {
+			if ((files[f] == boot) != (p == 0)) {
+				continue;
+			}
+			for (i = fileStart[f]; i < fileStart[f + 1]; i++) {
+				newPos[seq[i]] = slots[n++];
+			}
+		}
+	}
+	// Contents are kept aside first, a sector may be the new place of
+	// another one before it has been moved itself
+	for (i = 0; i < numSeq; i++) {
+		memcpy(old + i * BYTES_PER_SECTOR, dos33ReadSector(d,
+			isTsl[seq[i]] ? SECTOR_TSL : SECTOR_DATA, seq[i] / d->image.sectors,
+			seq[i] % d->image.sectors), BYTES_PER_SECTOR);
+	}
+	for (i = 0; i < numSeq; i++) {
+		kind = isTsl[seq[i]] ? SECTOR_TSL : SECTOR_DATA;
+		if (kind == SECTOR_TSL) {
+			header = (struct StslHeader *)(old + i * BYTES_PER_SECTOR);
+			pairs = (struct Sts *)((unsigned char *)header +
+				sizeof(struct StslHeader));
+			if (header->nextTs.track != 0 || header->nextTs.sector != 0) {
+				optimizeMove(d, newPos, &header->nextTs);
+			}
+			for (p = 0; p < TSL_MAX_NUMBER; p++) {
+				if (pairs[p].track != 0) {
+					optimizeMove(d, newPos, &pairs[p]);
+				}
+			}
+		}
+		nts.track = newPos[seq[i]] / d->image.sectors;
+		nts.sector = newPos[seq[i]] % d->image.sectors;
+		if (newPos[seq[i]] != seq[i]) {
+			++moved;
+		}
+		if (memcmp(dos33ReadSector(d, kind, nts.track, nts.sector),
+				old + i * BYTES_PER_SECTOR, BYTES_PER_SECTOR) != 0) {
+			memcpy(dos33WriteSector(d, kind, nts.track, nts.sector),
+				old + i * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+		}
+	}
+	for (f = 0; f < numFiles; f++) {
+		memcpy(&entry, catIndexEntry(d, files[f]), sizeof(entry));
+		optimizeMove(d, newPos, &entry.TsList);
+		dos33WriteCatEntry(d, files[f], &entry);
+	}
+	// Free space is what is left after the last file
+	for (i = 0; i < numSlots; i++) {
+		dos33ReleaseTs(d, slots[i] / d->image.sectors,
+			slots[i] % d->image.sectors);
+	}
+	for (i = 0; i < n; i++) {
+		dos33AllocTs(d, slots[i] / d->image.sectors,
+			slots[i] % d->image.sectors);
+	}
+	if (n > 0) {
+		t = slots[n - 1] / d->image.sectors;
+		d->vtoc.lastAllocTrack = t;
+		d->vtoc.allocDirection = (t > VTOC_TRACK) ? 1 : -1;
+	}
+	dos33SaveVtoc(d);
+	fprintf(d->out, "%d files, %d of %d sectors moved\n", numFiles, moved,
+		numSeq);
+	n = DOS33_OK;
+out:
+	free(newPos);
+	free(seq);
+	free(slots);
+	free(files);
+	free(fileStart);
+	free(isTsl);
+	free(old);
+	return n;
+}
+
+/*****************************************************************************/
+static int cmdUnarchive(struct Sdos33 *d, char *filename) {
+	if (0 == strcmp(filename, d->filename)) {
+		fprintf(d->err, "Error! %s is the image itself\n", filename);
+		return DOS33_ERR_ARGS;
+	}
+	return (imageExport(&d->image, filename) < 0) ? DOS33_ERR_IO : DOS33_OK;
+}
+
+/*****************************************************************************/
+static int cmdArchive(struct Sdos33 *d, char *dirname) {
+	char		target[FILENAME_MAX], *base, *dot;
+	struct stat	st;
+	int			r;
+
+	if (stat(dirname, &st) < 0) {
+#ifdef _WIN32
+		mkdir(dirname);
+#else
+		mkdir(dirname, 0777);
+#endif
+	}
+	// Same name as the image, the extension tells it is archived
+	base = strrchr(d->filename, '/');
+	base = (NULL == base) ? d->filename : base + 1;
+	dot = strrchr(base, '.');
+	snprintf(target, sizeof(target), "%s/%.*s.dar", dirname,
+		(NULL == dot || dot == base) ? (int)strlen(base) : (int)(dot - base),
+		base);
+	r = cmdUnarchive(d, target);
+	if (r == DOS33_OK) {
+		fprintf(d->out, "Archived as %s\n", target);
+	}
+	return r;
+}
+
+/*****************************************************************************/
+static void cmdDump(struct Sdos33 *d) {
+	unsigned int	free[MAX_TRACKS];
+	int				i, j;
+
+	dos33ReadVtoc(d);
+	fprintf(d->out, "\n");
+	fprintf(d->out, "VTOC INFORMATION:\n");
+	fprintf(d->out, "\tFirst Catalog = %02X/%02X\n", d->vtoc.catalog.track, 
+		d->vtoc.catalog.sector);
+	fprintf(d->out, "\tDOS RELEASE = 3.%i\n", d->vtoc.dosRelease);
+	fprintf(d->out, "\tDISK VOLUME = %i\n", d->vtoc.diskVolume);
+	fprintf(d->out, "\tT/S pairs that will fit in T/S List = %i\n",
+		d->vtoc.maxTSPairs);
+	fprintf(d->out, "\tLast track where sectors were allocated = $%02X\n",
+		d->vtoc.lastAllocTrack);
+	fprintf(d->out, "\tDirection of track allocation = %i\n",
+		d->vtoc.allocDirection);
+	fprintf(d->out, "\tNumber of tracks per disk = %i\n", d->vtoc.numTracks);
+	fprintf(d->out, "\tNumber of sectors per track = %i\n",
+		d->vtoc.sectorsPerTrack);
+	fprintf(d->out, "\tNumber of bytes per sector = %i\n",
+		d->vtoc.bytesPerSector);
+	fprintf(d->out, "\nFree sector bitmap:\n\n");
+	// Track numbers in hex, high digit on top
+	fprintf(d->out, "\t");
+	for(i = 0; i < d->image.tracks; i++) {
+		if (i < 16) {
+			fprintf(d->out, " ");
+		} else {
+			fprintf(d->out, "%01X", i >> 4);
+		}
+	}
+	fprintf(d->out, "\n\t");
+	for(i = 0; i < d->image.tracks; i++) {
+		fprintf(d->out, "%01X", i & 0x0F);
+		free[i] = dos33BitmapMask(d, i);
+	}
+	fprintf(d->out, "\n");
+	for(j = 0; j < d->image.sectors; j++) {
+		fprintf(d->out, "$%01X:\t",j);
+		for(i = 0; i < d->image.tracks; i++) {
+			if ((free[i] >> j) & 0x01) {
+				fprintf(d->out, ".");
+			} else {
+				fprintf(d->out, "U");
+			}
+		}
+		fprintf(d->out, "\n");
+	}
+	fprintf(d->out, "Key: 'U' = used, '.' = free\n\n");
+}
+
+/*****************************************************************************/
+static int cmdInit(struct Sdos33 *d, char *dosFilename) {
+	int						r, i, dosSize = 0, neededSectors;
+	int						tracks, sectors;
+	char					*dosBuffer = NULL;
+	struct ScatalogHeader	header;
+	FILE					*dosFile;
+
+	tracks = d->formatTracks ? d->formatTracks : TRACKS_PER_DISK;
+	sectors = d->formatSectors ? d->formatSectors : SECTORS_PER_TRACK;
+	// The VTOC bitmap ends with the sector at 50 tracks, and a catalog
+	// track past the middle of the disk is all DOS knows
+	if (tracks > MAX_TRACKS) {
+		fprintf(d->err, "Error: %d tracks, the VTOC bitmap holds %d at most\n",
+			tracks, MAX_TRACKS);
+		return DOS33_ERR_GEOMETRY;
+	}
+	if (tracks <= VTOC_TRACK ||
+			(sectors != SECTORS_PER_TRACK && sectors != MAX_SECTORS_PER_TRACK)) {
+		fprintf(d->err, "Error: invalid geometry %d tracks by %d sectors\n",
+			tracks, sectors);
+		return DOS33_ERR_GEOMETRY;
+	}
+	if (NULL != dosFilename && strlen(dosFilename) > 0) {
+		dosFile = fopen(dosFilename, "rb");
+		if (NULL == dosFile) {
+			fprintf(d->err,"Error opening '%s' for read.\n", dosFilename);
+			return DOS33_ERR_IO;
+		}
+		fseek(dosFile, 0, SEEK_END);
+		dosSize = ftell(dosFile);
+		fseek(dosFile, 0, SEEK_SET);
+		if (dosSize > BYTES_PER_SECTOR * sectors * 3) {
+			fprintf(d->err,"DOS file do not fit in the image.\n");
+			fclose(dosFile);
+			return DOS33_ERR_ARGS;
+		}
+		dosBuffer = (char *)malloc(dosSize);
+		if (NULL == dosBuffer) {
+			fprintf(d->err, "Error allocating memory\n");
+			fclose(dosFile);
+			return DOS33_ERR_MEMORY;
+		}
+		r = fread(dosBuffer, 1, dosSize, dosFile);
+		fclose(dosFile);
+		if (r != dosSize) {
+			fprintf(d->err, "Error on I/O\n");
+			free(dosBuffer);
+			return DOS33_ERR_IO;
+		}
+	}
+
+	// New image starts zeroed in memory and is written once on close,
+	// anything pending from previous batch commands is dropped
+	imageDiscard(&d->image);
+	statsTakeImage(d);
+	catIndexReset(d);
+	if (imageCreate(&d->image, d->filename, d->err, tracks, sectors) < 0) {
+		free(dosBuffer);
+		return DOS33_ERR_MEMORY;
+	}
+	if (dosSize > 0) {
+		memcpy(d->image.data, dosBuffer, dosSize);
+		free(dosBuffer);
+	}
+	// Create VTOC
+	memset(&d->vtoc, 0, sizeof(d->vtoc));
+	d->vtoc.dosRelease = 3;
+	d->vtoc.catalog.track = VTOC_TRACK;
+	d->vtoc.catalog.sector = sectors - 1;
+	d->vtoc.diskVolume = 254;
+	d->vtoc.maxTSPairs = TSL_MAX_NUMBER;
+	d->vtoc.lastAllocTrack = VTOC_TRACK + 1;
+	d->vtoc.allocDirection = 1;
+	d->vtoc.numTracks = tracks;
+	d->vtoc.sectorsPerTrack = sectors;
+	d->vtoc.bytesPerSector = BYTES_PER_SECTOR;
+	// reserve track 0
+	// No user data can be stored here as track=0 is special case
+	// end of file indicator
+	for (i = 1; i < tracks; i++) {
+		for (r = 0; r < sectors; r++) {
+			dos33ReleaseTs(d, i, r);
+		}
+	}
+	// if copying dos reserve anothers tracks/sectors
+	if (dosSize > 0) {
+		neededSectors = dosSize / BYTES_PER_SECTOR;
+		neededSectors -= 1 * sectors;		// Exclude track 0
+		i = 1;
+		r = 0;
+		while(neededSectors-- > 0) {
+			dos33AllocTs(d, i, r++);
+			if (r == sectors) {
+				r = 0;
+				++i;
+			}
+		}
+	}
+	// reserve VTOC track
+	// reserved for vtoc and catalog stuff
+	memset(d->vtoc.bitmap[VTOC_TRACK], 0, sizeof(d->vtoc.bitmap[VTOC_TRACK]));
+	dos33SaveVtoc(d);
+	memset(&header, 0, sizeof(header));
+	// Set catalog next pointers
+	for (i = sectors - 1; i > 1; i--) {
+		header.nextTs.track = VTOC_TRACK;
+		header.nextTs.sector = i - 1;
+		memcpy(dos33WriteSector(d, SECTOR_CATALOG, VTOC_TRACK, i), &header,
+			sizeof(header));
+	}
+	return DOS33_OK;
+}
+
+
+/*****************************************************************************/
+static int dos33CatalogScore(struct Sdos33 *d) {
+	struct Svtoc			*vtoc;
+	struct ScatalogHeader	*header;
+	struct Sts				ts;
+	int						n, score = 0;
+
+	// INIT links each catalog sector to the one below it, read in the
+	// wrong order the chain stops following that after the first sector
+	vtoc = (struct Svtoc *)imageSector(&d->image, VTOC_TRACK, VTOC_SECTOR);
+	ts = vtoc->catalog;
+	for (n = 0; n < d->image.sectors && ts.track != 0; n++) {
+		if (imageOffset(&d->image, ts.track, ts.sector) < 0) {
+			break;
+		}
+		header = (struct ScatalogHeader *)imageSector(&d->image, ts.track,
+			ts.sector);
+		if (header->nextTs.track == ts.track &&
+				header->nextTs.sector == ts.sector - 1) {
+			++score;
+		}
+		ts = header->nextTs;
+	}
+	return score;
+}
+
+/*****************************************************************************/
+static void dos33ProbeOrder(struct Sdos33 *d) {
+	int order = d->image.order, score;
+
+	score = dos33CatalogScore(d);
+	if (imageSetOrder(&d->image, order == IMAGE_ORDER_DOS ?
+			IMAGE_ORDER_PRODOS : IMAGE_ORDER_DOS) < 0) {
+		return;
+	}
+	// The name (or DOS order) wins a draw
+	if (dos33CatalogScore(d) <= score) {
+		imageSetOrder(&d->image, order);
+	}
+}
+
+/*****************************************************************************/
+static int dos33ProbeGeometry(struct Sdos33 *d) {
+	static const int	trySectors[] = {
+		SECTORS_PER_TRACK, MAX_SECTORS_PER_TRACK, 13
+	};
+	struct Svtoc		*vtoc;
+	int					i, tracks, sectors;
+
+	// The VTOC is looked for where a disk of each sectors per track keeps
+	// it, and gives the number of tracks. Anything else is read as 35 by 16,
+	// nibble images only come with the sectors found on them
+	for (i = 0; i < 3; i++) {
+		if (d->image.fixedSectors && d->image.fixedSectors != trySectors[i]) {
+			continue;
+		}
+		if (imageSetGeometry(&d->image, TRACKS_PER_DISK, trySectors[i]) < 0) {
+			return DOS33_ERR_MEMORY;
+		}
+		vtoc = (struct Svtoc *)imageSector(&d->image, VTOC_TRACK, VTOC_SECTOR);
+		if (vtoc->sectorsPerTrack != trySectors[i] ||
+				vtoc->bytesPerSector != BYTES_PER_SECTOR) {
+			continue;
+		}
+		tracks = (unsigned char)vtoc->numTracks;
+		if (tracks > MAX_TRACKS) {
+			fprintf(d->err,
+				"Error: %d tracks, the VTOC bitmap holds %d at most\n",
+				tracks, MAX_TRACKS);
+			return DOS33_ERR_GEOMETRY;
+		}
+		if (tracks > VTOC_TRACK) {
+			if (imageSetGeometry(&d->image, tracks, trySectors[i]) < 0) {
+				return DOS33_ERR_MEMORY;
+			}
+			if (trySectors[i] == SECTORS_PER_TRACK) {
+				dos33ProbeOrder(d);
+			}
+			return DOS33_OK;
+		}
+	}
+	sectors = d->image.fixedSectors ? d->image.fixedSectors :
+		SECTORS_PER_TRACK;
+	if (imageSetGeometry(&d->image, TRACKS_PER_DISK, sectors) < 0) {
+		return DOS33_ERR_MEMORY;
+	}
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+static int dos33Result(struct Sdos33 *d, int r) {
+	// Sectors outside the disk were served zeroed, so whatever the command
+	// did is based on a damaged image
+	if (r == DOS33_OK && d->image.invalid > 0) {
+		return DOS33_ERR_CORRUPT;
+	}
+	// Lookups that found nothing may only have had no catalog index
+	if (d->catIndex.failed) {
+		return DOS33_ERR_MEMORY;
+	}
+	return r;
+}
+
+// Public functions
+
+/*****************************************************************************/
+void dos33Setup(struct Sdos33 *d, const char *filename, FILE *out, FILE *err) {
+	memset(d, 0, sizeof(*d));
+	strncpy(d->filename, filename, FILENAME_MAX - 1);
+	d->address = -1;
+	d->type = '?';
+	d->in = stdin;
+	d->out = out;
+	d->err = err;
+}
+
+/*****************************************************************************/
+int dos33Open(struct Sdos33 *d) {
+	int r;
+
+	// Image stays open across the commands of a batch
+	if (d->image.data != NULL) {
+		return DOS33_OK;
+	}
+	catIndexReset(d);
+	if (imageOpen(&d->image, d->filename, d->err) < 0) {
+		return DOS33_ERR_IO;
+	}
+	r = dos33ProbeGeometry(d);
+	if (r < 0) {
+		dos33Discard(d);
+	}
+	return r;
+}
+
+/*****************************************************************************/
+int dos33Flush(struct Sdos33 *d) {
+	// Nothing is written back to an image found damaged, and nothing
+	// cached is trusted after a failed write
+	if (d->image.invalid > 0) {
+		dos33Discard(d);
+		return DOS33_ERR_CORRUPT;
+	}
+	if (d->catIndex.failed) {
+		dos33Discard(d);
+		return DOS33_ERR_MEMORY;
+	}
+	if (imageFlush(&d->image) < 0) {
+		dos33Discard(d);
+		return DOS33_ERR_IO;
+	}
+	statsTakeImage(d);
+	return DOS33_OK;
+}
+
+/*****************************************************************************/
+int dos33Close(struct Sdos33 *d) {
+	int r = dos33Flush(d);
+
+	dos33Discard(d);
+	return r;
+}
+
+/*****************************************************************************/
+void dos33Discard(struct Sdos33 *d) {
+	imageDiscard(&d->image);
+	statsTakeImage(d);
+	catIndexReset(d);
+	d->catIndex.failed = 0;
+}
+
+/*****************************************************************************/
+const char *dos33ErrorString(int error) {
+	switch(error) {
+		case DOS33_OK:
+			return "success";
+
+		case DOS33_ERR_ARGS:
+			return "invalid arguments";
+
+		case DOS33_ERR_IO:
+			return "I/O error";
+
+		case DOS33_ERR_NOT_FOUND:
+			return "file not found";
+
+		case DOS33_ERR_EXISTS:
+			return "file exists";
+
+		case DOS33_ERR_LOCKED:
+			return "file is locked";
+
+		case DOS33_ERR_FULL:
+			return "disk full";
+
+		case DOS33_ERR_CATALOG_FULL:
+			return "catalog full";
+
+		case DOS33_ERR_CORRUPT:
+			return "damaged image";
+
+		case DOS33_ERR_MEMORY:
+			return "out of memory";
+
+		case DOS33_ERR_GEOMETRY:
+			return "unsupported geometry";
+
+		default:
+			return "unknown error";
+	}
+}
+
+/*****************************************************************************/
+int dos33Escape(char *out, const char *s, int format) {
+	char	esc[8];
+	int		quote, n = 0, len;
+
+	// Strings as JSON, CSV (quoted when needed) or TSV (backslash escapes),
+	// only counted when out is NULL
+	quote = (format == DOS33_FORMAT_JSON) ||
+		(format == DOS33_FORMAT_CSV && NULL != strpbrk(s, ",\"\r\n"));
+	if (quote) {
+		if (NULL != out) {
+			out[n] = '"';
+		}
+		++n;
+	}
+	for (; *s != '\0'; s++) {
+		if (format == DOS33_FORMAT_JSON && (*s == '"' || *s == '\\')) {
+			len = snprintf(esc, sizeof(esc), "\\%c", *s);
+		} else if (format == DOS33_FORMAT_JSON &&
+				((unsigned char)*s < 0x20 || *s == 0x7F)) {
+			len = snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+		} else if (format == DOS33_FORMAT_CSV && *s == '"') {
+			len = snprintf(esc, sizeof(esc), "\"\"");
+		} else if (format == DOS33_FORMAT_TSV && (*s == '\t' || *s == '\n' ||
+				*s == '\r' || *s == '\\')) {
+			len = snprintf(esc, sizeof(esc), "\\%c", (*s == '\t') ? 't' :
+				(*s == '\n') ? 'n' : (*s == '\r') ? 'r' : '\\');
+		} else {
+			esc[0] = *s;
+			len = 1;
+		}
+		if (NULL != out) {
+			memcpy(out + n, esc, len);
+		}
+		n += len;
+	}
+	if (quote) {
+		if (NULL != out) {
+			out[n] = '"';
+		}
+		++n;
+	}
+	if (NULL != out) {
+		out[n] = '\0';
+	}
+	return n;
+}
+
+/*****************************************************************************/
+void dos33ParseHostFilename(struct Sdos33 *d, char *inputFilename,
+		char *appleFilename, char *fileType, int *fileAddress) {
+	parseHostFilename(d, inputFilename, appleFilename, fileType, fileAddress);
+}
+
+/*****************************************************************************/
+int dos33Catalog(struct Sdos33 *d) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdCatalog(d));
+}
+
+/*****************************************************************************/
+int dos33Verify(struct Sdos33 *d) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdVerify(d));
+}
+
+/*****************************************************************************/
+int dos33Recover(struct Sdos33 *d, int restore) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdRecover(d, restore));
+}
+
+/*****************************************************************************/
+int dos33Optimize(struct Sdos33 *d, char *bootFilename) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdOptimize(d, bootFilename));
+}
+
+/*****************************************************************************/
+int dos33Archive(struct Sdos33 *d, char *dirname) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdArchive(d, dirname));
+}
+
+/*****************************************************************************/
+int dos33Unarchive(struct Sdos33 *d, char *filename) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdUnarchive(d, filename));
+}
+
+/*****************************************************************************/
+int dos33Dump(struct Sdos33 *d) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	cmdDump(d);
+	return dos33Result(d, DOS33_OK);
+}
+
+/*****************************************************************************/
+int dos33Load(struct Sdos33 *d, char *appleFilename, char *outputFilename) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdLoad(d, appleFilename, outputFilename));
+}
+
+/*****************************************************************************/
+int dos33LoadAll(struct Sdos33 *d, char *dirname) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdLoadAll(d, dirname));
+}
+
+/*****************************************************************************/
+int dos33Save(struct Sdos33 *d, char *inputFilename, char *appleFilename) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdSave(d, inputFilename, appleFilename));
+}
+
+/*****************************************************************************/
+int dos33SaveDir(struct Sdos33 *d, char *dirname) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdSaveDir(d, dirname, 0));
+}
+
+/*****************************************************************************/
+int dos33Sync(struct Sdos33 *d, char *dirname) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, cmdSaveDir(d, dirname, 1));
+}
+
+/*****************************************************************************/
+int dos33Delete(struct Sdos33 *d, char *appleFilename) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, dos33DeleteFile(d, appleFilename));
+}
+
+/*****************************************************************************/
+int dos33Undelete(struct Sdos33 *d, char *appleFilename) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	return dos33Result(d, dos33UndeleteFile(d, appleFilename));
+}
+
+/*****************************************************************************/
+int dos33Lock(struct Sdos33 *d, char *appleFilename, int lock) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	if (!dos33CheckFileExists(d, appleFilename, 0)) {
+		fprintf(d->err, 
+			"Error! File %s does not exist or has been deleted.\n", 
+			appleFilename);
+		return DOS33_ERR_NOT_FOUND;
+	}
+	if (lock) {
+		d->catEntry.fileEntry.type |= 0x80;
+	} else {
+		d->catEntry.fileEntry.type &= ~0x80;
+	}
+	dos33SaveActCatEntry(d);
+	return dos33Result(d, DOS33_OK);
+}
+
+/*****************************************************************************/
+int dos33Rename(struct Sdos33 *d, char *appleFilename, char *newAppleFilename) {
+	int r = dos33Open(d);
+
+	if (r < 0) {
+		return r;
+	}
+	if (!dos33CheckFileExists(d, appleFilename, 0)) {
+		fprintf(d->err, 
+			"Error! File %s does not exist or has been deleted.\n", 
+			appleFilename);
+		return DOS33_ERR_NOT_FOUND;
+	}
+	dos33AsciiToFilename(d->catEntry.fileEntry.name, newAppleFilename);
+	dos33SaveActCatEntry(d);
+	return dos33Result(d, DOS33_OK);
+}
+
+/*****************************************************************************/
+int dos33Format(struct Sdos33 *d, char *dosFilename) {
+	return dos33Result(d, cmdInit(d, dosFilename));
+}
@@ -25,11 +25,28 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>    /* toupper() */
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <errno.h>
+#include <limits.h>   /* PATH_MAX */
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
 #include "dos33.h"
 #include "utils.h"
+#include "image.h"
+#include "dos33lib.h"
 #include "version.h"
 
 // Defines
+#define SERVE_CACHE_SIZE 16
+#define SERVE_MAX_INPUT (1024 * 1024)
 
 // Enums
 enum {
@@ -43,15 +60,112 @@ enum {
 	COMMAND_RENAME,
 	COMMAND_DUMP,
 	COMMAND_INIT,
+	COMMAND_BATCH,
+	COMMAND_SAVEDIR,
+	COMMAND_LOADALL,
+	COMMAND_VERIFY,
+	COMMAND_OPTIMIZE,
+	COMMAND_ARCHIVE,
+	COMMAND_UNARCHIVE,
+	COMMAND_SCAN,
+	COMMAND_RECOVER,
+	COMMAND_SYNC,
 	COMMAND_UNKNOWN,
 };
 
+enum {
+	STATS_NONE = 0,
+	STATS_TEXT,
+	STATS_JSON,
+};
+
 // Structs
 struct command_type {
 	int type;
 	char name[32];
 };
 
+struct SfanJob {
+	char		*imageFilename;
+	char		*out;
+	size_t		outLen;
+	char		*err;
+	size_t		errLen;
+	int			result;
+	int			done;
+};
+
+/* Jobs are dealt as one contiguous range per worker. A worker takes from
+ * the front of its own range and, when it runs dry, steals the back half
+ * of another worker range */
+struct SfanQueue {
+	pthread_mutex_t	lock;
+	int				begin;
+	int				end;
+};
+
+struct SfanOut {
+	struct SfanJob		*jobs;
+	int					numJobs;
+	struct SfanQueue	queues[MAX_WORKERS];
+	int					numWorkers;
+	pthread_mutex_t		outLock;
+	int					nextEmit;
+	int					ordered;
+	char				*outDir;
+	int					command;
+	int					cac;
+	char				(*commandArgs)[FILENAME_MAX];
+	int					force, raw, address;
+	char				type;
+	int					formatTracks, formatSectors;
+	int					repair;
+	int					format;
+	int					emitted;
+	int					errors;
+};
+
+struct SfanWorker {
+	struct SfanOut		*fan;
+	int					id;
+};
+
+/* Image kept open by --serve, named by its full path. The lock is held
+ * by the request working on it, refs counts the requests that have it so
+ * it is not closed under them */
+struct SserveEntry {
+	struct Sdos33		d;
+	struct stat			st;
+	pthread_mutex_t		lock;
+	int					refs;
+	unsigned long		lastUsed;
+};
+
+/* At most cacheSize idle images stay open, the least recently used one
+ * is closed first. maxRunning requests run at once, on any images */
+struct Sserve {
+	struct SserveEntry	**entries;
+	int					numEntries;
+	int					cacheSize;
+	unsigned long		clock;
+	pthread_mutex_t		lock;
+	pthread_cond_t		idle;
+	int					running;
+	int					maxRunning;
+	int					stop;
+	int					force, raw, address;
+	char				type;
+	int					formatTracks, formatSectors;
+	int					repair;
+	int					format;
+	int					threads;
+};
+
+struct SserveConn {
+	struct Sserve		*srv;
+	int					fd;
+};
+
 // Constants
 const static struct command_type commands[] = {
 	{COMMAND_LOAD,		"LOAD"},
@@ -64,974 +178,1366 @@ const static struct command_type commands[] = {
 	{COMMAND_RENAME,	"RENAME"},
 	{COMMAND_DUMP,		"DUMP"},
 	{COMMAND_INIT,      "INIT"},
+	{COMMAND_BATCH,		"BATCH"},
+	{COMMAND_SAVEDIR,	"SAVEDIR"},
+	{COMMAND_LOADALL,	"LOADALL"},
+	{COMMAND_VERIFY,	"VERIFY"},
+	{COMMAND_OPTIMIZE,	"OPTIMIZE"},
+	{COMMAND_ARCHIVE,	"ARCHIVE"},
+	{COMMAND_UNARCHIVE,	"UNARCHIVE"},
+	{COMMAND_SCAN,		"SCAN"},
+	{COMMAND_RECOVER,	"RECOVER"},
+	{COMMAND_SYNC,		"SYNC"},
 };
 const static int num_commands = sizeof(commands) / sizeof(struct command_type);
-const static int onesTbl[16] = {
-	/* 0x0 = 0000 */ 0,
-	/* 0x1 = 0001 */ 1,
-	/* 0x2 = 0010 */ 1,
-	/* 0x3 = 0011 */ 2,
-	/* 0x4 = 0100 */ 1,
-	/* 0x5 = 0101 */ 2,
-	/* 0x6 = 0110 */ 2,
-	/* 0x7 = 0111 */ 3,
-	/* 0x8 = 1000 */ 1,
-	/* 0x9 = 1001 */ 2,
-	/* 0xA = 1010 */ 2,
-	/* 0xB = 1011 */ 3,
-	/* 0xC = 1100 */ 2,
-	/* 0xd = 1101 */ 3,
-	/* 0xe = 1110 */ 3,
-	/* 0xf = 1111 */ 4,
+const static char *sectorKinds[SECTOR_KINDS] = {
+	"vtoc", "catalog", "tsl", "data",
+};
+// In DOS33_FORMAT_* order
+const static char *formats[] = {
+	"text", "json", "csv", "tsv",
 };
+const static int num_formats = sizeof(formats) / sizeof(formats[0]);
 
 // Variables
-char					dskFilename[FILENAME_MAX] = "";
-FILE					*dskFile = NULL;
-struct Svtoc			vtoc;
-struct ScatalogEntry	catEntry;
-int						force = 0, raw = 0, address = -1;
-char					type = '?';
+// Set once from the command line
+int								statsMode = STATS_NONE;
+#ifndef _WIN32
+static volatile sig_atomic_t	serveStopping = 0;
+#endif
 
 // Private functions
 
 /*****************************************************************************/
-static int dos33ReadVtoc() {
-	int r;
-
-	// Seek to VTOC
-	fseek(dskFile, diskOffset(VTOC_TRACK, VTOC_SECTOR), SEEK_SET);
-	r = fread(&vtoc, 1, sizeof(vtoc), dskFile);
-	if (r < 0) {
-		fprintf(stderr, "Error on I/O\n");
-		return -1;
-	}
-	// Clear catalog entry
-	memset(&catEntry, 0, sizeof(catEntry));
-	return 0;
+static double statsClock(struct Sdos33 *d, int cpu) {
+	struct timespec ts;
+
+	// On a single thread, as with many images on the pool, only this
+	// thread's CPU is ours
+	clock_gettime(cpu ? ((d->threads == 1) ? CLOCK_THREAD_CPUTIME_ID :
+		CLOCK_PROCESS_CPUTIME_ID) : CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
 /*****************************************************************************/
-static int dos33SaveVtoc() {
-	int r;
+static void statsPhase(struct Sdos33 *d, struct Sphase *phase, int begin) {
+	double sign = begin ? -1.0 : 1.0;
 
-	// Seek to VTOC
-	fseek(dskFile, diskOffset(VTOC_TRACK, VTOC_SECTOR), SEEK_SET);
-	// Write back
-	r = fwrite(&vtoc, 1, sizeof(vtoc), dskFile);
-	if (r < 0) {
-		fprintf(stderr, "Error on I/O\n");
-		return -1;
-	}
-	// Clear catalog entry
-	memset(&catEntry, 0, sizeof(catEntry));
-	return 0;
+	phase->wall += sign * statsClock(d, 0);
+	phase->cpu += sign * statsClock(d, 1);
 }
 
 /*****************************************************************************/
-static void dos33AllocTs(int track, int sector) {
-	int sm;
-
-	sm = sector % 8;
-	if (sector < 8) {
-		vtoc.bitmap[track][1] &= ~(1 << sm);
-	} else {
-		vtoc.bitmap[track][0] &= ~(1 << sm);
+static void statsField(FILE *f, const char *s) {
+	char *field;
+
+	field = (char *)malloc(dos33Escape(NULL, s, DOS33_FORMAT_JSON) + 1);
+	if (NULL != field) {
+		dos33Escape(field, s, DOS33_FORMAT_JSON);
+		fputs(field, f);
+		free(field);
 	}
 }
 
 /*****************************************************************************/
-static void dos33ReleaseTs(int track, int sector) {
-	int sm;
-
-	sm = sector % 8;
-	if (sector < 8) {
-		vtoc.bitmap[track][1] |= 1 << sm;
-	} else {
-		vtoc.bitmap[track][0] |= 1 << sm;
+static void statsPrint(struct Sdos33 *d, FILE *f, const char *command) {
+	struct Sstats	*stats = &d->stats;
+	int				i;
+
+	if (statsMode == STATS_JSON) {
+		fprintf(f, "{\"image\":");
+		statsField(f, d->filename);
+		fprintf(f, ",\"command\":");
+		statsField(f, command);
+		fprintf(f, ",\"reads\":{");
+		for (i = 0; i < SECTOR_KINDS; i++) {
+			fprintf(f, "%s\"%s\":%lu", i ? "," : "", sectorKinds[i],
+				stats->reads[i]);
+		}
+		fprintf(f, "},\"writes\":{");
+		for (i = 0; i < SECTOR_KINDS; i++) {
+			fprintf(f, "%s\"%s\":%lu", i ? "," : "", sectorKinds[i],
+				stats->writes[i]);
+		}
+		fprintf(f, "},\"cache\":{\"hits\":%lu,\"misses\":%lu,"
+			"\"flushed\":%lu}", stats->image.hits, stats->image.misses,
+			stats->image.flushed);
+		fprintf(f, ",\"io\":{\"seeks\":%lu,\"bytes_read\":%lu,"
+			"\"bytes_written\":%lu}", stats->image.seeks,
+			stats->image.bytesRead, stats->image.bytesWritten);
+		fprintf(f, ",\"catalog_entries_scanned\":%lu,\"bitmap_scans\":%lu",
+			stats->catEntries, stats->bitmapScans);
+		fprintf(f, ",\"phases\":{\"command\":{\"wall_ms\":%.3f,"
+			"\"cpu_ms\":%.3f},\"commit\":{\"wall_ms\":%.3f,"
+			"\"cpu_ms\":%.3f}}}\n",
+			stats->command.wall * 1e3, stats->command.cpu * 1e3,
+			stats->commit.wall * 1e3, stats->commit.cpu * 1e3);
+		return;
+	}
+	fprintf(f, "Stats for %s %s:\n", d->filename, command);
+	fprintf(f, "\tsector reads  :");
+	for (i = 0; i < SECTOR_KINDS; i++) {
+		fprintf(f, " %s %lu", sectorKinds[i], stats->reads[i]);
+	}
+	fprintf(f, "\n\tsector writes :");
+	for (i = 0; i < SECTOR_KINDS; i++) {
+		fprintf(f, " %s %lu", sectorKinds[i], stats->writes[i]);
 	}
+	fprintf(f, "\n\tcache         : hits %lu misses %lu flushed %lu\n",
+		stats->image.hits, stats->image.misses, stats->image.flushed);
+	fprintf(f, "\tfile I/O      : seeks %lu read %lu written %lu bytes\n",
+		stats->image.seeks, stats->image.bytesRead, stats->image.bytesWritten);
+	fprintf(f, "\tcatalog       : %lu entries scanned\n", stats->catEntries);
+	fprintf(f, "\tallocation    : %lu bitmap scans\n", stats->bitmapScans);
+	fprintf(f, "\tcommand       : %.3f ms wall %.3f ms cpu\n",
+		stats->command.wall * 1e3, stats->command.cpu * 1e3);
+	fprintf(f, "\tcommit        : %.3f ms wall %.3f ms cpu\n",
+		stats->commit.wall * 1e3, stats->commit.cpu * 1e3);
 }
 
 /*****************************************************************************/
-static int dos33GetFreeSpace() {
-	int i, sectors_free = 0;
+static int lookupCommand(char *name) {
+	int which = COMMAND_UNKNOWN, i;
 
-	for(i = 0; i < TRACKS_PER_DISK; i++) {
-		sectors_free += onesTbl[ vtoc.bitmap[i][0]       & 0x0F];
-		sectors_free += onesTbl[(vtoc.bitmap[i][0] >> 4) & 0x0F];
-		sectors_free += onesTbl[ vtoc.bitmap[i][1]       & 0x0F];
-		sectors_free += onesTbl[(vtoc.bitmap[i][1] >> 4) & 0x0F];
+	for(i = 0; i < num_commands; i++) {
+		if(!strcmp(name, commands[i].name)) {
+			which = commands[i].type;
+			break;
+		}
 	}
+	return which;
+}
 
-	return sectors_free * BYTES_PER_SECTOR;
+/*****************************************************************************/
+static void usage(char *name, int only_version) {
+	printf("dos33util %s - by FBLabs\n\n", VERSION);
+	if (0 != only_version) {
+		return;
+	}
+	printf("Usage: %s [options] <filename> [filename...] <command>\n\n", name);
+	printf("Generic options:\n");
+	printf("\t-h  display this help\n");
+	printf("\t-V  show version and exit\n");
+	printf("\t-f  force operation\n");
+	printf("\t--durability none|fsync|atomic\n");
+	printf("\t    how changes reach the disk: plain writes (default), synced\n");
+	printf("\t    writes, or a synced copy renamed over the image\n");
+	printf("\t--stats[=text|json]\n");
+	printf("\t    report sector, I/O and timing counters on stderr\n");
+	printf("\t--serve socket\n");
+	printf("\t    keep images open and run the requests sent to a Unix\n");
+	printf("\t    socket, -j of them at once (default one per core)\n");
+	printf("\t--cache n\n");
+	printf("\t    images kept open by --serve (default %d)\n",
+		SERVE_CACHE_SIZE);
+	printf("Command options:\n");
+	printf("\t-r      : raw mode\n");
+	printf("\t-t type : char file type (T|I|A|B|S|R|N|L)\n");
+	printf("\t-a aux  : set auxiliary value (address)\n");
+	printf("\t-s size : tracks[xsectors] of a new image (default 35x16)\n");
+	printf("Many images options:\n");
+	printf("\t-j n    : number of threads (default one per core)\n");
+	printf("\t-l file : read image names from file, one per line (- for stdin)\n");
+	printf("\t-o dir  : write the output of each image to dir/<image>.txt\n");
+	printf("\t-O      : keep the output in image order\n");
+	printf("\n");
+	printf("List of valid commands:\n");
+	printf("\tCATALOG  [--format text|json|csv|tsv]\n");
+	printf("\tLOAD     [-r] <apple_file> [local_file|-]\n");
+	printf("\tSAVE     [-r] [-a aux] [-t type] <local_file|-> [apple_file]\n");
+	printf("\tDELETE   <apple_file>\n");
+	printf("\tUNDELETE <apple_file>\n");
+	printf("\tLOCK     <apple_file>\n");
+	printf("\tUNLOCK   <apple_file>\n");
+	printf("\tRENAME   <apple_file_old> <apple_file_new>\n");
+	printf("\tDUMP\n");
+	printf("\tINIT     [-s size] [dos_file]\n");
+	printf("\tBATCH    <script_file|->\n");
+	printf("\tSAVEDIR  [-r] [-a aux] [-t type] <local_dir>\n");
+	printf("\tLOADALL  [-r] <local_dir>\n");
+	printf("\tSYNC     [-r] [-a aux] [-t type] <local_dir>\n");
+	printf("\tVERIFY   [--repair]\n");
+	printf("\tOPTIMIZE [boot_file]\n");
+	printf("\tARCHIVE  <archive_dir>\n");
+	printf("\tUNARCHIVE <image_file>\n");
+	printf("\tSCAN\n");
+	printf("\tRECOVER\n");
+	printf("\n");
+	printf("A BATCH script has one command per line, with its options and\n");
+	printf("arguments, e.g. 'SAVE -t B -a 0x2000 prog.bin PROG'. Lines starting\n");
+	printf("with ';' are comments. The image is written once at the end.\n");
+	printf("\n");
+	printf("INIT makes 18 to 50 tracks of 16 or 32 sectors, other images\n");
+	printf("are read with the geometry found in their VTOC. Images may be\n");
+	printf("sector dumps in DOS or ProDOS order (.dsk, .do, .po), 2IMG,\n");
+	printf("nibble (.nib) or WOZ. The order of a .dsk is found from its\n");
+	printf("catalog. INIT makes the kind of image its name ends in. Any of\n");
+	printf("them may be compressed with gzip or zlib (.gz, .zlib).\n");
+	printf("\n");
+	printf("CATALOG --format json writes one object per file, csv and tsv\n");
+	printf("one row per file after a header row. Each has the image, the\n");
+	printf("disk volume, the deleted and locked flags, the type letter and\n");
+	printf("byte, the size in sectors, the name with inverse characters as\n");
+	printf("^X, the track/sector of its T/S list and where its entry is in\n");
+	printf("the catalog (track, sector and entry 0 to 6).\n");
+	printf("\n");
+	printf("VERIFY checks the catalog, the T/S lists and the free sector\n");
+	printf("bitmap, --repair cuts broken chains and fixes sizes and bitmap.\n");
+	printf("OPTIMIZE packs every file after the DOS tracks, T/S list first\n");
+	printf("and data in DOS load order, the boot file first when given.\n");
+	printf("Deleted files can't be undeleted afterwards.\n");
+	printf("\n");
+	printf("SYNC makes the files of the image those of local_dir, named as\n");
+	printf("for SAVEDIR: new and changed files are saved, files not in the\n");
+	printf("directory are deleted and the sectors of the same ones are left\n");
+	printf("alone.\n");
+	printf("\n");
+	printf("SCAN looks at every sector for T/S lists, follows their chains\n");
+	printf("and tells which deleted files and orphaned T/S lists can still\n");
+	printf("be read, none of their sectors being in use since. RECOVER also\n");
+	printf("restores them, orphans as binary files named RECOVERED.tt.ss.\n");
+	printf("\n");
+	printf("ARCHIVE stores the image as <archive_dir>/<name>.dar, references\n");
+	printf("into a pool of sectors shared by every image of the archive, so\n");
+	printf("sectors found in many images are kept once. Any command works on\n");
+	printf("a .dar, UNARCHIVE writes any image out again as a new image of\n");
+	printf("the kind its name ends in.\n");
+	printf("\n");
+	printf("LOAD writes to stdout and SAVE reads from stdin when the local\n");
+	printf("file is '-'.\n");
+	printf("\n");
+	printf("With many images each output line is prefixed with the image name\n");
+	printf("and LOADALL extracts every image to its own subdirectory.\n");
+	printf("\n");
+	printf("With --serve every message, both ways, is a 4 byte big endian\n");
+	printf("length and that many bytes. A request is a line like the ones of\n");
+	printf("a BATCH script with the image first, '[options] <filename>\n");
+	printf("<command> [args]', then the data SAVE reads for '-'. The answer\n");
+	printf("is the exit code as text, the output and the error output. Any\n");
+	printf("number of requests may follow on a connection. Changes are\n");
+	printf("written before the answer, images changed by others are read\n");
+	printf("again. Names are relative to the directory of the server.\n");
+	printf("\n");
+	return;
 }
 
 /*****************************************************************************/
-static int dos33FindAndAllocSector(struct Sts *ts) {
-	int foundTrack = -1, foundSector = -1;
-	int i, b, startTrack;
-	int r;
-	char trackDir;
-
-
-	// Originally used to keep things near center of disk for speed
-	// We can use to avoid fragmentation possibly
-	startTrack = vtoc.lastAllocTrack % TRACKS_PER_DISK;
-	trackDir = vtoc.allocDirection;
-
-	if ((trackDir != 1) && (trackDir != -1)) {
-		fprintf(stderr,"ERROR! Invalid track dir %i\n", trackDir);
-		exit(1);
-	}
-
-	if (((startTrack > VTOC_TRACK) && (trackDir != 1)) ||
-		((startTrack < VTOC_TRACK) && (trackDir != -1))) {
-		fprintf(stderr,
-			"Warning! Non-optimal values for track dir t=%i d=%i!\n",
-			startTrack, trackDir);
-	}
-
-	i = startTrack;
-	do {
-		for (b = 1; b > -1; b--) {
-			r = vtoc.bitmap[i][b];
-			if (r != 0) {
-				foundSector = findFirstOne(r);
-				foundTrack = i;
-				// clear bit indicating in use
-				vtoc.bitmap[i][b] &= ~(1 << foundSector);
-				foundSector += (8 * (1 - b));
+static int parseOption(struct Sdos33 *d, int argc, char **argv, int c) {
+	char	*endptr;
+	int		i;
+
+	// Check options w/o parameter
+	switch(argv[c][1]) {
+		case 'f':
+			d->force = 1;
+			break;
+
+		case 'r':
+			d->raw = 1;
+			break;
+
+		case '-':
+			if (0 == strcmp(argv[c], "--repair")) {
+				d->repair = 1;
 				break;
 			}
-		}
-		if (foundTrack != -1) {
+			if (strcmp(argv[c], "--format") != 0) {
+				fprintf(d->err, "ERROR! Unknown option %s\n", argv[c]);
+				return -1;
+			}
+			++c;
+			if (c == argc) {
+				fprintf(d->err, "ERROR! Missing parameter for option %s\n",
+					argv[c - 1]);
+				return -1;
+			}
+			for (i = 0; i < num_formats && strcmp(argv[c], formats[i]); i++)
+				;
+			if (i == num_formats) {
+				fprintf(d->err, "ERROR! --format needs text, json, csv or "
+					"tsv\n");
+				return -1;
+			}
+			d->format = i;
 			break;
-		}
-		// Move to next track, handling overflows
-		i += trackDir;
-		if (i < 0) {
-			i = VTOC_TRACK;
-			trackDir = 1;
-		}
-		if (i >= TRACKS_PER_DISK) {
-			i = VTOC_TRACK;
-			trackDir = -1;
-		}
-	} while (i != startTrack);
 
-	if (foundTrack == -1 || foundSector == -1) {
-		fprintf(stderr, "No room left!\n");
-		return 0;
-	}
+		default:
+			// Check options with parameters
+			if (c+1 == (int)argc) {
+				fprintf(d->err, 
+					"ERROR! Missing parameter for option %s\n",
+					argv[c]);
+				return -1;
+			}
+			switch(argv[c][1]) {
+				case 'a':
+					++c;
+					d->address = strtol(argv[c], &endptr, 0);
+					break;
 
-	/* store new track/direction info */
-	vtoc.lastAllocTrack = foundTrack;
-	if (foundTrack > VTOC_TRACK) {
-		vtoc.allocDirection = 1;
-	} else {
-		vtoc.allocDirection = -1;
-	}
-	ts->track = foundTrack;
-	ts->sector = foundSector;
-	return 1;
-}
+				case 't':
+					++c;
+					d->type = argv[c][0];
+					break;
 
-/*****************************************************************************/
-static int dos33GetNextCatEntry() {
-	int						r;
-	struct ScatalogHeader	header;
-
-	if (catEntry.nextTs.track == 0 || catEntry.entryNum == 7) {
-		if (catEntry.entryNum == 7) {
-			catEntry.actTs.track = catEntry.nextTs.track;
-			catEntry.actTs.sector = catEntry.nextTs.sector;
-		} else {
-			catEntry.actTs.track = vtoc.catalog.track;
-			catEntry.actTs.sector = vtoc.catalog.sector;
-		}
-		fseek(dskFile, 
-			diskOffset(catEntry.actTs.track, catEntry.actTs.sector),
-			SEEK_SET);
-		r = fread(&header, 1, sizeof(header), dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
-		}
-		catEntry.nextTs.track = header.nextTs.track;
-		catEntry.nextTs.sector = header.nextTs.sector;
-		catEntry.entryNum = 0;
-	}
-	r = fread(&catEntry.fileEntry, 1, sizeof(catEntry.fileEntry), dskFile);
-	if (r < 0) {
-		fprintf(stderr, "Error on I/O\n");
-		exit(1);
-	}
-	++catEntry.entryNum;
-	if (catEntry.fileEntry.TsList.track == 0) {
-		return 0;
+				case 's':
+					++c;
+					// tracks or tracks x sectors, e.g. 40 or 50x32
+					d->formatTracks = strtol(argv[c], &endptr, 10);
+					d->formatSectors = 0;
+					if (*endptr == 'x' || *endptr == 'X') {
+						d->formatSectors = strtol(endptr + 1, &endptr, 10);
+					}
+					if (*endptr != '\0' || d->formatTracks <= 0) {
+						fprintf(d->err, "ERROR! Invalid size '%s'\n", argv[c]);
+						return -1;
+					}
+					break;
+
+			}
 	}
-	return 1;
+	return c;
 }
 
 /*****************************************************************************/
-static int dos33SaveActCatEntry() {
-	int r, e, t, s;
+static int runCommand(struct Sdos33 *d, int command, int cac,
+		char commandArgs[][FILENAME_MAX]) {
+	char	appleFilename[FILENAME_MAX] = "";
+	char	newAppleFilename[FILENAME_MAX] = "";
+	char	inputFilename[FILENAME_MAX] = "";
+	char	outputFilename[FILENAME_MAX] = "";
+	int		r;
 
-	if (catEntry.nextTs.track == 0) {
-		return 0;
-	}
-	e = sizeof(struct ScatalogHeader);
-	e += (catEntry.entryNum - 1) * sizeof(struct SfileEntry);
-	t = catEntry.actTs.track;
-	s = catEntry.actTs.sector;
-	fseek(dskFile, diskOffset(t, s) + e, SEEK_SET);
-	r = fwrite(&catEntry.fileEntry, 1, sizeof(catEntry.fileEntry), dskFile);
-	if (r < 0) {
-		fprintf(stderr, "Error on I/O\n");
-		exit(1);
-	}
-	return 1;
-}
+	switch(command) {
 
-/*****************************************************************************/
-static int dos33CheckFileExists(char *filename, int file_deleted) {
-	char	name[FILENAME_MAX];
-	int		i, nl;
-
-	dos33ReadVtoc();
-	while (dos33GetNextCatEntry()) {
-		nl = FILE_NAME_SIZE;
-		if (catEntry.fileEntry.TsList.track == 0xFF) {
-			--nl;
-		}
-		dos33FilenameToAscii(name, catEntry.fileEntry.name, nl);
-		// convert inverse chars
-		for(i = 0; i < strlen(name); i++) {
-			if (name[i] < 0x20) {
-				name[i] += 0x40;
+		case COMMAND_CATALOG:
+			r = dos33Catalog(d);
+			break;
+
+		case COMMAND_LOAD:
+			if (cac == 0) {
+				fprintf(d->err,"Error! Need apple filename\n");
+				return 1;
 			}
-		}
-		if (0 == strcasecmp(filename, name)) {
-			if (catEntry.fileEntry.TsList.track == 0xFF) {
-				if (file_deleted) {
-					return 1;
-				}
+			truncateFilename(d->err, appleFilename, commandArgs[0]);
+			if (cac > 1) {
+				strcpy(outputFilename, commandArgs[1]);
 			} else {
-				if (!file_deleted) {
-					return 1;
-				}
+				strcpy(outputFilename, appleFilename);
 			}
-		}
-	}
-	return 0;
-}
+			r = dos33Load(d, appleFilename, outputFilename);
+			break;
 
-/*****************************************************************************/
-static void dos33FindEmptyEntry() {
-	dos33ReadVtoc();
-	while (dos33GetNextCatEntry()) {
-		if (catEntry.fileEntry.TsList.track == 0xFF) {
-			return;
-		}
-	}
-}
+		case COMMAND_SAVE:
+			if (cac == 0) {
+				fprintf(d->err,"Error! Need filename\n");
+				return 1;
+			}
+			strcpy(inputFilename, commandArgs[0]);
+			if (cac == 1 && 0 == strcmp(inputFilename, "-")) {
+				fprintf(d->err,"Error! Need apple filename to save stdin\n");
+				return 1;
+			}
+			if (cac > 1) {
+				dos33ParseHostFilename(d, inputFilename, NULL, &d->type,
+					&d->address);
+				truncateFilename(d->err, appleFilename, commandArgs[1]);
+			} else {
+				dos33ParseHostFilename(d, inputFilename, appleFilename,
+					&d->type, &d->address);
+			}
+			r = dos33Save(d, inputFilename, appleFilename);
+			// Keeping an existing file without -f is not a failure
+			if (r == DOS33_ERR_EXISTS) {
+				r = DOS33_OK;
+			}
+			break;
 
-/*****************************************************************************/
-static void cmdCatalog() {
-	char	name[FILENAME_MAX];
-	int		i, nl;
-
-	dos33ReadVtoc();
-	printf("DISK VOLUME %d\n\n", vtoc.diskVolume);
-	while (dos33GetNextCatEntry()) {
-		nl = FILE_NAME_SIZE;
-		if (catEntry.fileEntry.TsList.track == 0xFF) {
-			--nl;
-			printf("#");
-		} else {
-			printf(" ");
-		}
-		if (catEntry.fileEntry.type & 0x80) {
-			printf("*");
-		} else {
-			printf(" ");
-		}
-		printf("%c", dos33TypeToLetter(catEntry.fileEntry.type));
-		printf(" ");
-		printf("%.3i ", catEntry.fileEntry.size);
-		dos33FilenameToAscii(name, catEntry.fileEntry.name, nl);
-		// convert inverse chars
-		for(i = 0; i < strlen(name); i++) {
-			if (name[i] < 0x20) {
-				printf("^%c", name[i] + 0x40);
+		case COMMAND_DELETE:
+		case COMMAND_UNDELETE:
+		case COMMAND_LOCK:
+		case COMMAND_UNLOCK:
+			if (cac == 0) {
+				fprintf(d->err,"Error! Need apple filename\n");
+				return 1;
+			}
+			truncateFilename(d->err, appleFilename, commandArgs[0]);
+			if (command == COMMAND_DELETE) {
+				r = dos33Delete(d, appleFilename);
+			} else if (command == COMMAND_UNDELETE) {
+				r = dos33Undelete(d, appleFilename);
 			} else {
-				printf("%c", name[i]);
+				r = dos33Lock(d, appleFilename, command == COMMAND_LOCK);
 			}
-		}
-		printf("\n");
-	}
-}
+			break;
 
-/*****************************************************************************/
-static void cmdLoad(char *appleFilename, char *outputFilename) {
-	char				tempStr[FILENAME_MAX];
-	struct StslHeader	header;
-	struct Sts			dataTs[TSL_MAX_NUMBER], nextTs;
-	int					i, r, tslPointer, bufPointer;
-	int					fileSize, offset, aux;
-	char				*buffer = NULL;
-	FILE				*outputFile = NULL;
-
-	if (!dos33CheckFileExists(appleFilename, 0)) {
-		fprintf(stderr, "Apple filename not found.\n");
-		return;
-	}
-	// Alloc data buffer
-	buffer = (char *)malloc(BYTES_PER_SECTOR * catEntry.fileEntry.size);
-	bufPointer = 0;
-	nextTs.track = catEntry.fileEntry.TsList.track;
-	nextTs.sector = catEntry.fileEntry.TsList.sector;
-	while (1) {
-		// Read TSL
-		fseek(dskFile, diskOffset(nextTs.track, nextTs.sector), SEEK_SET);
-		r = fread(&header, 1, sizeof(header), dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
-		}
-		nextTs.track = header.nextTs.track;
-		nextTs.sector = header.nextTs.sector;
-		tslPointer = 0;
-		while(tslPointer < TSL_MAX_NUMBER) {
-			r = fread(&dataTs[tslPointer], 1, sizeof(struct Sts), dskFile);
-			if (r < 0) {
-				fprintf(stderr, "Error on I/O\n");
-				exit(1);
+		case COMMAND_RENAME:
+			if (cac < 2) {
+				fprintf(d->err,"Error! Need two apple filename\n");
+				return 1;
 			}
-			if (dataTs[tslPointer].track == 0 && dataTs[tslPointer].sector == 0) {
-				break;
+			truncateFilename(d->err, appleFilename, commandArgs[0]);
+			truncateFilename(d->err, newAppleFilename, commandArgs[1]);
+			r = dos33Rename(d, appleFilename, newAppleFilename);
+			break;
+
+		case COMMAND_DUMP:
+			r = dos33Dump(d);
+			break;
+
+		case COMMAND_VERIFY:
+			r = dos33Verify(d);
+			break;
+
+		case COMMAND_SCAN:
+		case COMMAND_RECOVER:
+			r = dos33Recover(d, command == COMMAND_RECOVER);
+			break;
+
+		case COMMAND_OPTIMIZE:
+			if (cac > 0) {
+				truncateFilename(d->err, appleFilename, commandArgs[0]);
 			}
-			++tslPointer;
-		}
-		// Read data
-		for (i = 0; i < tslPointer; i++) {
-			fseek(dskFile, diskOffset(dataTs[i].track, dataTs[i].sector), SEEK_SET);
-			r = fread(&buffer[bufPointer], 1, BYTES_PER_SECTOR, dskFile);
-			if (r < 0) {
-				fprintf(stderr, "Error on I/O\n");
-				exit(1);
+			r = dos33Optimize(d, appleFilename);
+			break;
+
+		case COMMAND_ARCHIVE:
+			if (cac == 0) {
+				fprintf(d->err,"Error! Need directory name\n");
+				return 1;
 			}
-			bufPointer += r;
-		}
-		if (nextTs.track == 0 && nextTs.sector == 0) {
+			r = dos33Archive(d, commandArgs[0]);
 			break;
-		}
-	}
-	// process file
-	aux = 0;
-	type = dos33TypeToLetter(catEntry.fileEntry.type);
-	switch(type) {
-		case 'A':
-		case 'I':
-			aux = 0x0801;
-			fileSize = WORD(buffer[1], buffer[0]);
-			offset = 2;
+
+		case COMMAND_UNARCHIVE:
+			if (cac == 0) {
+				fprintf(d->err,"Error! Need image filename\n");
+				return 1;
+			}
+			r = dos33Unarchive(d, commandArgs[0]);
+			break;
+
+		case COMMAND_SAVEDIR:
+		case COMMAND_SYNC:
+		case COMMAND_LOADALL:
+			if (cac == 0) {
+				fprintf(d->err,"Error! Need directory name\n");
+				return 1;
+			}
+			if (command == COMMAND_SAVEDIR) {
+				r = dos33SaveDir(d, commandArgs[0]);
+			} else if (command == COMMAND_SYNC) {
+				r = dos33Sync(d, commandArgs[0]);
+			} else {
+				r = dos33LoadAll(d, commandArgs[0]);
+			}
 			break;
 
-		case 'B':
-			aux = WORD(buffer[1], buffer[0]);
-			fileSize = WORD(buffer[3], buffer[2]);
-			offset = 4;
+		case COMMAND_INIT:
+			if (cac > 0) {
+				strcpy(inputFilename, commandArgs[0]);
+			}
+			r = dos33Format(d, inputFilename);
 			break;
-		
+
 		default:
-			offset = 0;
-			fileSize = bufPointer;
-	}
-	if (raw) {
-		strcpy(tempStr, outputFilename);
-	} else {
-		sprintf(tempStr, "%s#%02X%04X", outputFilename, 
-			dos33TypeToHex(catEntry.fileEntry.type), aux);
-	}
-	outputFile = fopen(tempStr, "wb");
-	if (NULL == outputFile) {
-		fprintf(stderr,"Error opening '%s' for write.\n", tempStr);
-		exit(1);
-	}
-	if (raw) {
-		fwrite(buffer, 1, fileSize + offset, outputFile);
-	} else {
-		fwrite(buffer + offset, 1, fileSize, outputFile);
+			return 1;
 	}
-	fclose(outputFile);
+	return (r < 0) ? 1 : 0;
 }
 
 /*****************************************************************************/
-static void dos33DeleteFile(char *appleFilename) {
-    int					r, tslPointer;
-	struct StslHeader	header;
-	struct Sts			nextTs, dataTs;
-
-	if (!dos33CheckFileExists(appleFilename, 0)) {
-		fprintf(stderr, 
-			"Error! File %s does not exist or already deleted.\n", 
-			appleFilename);
-		return;
-	}
-	if (catEntry.fileEntry.type & 0x80) {
-       fprintf(stderr, "File is locked! Unlock before deleting!\n");
-       return;
-	}
-	nextTs.track = catEntry.fileEntry.TsList.track;
-	nextTs.sector = catEntry.fileEntry.TsList.sector;
-	while (1) {
-		// Read TSL
-		fseek(dskFile, diskOffset(nextTs.track, nextTs.sector), SEEK_SET);
-		r = fread(&header, 1, sizeof(header), dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
-		}
-		// Release TSL TS
-		dos33ReleaseTs(nextTs.track, nextTs.sector);
-		//
-		nextTs.track = header.nextTs.track;
-		nextTs.sector = header.nextTs.sector;
-		tslPointer = 0;
-		while(tslPointer < TSL_MAX_NUMBER) {
-			r = fread(&dataTs, 1, sizeof(struct Sts), dskFile);
-			if (r < 0) {
-				fprintf(stderr, "Error on I/O\n");
-				exit(1);
+static int parseLine(struct Sdos33 *d, int argc, char **argv, char **image,
+		int *command, int *cac, char commandArgs[][FILENAME_MAX]) {
+	int c, i;
+
+	// Options may be anywhere, the first other word names the image when
+	// asked for one, the next one the command
+	*command = COMMAND_UNKNOWN;
+	*cac = 0;
+	for (c = 0; c < argc; c++) {
+		if (argv[c][0] == '-' && argv[c][1] != '\0') {
+			c = parseOption(d, argc, argv, c);
+			if (c < 0) {
+				return -1;
 			}
-			if (dataTs.track == 0 && dataTs.sector == 0) {
-				break;
+		} else if (NULL != image && NULL == *image) {
+			*image = argv[c];
+		} else if (*command == COMMAND_UNKNOWN) {
+			for(i = 0; i < strlen(argv[c]); i++) {
+				argv[c][i] = toupper(argv[c][i]);
 			}
-			// Release data TS
-			dos33ReleaseTs(dataTs.track, dataTs.sector);
-			++tslPointer;
-		}
-		if (nextTs.track == 0 && nextTs.sector == 0) {
-			break;
+			*command = lookupCommand(argv[c]);
+			if (*command == COMMAND_UNKNOWN) {
+				fprintf(d->err,"Unknown command '%s'\n", argv[c]);
+				return -1;
+			}
+		} else if (*cac < 10) {
+			if (strlen(argv[c]) >= FILENAME_MAX) {
+				fprintf(d->err, "Error! Argument too long\n");
+				return -1;
+			}
+			strcpy(commandArgs[(*cac)++], argv[c]);
 		}
 	}
-	// Save track to last name char and mark as deleted
-	catEntry.fileEntry.name[FILE_NAME_SIZE-1] = catEntry.fileEntry.TsList.track;
-	catEntry.fileEntry.TsList.track = 0xFF;
-	dos33SaveActCatEntry();
-	dos33SaveVtoc();
+	return (*command == COMMAND_UNKNOWN) ? -1 : 0;
 }
 
 /*****************************************************************************/
-static void dos33UndeleteFile(char *appleFilename) {
-    int					r, tslPointer;
-	struct StslHeader	header;
-	struct Sts			nextTs, dataTs;
-
-	if (!dos33CheckFileExists(appleFilename, 1)) {
-		fprintf(stderr, 
-			"Error! File %s does not exist or not deleted.\n", 
-			appleFilename);
-		return;
-	}
-	// Restore TSL track
-	catEntry.fileEntry.TsList.track = catEntry.fileEntry.name[FILE_NAME_SIZE-1];
-	if (catEntry.fileEntry.TsList.track >= TRACKS_PER_DISK) {
-		fprintf(stderr, "Error undeleting file, track > %d\n", TRACKS_PER_DISK);
-		return;
+static int cmdBatch(struct Sdos33 *d, char *scriptFilename) {
+	char	line[FILENAME_MAX];
+	char	commandArgs[10][FILENAME_MAX];
+	char	*lineArgv[16];
+	FILE	*script;
+	int		lineArgc, lineNum = 0, errors = 0;
+	int		command, cac, c;
+	int		optForce = d->force, optRaw = d->raw, optAddress = d->address;
+	char	optType = d->type;
+
+	if (0 == strcmp(scriptFilename, "-")) {
+		script = stdin;
+	} else {
+		script = fopen(scriptFilename, "r");
+		if (NULL == script) {
+			fprintf(d->err,"Error opening '%s' for read.\n", scriptFilename);
+			return -1;
+		}
 	}
-	catEntry.fileEntry.name[FILE_NAME_SIZE-1] = ' ' | 0x80;
-	nextTs.track = catEntry.fileEntry.TsList.track;
-	nextTs.sector = catEntry.fileEntry.TsList.sector;
-	while (1) {
-		// Read TSL
-		fseek(dskFile, diskOffset(nextTs.track, nextTs.sector), SEEK_SET);
-		r = fread(&header, 1, sizeof(header), dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
+	while (fgets(line, sizeof(line), script)) {
+		++lineNum;
+		// The rest of a line too long is skipped, not taken as another one
+		if (NULL == strchr(line, '\n') && !feof(script)) {
+			while ((c = fgetc(script)) != EOF && c != '\n')
+				;
+			fprintf(d->err, "%s:%d: line too long\n", scriptFilename,
+				lineNum);
+			++errors;
+			continue;
 		}
-		// Re-alloc TSL TS
-		dos33AllocTs(nextTs.track, nextTs.sector);
-		//
-		nextTs.track = header.nextTs.track;
-		nextTs.sector = header.nextTs.sector;
-		tslPointer = 0;
-		while(tslPointer < TSL_MAX_NUMBER) {
-			r = fread(&dataTs, 1, sizeof(struct Sts), dskFile);
-			if (r < 0) {
-				fprintf(stderr, "Error on I/O\n");
-				exit(1);
-			}
-			if (dataTs.track == 0 && dataTs.sector == 0) {
-				break;
-			}
-			// Re-alloc data TS
-			dos33AllocTs(dataTs.track, dataTs.sector);
-			++tslPointer;
+		lineArgc = splitArgs(line, lineArgv, 16);
+		if (lineArgc == 0 || lineArgv[0][0] == ';') {
+			continue;
 		}
-		if (nextTs.track == 0 && nextTs.sector == 0) {
-			break;
+		// Each line starts from the options given on the command line
+		d->force = optForce;
+		d->raw = optRaw;
+		d->address = optAddress;
+		d->type = optType;
+		if (parseLine(d, lineArgc, lineArgv, NULL, &command, &cac,
+				commandArgs) < 0) {
+			fprintf(d->err, "%s:%d: invalid line\n", scriptFilename, lineNum);
+			++errors;
+			continue;
+		}
+		if (command == COMMAND_BATCH) {
+			fprintf(d->err, "%s:%d: BATCH can not be nested\n",
+				scriptFilename, lineNum);
+			++errors;
+			continue;
+		}
+		if (runCommand(d, command, cac, commandArgs) != 0) {
+			fprintf(d->err, "%s:%d: command failed\n", scriptFilename,
+				lineNum);
+			++errors;
 		}
 	}
-	dos33SaveActCatEntry();
-	dos33SaveVtoc();
+	if (script != stdin) {
+		fclose(script);
+	}
+	return errors ? -1 : 0;
 }
 
 /*****************************************************************************/
-static void cmdSave(char *inputFilename, char *appleFilename) {
-	FILE				*inputFile;
-	int					i, r, length, fileSize, offset, tsOffset;
-	int					freeSpace, neededSectors, sizeInSectors, sectorsUsed;
-	struct Sts			oldTs, newTs, dataTs[TSL_MAX_NUMBER];
-	struct StslHeader	header;
-	int					tslPointer, bufPointer;
-	char				*buffer;
-
-	//printf("SAVE: file %s, applefile %s, address %d, type: %c\n", inputFilename, appleFilename, address, type);
-	if (!raw && address == -1) {
-		fprintf(stderr, "Error! no raw mode needs an address.\n");
-		return;
-	}
-	if (address < 0 || address > 0xFFFF) {
-		fprintf(stderr,"Error! invalid address.\n");
-		return;
+static int runImage(struct Sdos33 *d, int command, int cac,
+		char commandArgs[][FILENAME_MAX]) {
+	int r, i;
+
+	statsPhase(d, &d->stats.command, 1);
+	if (command == COMMAND_BATCH) {
+		r = (cmdBatch(d, commandArgs[0]) < 0) ? 1 : 0;
+	} else {
+		r = runCommand(d, command, cac, commandArgs);
 	}
-	if (type == '?') {
-		fprintf(stderr,"Error! type unknown.\n");
-		return;
+	statsPhase(d, &d->stats.command, 0);
+	statsPhase(d, &d->stats.commit, 1);
+	if (dos33Close(d) < 0) {
+		r = 1;
 	}
-	if (!checkAppleFilename(appleFilename)) {
-		return;
+	statsPhase(d, &d->stats.commit, 0);
+	if (statsMode != STATS_NONE) {
+		for (i = 0; i < num_commands && commands[i].type != command; i++)
+			;
+		statsPrint(d, d->err, i < num_commands ? commands[i].name : "?");
 	}
-	inputFile = fopen(inputFilename, "rb");
-	if (NULL == inputFile) {
-		fprintf(stderr,"Error opening '%s' for read.\n", inputFilename);
-		return;
+	return r;
+}
+
+/*****************************************************************************/
+static void fanOutputName(char *dest, int size, char *imageFilename) {
+	char	*p;
+
+	// Whole path flattened, so equal names in different folders don't clash
+	while (*imageFilename == '/' || *imageFilename == '\\' ||
+			(imageFilename[0] == '.' && (imageFilename[1] == '/' ||
+			imageFilename[1] == '\\'))) {
+		++imageFilename;
 	}
-	if (dos33CheckFileExists(appleFilename, 0)) {
-		fprintf(stderr, "Warning! %s exists!\n", appleFilename);
-		if (!force) {
-			printf("Exiting early...\n");
-			fclose(inputFile);
-			return;
+	snprintf(dest, size, "%s", imageFilename);
+	for (p = dest; *p != '\0'; p++) {
+		if (*p == '/' || *p == '\\' || *p == ':') {
+			*p = '_';
 		}
-		fprintf(stderr, "Deleting previous version...\n");
-		dos33DeleteFile(appleFilename);
-	}
-	dos33FindEmptyEntry();
-	// Get input file size
-	fseek(inputFile, 0, SEEK_END);
-	fileSize = ftell(inputFile);
-	fseek(inputFile, 0, SEEK_SET);
-	offset = 0;
-	length = fileSize;
-	if (!raw) {
-		switch(type) {
-			case 'A':
-			case 'I':
-				offset = 2;
-				break;
+	}
+}
 
-			case 'B':
-				offset = 4;
-				break;
+/*****************************************************************************/
+static void fanEmitLines(FILE *f, char *prefix, char *buffer, size_t len) {
+	char	*eol;
+	size_t	n;
+
+	while (len > 0) {
+		eol = (char *)memchr(buffer, '\n', len);
+		n = (NULL == eol) ? len : (size_t)(eol - buffer);
+		fprintf(f, "%s: %.*s\n", prefix, (int)n, buffer);
+		if (NULL == eol) {
+			break;
+		}
+		buffer += n + 1;
+		len -= n + 1;
+	}
+}
 
-			default:
-				offset = 0;
+/*****************************************************************************/
+static void fanEmit(struct SfanOut *fan, struct SfanJob *job) {
+	char	*p = job->out, *eol;
+	size_t	len = job->outLen;
+
+	// Records of a CATALOG listing carry their image name, so they are
+	// written as they are and the CSV/TSV header only once
+	if (fan->command == COMMAND_CATALOG && fan->format != DOS33_FORMAT_TEXT) {
+		eol = (NULL == p) ? NULL : (char *)memchr(p, '\n', len);
+		if (fan->format != DOS33_FORMAT_JSON && fan->emitted > 0 &&
+				NULL != eol) {
+			len -= eol + 1 - p;
+			p = eol + 1;
 		}
-		fileSize += offset;
-	}
-	// We need to round up to nearest sector size
-	// Add an extra sector for the T/S list
-	// Then add extra sector for a T/S list every 122*256 bytes (~31k)
-	neededSectors = (fileSize / BYTES_PER_SECTOR) +		// round sectors
-			((fileSize % BYTES_PER_SECTOR) != 0) +		// tail if needed
-			1 + 										// first T/S list
-			(fileSize / (122 * BYTES_PER_SECTOR));		// extra t/s lists
-	// Get free space on device
-	freeSpace = dos33GetFreeSpace();
-	// Check for free space
-	if (neededSectors * BYTES_PER_SECTOR > freeSpace) {
-		fprintf(stderr, "Error! Not enough free space "
-				"on disk image (need %d, have %d)\n",
-				neededSectors * BYTES_PER_SECTOR, freeSpace);
-		fclose(inputFile);
-		return;
+		if (len > 0) {
+			fwrite(p, 1, len, stdout);
+		}
+	} else {
+		fanEmitLines(stdout, job->imageFilename, job->out, job->outLen);
 	}
-	// plus one because we need a sector for the tail
-	sizeInSectors = (fileSize / BYTES_PER_SECTOR) +
-		((fileSize % BYTES_PER_SECTOR) != 0);
-
-	// Alloc buffer and read input file
-	buffer = (char *)malloc(fileSize);
-	r = fread(buffer + offset, 1, fileSize - offset, inputFile);
-	fclose(inputFile);
-	switch(type) {
-		case 'A':
-		case 'I':
-			buffer[0] = LOW(length);
-			buffer[1] = HIGH(length);
-			break;
+	++fan->emitted;
+	if (job->errLen > 0) {
+		// Keep both streams in step when they go to the same place
+		fflush(stdout);
+		fanEmitLines(stderr, job->imageFilename, job->err, job->errLen);
+	}
+	free(job->out);
+	free(job->err);
+	job->out = job->err = NULL;
+}
 
-		case 'B':
-			buffer[0] = LOW(address);
-			buffer[1] = HIGH(address);
-			buffer[2] = LOW(length);
-			buffer[3] = HIGH(length);
-			break;
+/*****************************************************************************/
+static int fanTake(struct SfanOut *fan, int id) {
+	struct SfanQueue	*own = &fan->queues[id], *victim;
+	int					i, n, first = -1;
 
-		default:
-			break;
+	pthread_mutex_lock(&own->lock);
+	if (own->begin < own->end) {
+		first = own->begin++;
+	}
+	pthread_mutex_unlock(&own->lock);
+	if (first >= 0) {
+		return first;
+	}
+	for (i = 1; i < fan->numWorkers && first < 0; i++) {
+		victim = &fan->queues[(id + i) % fan->numWorkers];
+		pthread_mutex_lock(&victim->lock);
+		n = victim->end - victim->begin;
+		if (n > 0) {
+			first = victim->end - (n + 1) / 2;
+			victim->end = first;
+			n = (n + 1) / 2;
+		}
+		pthread_mutex_unlock(&victim->lock);
 	}
-	// Alloc all sectors
-	i = 0;
-	sectorsUsed = 0;
-	newTs.track = 0;
-	newTs.sector = 0;
-	tsOffset = 0;
-	while (i < sizeInSectors) {
-
-		// Create new T/S list if necessary
-		if (i % TSL_MAX_NUMBER == 0) {
-			// allocate a sector for the new list
-			if (!dos33FindAndAllocSector(&newTs)) {
-				return;
+	if (first >= 0) {
+		// First stolen job is run now, the rest goes to our own range
+		pthread_mutex_lock(&own->lock);
+		own->begin = first + 1;
+		own->end = first + n;
+		pthread_mutex_unlock(&own->lock);
+	}
+	return first;
+}
+
+/*****************************************************************************/
+static void fanRunJob(struct SfanOut *fan, struct SfanJob *job) {
+	struct Sdos33	d;
+	char			commandArgs[10][FILENAME_MAX];
+	char			name[FILENAME_MAX];
+	char			path[FILENAME_MAX * 2 + 8];
+	FILE			*out, *err;
+
+	memcpy(commandArgs, fan->commandArgs, sizeof(commandArgs));
+	fanOutputName(name, sizeof(name), job->imageFilename);
+	// Each image is extracted to its own subdirectory
+	if (fan->command == COMMAND_LOADALL && fan->cac > 0) {
+		snprintf(path, sizeof(path), "%s/%s", fan->commandArgs[0], name);
+		if (strlen(path) >= FILENAME_MAX) {
+			fprintf(stderr, "%s: Error! Path too long\n", job->imageFilename);
+			job->result = 1;
+			return;
+		}
+		strcpy(commandArgs[0], path);
+	}
+	if (NULL != fan->outDir) {
+		snprintf(path, sizeof(path), "%s/%s.txt", fan->outDir, name);
+		out = fopen(path, "w");
+		if (NULL == out) {
+			fprintf(stderr,"Error opening '%s' for write.\n", path);
+			job->result = 1;
+			return;
+		}
+		err = out;
+	} else {
+		out = open_memstream(&job->out, &job->outLen);
+		err = open_memstream(&job->err, &job->errLen);
+		if (NULL == out || NULL == err) {
+			if (NULL != out) {
+				fclose(out);
 			}
-			++sectorsUsed;
-			if (i == 0) {
-				// Is the first allocation, just save in the file entry
-				catEntry.fileEntry.TsList.track = newTs.track;
-				catEntry.fileEntry.TsList.sector = newTs.sector;
-			} else {
-				// New TSL sector, save actual
-				memset(&header, 0, sizeof(header));
-				header.nextTs.track = newTs.track;
-				header.nextTs.sector = newTs.sector;
-				// set TSL offset
-				header.offset = tsOffset;
-				tsOffset += i;
-				//
-				fseek(dskFile, diskOffset(oldTs.track, oldTs.sector), SEEK_SET);
-				r = fwrite(&header, 1, sizeof(header), dskFile);
-				if (r < 0) {
-					fprintf(stderr, "Error on I/O\n");
-					exit(1);
-				}
-				for (i = 0; i < TSL_MAX_NUMBER; i++) {
-					r = fwrite(&dataTs[i], 1, sizeof(struct Sts), dskFile);
-					if (r < 0) {
-						fprintf(stderr, "Error on I/O\n");
-						exit(1);
-					}
-				}
+			if (NULL != err) {
+				fclose(err);
 			}
-			// Uses oldTs to indicate actual TS
-			oldTs.track = newTs.track;
-			oldTs.sector = newTs.sector;
-			memset(&dataTs, 0, sizeof(dataTs));
-			tslPointer = 0;
-		}
-		/* allocate a sector */
-		if (!dos33FindAndAllocSector(&newTs)) {
+			fprintf(stderr, "%s: Error allocating memory\n",
+				job->imageFilename);
+			job->result = 1;
 			return;
 		}
-		++sectorsUsed;
-		dataTs[tslPointer].track = newTs.track;
-		dataTs[tslPointer].sector = newTs.sector;
-		++tslPointer;
-		++i;
-	}
-	// Save last TSL
-	memset(&header, 0, sizeof(header));
-	if (i > TSL_MAX_NUMBER) {
-		// set TSL offset
-		header.offset = tsOffset;
-	}
-	fseek(dskFile, diskOffset(oldTs.track, oldTs.sector), SEEK_SET);
-	r = fwrite(&header, 1, sizeof(header), dskFile);
-	if (r < 0) {
-		fprintf(stderr, "Error on I/O\n");
-		exit(1);
 	}
-	for (i = 0; i < TSL_MAX_NUMBER; i++) {
-		r = fwrite(&dataTs[i], 1, sizeof(struct Sts), dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
+	dos33Setup(&d, job->imageFilename, out, err);
+	d.force = fan->force;
+	d.raw = fan->raw;
+	d.address = fan->address;
+	d.type = fan->type;
+	d.formatTracks = fan->formatTracks;
+	d.formatSectors = fan->formatSectors;
+	d.repair = fan->repair;
+	d.format = fan->format;
+	// Images are already spread over the cores, don't multiply threads
+	d.threads = 1;
+	job->result = runImage(&d, fan->command, fan->cac, commandArgs);
+	if (err != out) {
+		fclose(err);
+	}
+	fclose(out);
+}
+
+/*****************************************************************************/
+static void fanFinish(struct SfanOut *fan, struct SfanJob *job) {
+	pthread_mutex_lock(&fan->outLock);
+	job->done = 1;
+	if (job->result != 0) {
+		++fan->errors;
+	}
+	if (NULL == fan->outDir) {
+		if (fan->ordered) {
+			// Hold the output until every image before it is written
+			while (fan->nextEmit < fan->numJobs &&
+					fan->jobs[fan->nextEmit].done) {
+				fanEmit(fan, &fan->jobs[fan->nextEmit++]);
+			}
+		} else {
+			fanEmit(fan, job);
 		}
 	}
-	fflush(dskFile);
-	// Sectors allocated, now read TSs and save file
-	newTs.track = catEntry.fileEntry.TsList.track;
-	newTs.sector = catEntry.fileEntry.TsList.sector;
-	bufPointer = 0;
-	while (1) {
-		// Read TSL
-		fseek(dskFile, diskOffset(newTs.track, newTs.sector), SEEK_SET);
-		r = fread(&header, 1, sizeof(header), dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
+	pthread_mutex_unlock(&fan->outLock);
+}
+
+/*****************************************************************************/
+static void *fanWorker(void *arg) {
+	struct SfanWorker	*worker = (struct SfanWorker *)arg;
+	int					j;
+
+	while ((j = fanTake(worker->fan, worker->id)) >= 0) {
+		fanRunJob(worker->fan, &worker->fan->jobs[j]);
+		fanFinish(worker->fan, &worker->fan->jobs[j]);
+	}
+	return NULL;
+}
+
+/*****************************************************************************/
+static int runFanOut(struct SfanOut *fan, char **images, int numImages,
+		int numWorkers) {
+	struct SfanWorker	workers[MAX_WORKERS];
+	pthread_t			threads[MAX_WORKERS];
+	int					i, created;
+
+	fan->numJobs = numImages;
+	fan->jobs = (struct SfanJob *)calloc(numImages, sizeof(struct SfanJob));
+	if (NULL == fan->jobs) {
+		fprintf(stderr, "Error allocating memory\n");
+		return 1;
+	}
+	for (i = 0; i < numImages; i++) {
+		fan->jobs[i].imageFilename = images[i];
+	}
+	if (numWorkers < 1) {
+		numWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (numWorkers > numImages) {
+		numWorkers = numImages;
+	}
+	if (numWorkers > MAX_WORKERS) {
+		numWorkers = MAX_WORKERS;
+	}
+	if (numWorkers < 1) {
+		numWorkers = 1;
+	}
+	fan->numWorkers = numWorkers;
+	pthread_mutex_init(&fan->outLock, NULL);
+	for (i = 0; i < numWorkers; i++) {
+		pthread_mutex_init(&fan->queues[i].lock, NULL);
+		fan->queues[i].begin = (int)((long)numImages * i / numWorkers);
+		fan->queues[i].end = (int)((long)numImages * (i + 1) / numWorkers);
+		workers[i].fan = fan;
+		workers[i].id = i;
+	}
+	// Ranges of threads that fail to start are stolen by the others
+	for (created = 1; created < numWorkers; created++) {
+		if (pthread_create(&threads[created], NULL, fanWorker,
+				&workers[created]) != 0) {
+			break;
 		}
-		newTs.track = header.nextTs.track;
-		newTs.sector = header.nextTs.sector;
-		tslPointer = 0;
-		while(tslPointer < TSL_MAX_NUMBER) {
-			r = fread(&dataTs[tslPointer], 1, sizeof(struct Sts), dskFile);
-			if (r < 0) {
-				fprintf(stderr, "Error on I/O\n");
-				exit(1);
-			}
-			if (dataTs[tslPointer].track == 0 && dataTs[tslPointer].sector == 0) {
-				break;
-			}
-			++tslPointer;
+	}
+	fanWorker(&workers[0]);
+	for (i = 1; i < created; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	for (i = 0; i < numWorkers; i++) {
+		pthread_mutex_destroy(&fan->queues[i].lock);
+	}
+	pthread_mutex_destroy(&fan->outLock);
+	free(fan->jobs);
+	return fan->errors ? 1 : 0;
+}
+
+/*****************************************************************************/
+static int readImageList(char *listFilename, char ***images, int *numImages,
+		int *maxImages) {
+	char	line[FILENAME_MAX];
+	char	**p;
+	FILE	*list;
+	int		len, r = 0;
+
+	if (0 == strcmp(listFilename, "-")) {
+		list = stdin;
+	} else {
+		list = fopen(listFilename, "r");
+		if (NULL == list) {
+			fprintf(stderr,"Error opening '%s' for read.\n", listFilename);
+			return -1;
 		}
-		// Write data
-		for (i = 0; i < tslPointer; i++) {
-			fseek(dskFile, diskOffset(dataTs[i].track, dataTs[i].sector), SEEK_SET);
-			r = fwrite(&buffer[bufPointer], 1, BYTES_PER_SECTOR, dskFile);
-			if (r < 0) {
-				fprintf(stderr, "Error on I/O\n");
-				exit(1);
+	}
+	while (fgets(line, sizeof(line), list)) {
+		len = strlen(line);
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+			line[--len] = '\0';
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (*numImages == *maxImages) {
+			len = *maxImages ? *maxImages * 2 : 256;
+			p = (char **)realloc(*images, len * sizeof(char *));
+			if (NULL == p) {
+				r = -1;
+				break;
 			}
-			bufPointer += r;
+			*images = p;
+			*maxImages = len;
 		}
-		if (newTs.track == 0 && newTs.sector == 0) {
+		(*images)[*numImages] = strdup(line);
+		if (NULL == (*images)[*numImages]) {
+			r = -1;
 			break;
 		}
+		++*numImages;
 	}
-	catEntry.fileEntry.type = dos33LetterToType(type, 0);
-	catEntry.fileEntry.size = sectorsUsed;
-	// copy over filename 
-	for (i = 0; i < strlen(appleFilename); i++) {
-		catEntry.fileEntry.name[i] = appleFilename[i] | 0x80;
+	if (r < 0) {
+		fprintf(stderr, "Error allocating memory\n");
 	}
-	// pad out the filename with spaces
-	for(i = strlen(appleFilename); i < FILE_NAME_SIZE; i++) {
-		catEntry.fileEntry.name[i] = ' ' | 0x80;
+	if (list != stdin) {
+		fclose(list);
 	}
-	dos33SaveActCatEntry();
-	dos33SaveVtoc();
+	return r;
 }
 
+#ifndef _WIN32
 /*****************************************************************************/
-static void cmdDump() {
-	int i, j, b;
+static void serveKey(char *key, const char *filename) {
+	char		dir[FILENAME_MAX], real[PATH_MAX];
+	const char	*base = strrchr(filename, '/');
+
+	// Same image under another name or from another directory, same entry.
+	// The image itself may not exist yet, only its directory is resolved
+	if (NULL == base) {
+		strcpy(dir, ".");
+		base = filename;
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", (base == filename) ? 1 :
+			(int)(base - filename), filename);
+		++base;
+	}
+	if (NULL == realpath(dir, real) ||
+			strlen(real) + strlen(base) + 2 > FILENAME_MAX) {
+		strncpy(key, filename, FILENAME_MAX - 1);
+		key[FILENAME_MAX - 1] = '\0';
+		return;
+	}
+	strcpy(key, real);
+	if (0 != strcmp(real, "/")) {
+		strcat(key, "/");
+	}
+	strcat(key, base);
+}
 
-	dos33ReadVtoc();
-	printf("\n");
-	printf("VTOC INFORMATION:\n");
-	printf("\tFirst Catalog = %02X/%02X\n", vtoc.catalog.track, 
-		vtoc.catalog.sector);
-	printf("\tDOS RELEASE = 3.%i\n", vtoc.dosRelease);
-	printf("\tDISK VOLUME = %i\n", vtoc.diskVolume);
-	printf("\tT/S pairs that will fit in T/S List = %i\n", vtoc.maxTSPairs);
-	printf("\tLast track where sectors were allocated = $%02X\n",
-		vtoc.lastAllocTrack);
-	printf("\tDirection of track allocation = %i\n", vtoc.allocDirection);
-	printf("\tNumber of tracks per disk = %i\n", vtoc.numTracks);
-	printf("\tNumber of sectors per track = %i\n", vtoc.sectorsPerTrack);
-	printf("\tNumber of bytes per sector = %i\n", vtoc.bytesPerSector);
-	printf("\nFree sector bitmap:\n\n");
-	printf("\t                1111111111111111222\n");
-	printf("\t0123456789ABCDEF0123456789ABCDEF012\n");
-	for(j = 0; j < SECTORS_PER_TRACK; j++) {
-		printf("$%01X:\t",j);
-		for(i = 0; i < TRACKS_PER_DISK; i++) {
-			if (j < 8) {
-				b = vtoc.bitmap[i][1] >> j;
-			} else {
-				b = vtoc.bitmap[i][0] >> (j - 8);
+/*****************************************************************************/
+static struct SserveEntry *serveAcquire(struct Sserve *srv,
+		const char *imageFilename) {
+	struct SserveEntry	*e = NULL, *lru;
+	char				key[FILENAME_MAX];
+	int					i, k = 0;
+
+	serveKey(key, imageFilename);
+	pthread_mutex_lock(&srv->lock);
+	if (srv->stop) {
+		pthread_mutex_unlock(&srv->lock);
+		return NULL;
+	}
+	for (i = 0; i < srv->numEntries; i++) {
+		if (0 == strcmp(srv->entries[i]->d.filename, key)) {
+			e = srv->entries[i];
+			break;
+		}
+	}
+	if (NULL == e) {
+		// Images no request is using go, least recently used first. Each
+		// connection uses one at a time, so the table never runs out
+		while (srv->numEntries >= srv->cacheSize) {
+			lru = NULL;
+			for (i = 0; i < srv->numEntries; i++) {
+				if (srv->entries[i]->refs == 0 && (NULL == lru ||
+						srv->entries[i]->lastUsed < lru->lastUsed)) {
+					lru = srv->entries[i];
+					k = i;
+				}
 			}
-			if (b & 0x01) {
-				printf(".");
-			} else {
-				printf("U");
+			if (NULL == lru) {
+				break;
 			}
+			dos33Close(&lru->d);
+			pthread_mutex_destroy(&lru->lock);
+			free(lru);
+			srv->entries[k] = srv->entries[--srv->numEntries];
 		}
-		printf("\n");
+		e = (struct SserveEntry *)calloc(1, sizeof(struct SserveEntry));
+		if (NULL == e) {
+			pthread_mutex_unlock(&srv->lock);
+			return NULL;
+		}
+		dos33Setup(&e->d, key, stderr, stderr);
+		pthread_mutex_init(&e->lock, NULL);
+		srv->entries[srv->numEntries++] = e;
 	}
-	printf("Key: 'U' = used, '.' = free\n\n");
+	++e->refs;
+	e->lastUsed = ++srv->clock;
+	pthread_mutex_unlock(&srv->lock);
+	pthread_mutex_lock(&e->lock);
+	return e;
 }
 
 /*****************************************************************************/
-static void cmdInit(char *dosFilename) {
-	int						r, i, dosSize = 0, neededSectors;
-	char					buffer[BYTES_PER_SECTOR], *dosBuffer;
-	struct ScatalogHeader	header;
-	FILE					*dosFile;
-
-	if (strlen(dosFilename) > 0) {
-		dosFile = fopen(dosFilename, "rb");
-		if (NULL == dosFilename) {
-			fprintf(stderr,"Error opening '%s' for read.\n", dosFilename);
-			return;
-		}
-		fseek(dosFile, 0, SEEK_END);
-		dosSize = ftell(dosFile);
-		fseek(dosFile, 0, SEEK_SET);
-		if (dosSize > BYTES_PER_SECTOR * SECTORS_PER_TRACK * 3) {
-			fprintf(stderr,"DOS file do not fit in the image.\n");
-			fclose(dosFile);
-			return;
+static void serveRelease(struct Sserve *srv, struct SserveEntry *e) {
+	// Whatever the request wrote to goes away with it
+	e->d.in = stdin;
+	e->d.out = e->d.err = e->d.image.err = stderr;
+	pthread_mutex_unlock(&e->lock);
+	pthread_mutex_lock(&srv->lock);
+	--e->refs;
+	pthread_mutex_unlock(&srv->lock);
+}
+
+/*****************************************************************************/
+static int serveRequest(struct Sserve *srv, char *line, char *input,
+		size_t inputLen, FILE *out, FILE *err) {
+	struct Sdos33		opts;
+	struct SserveEntry	*e;
+	struct stat			st;
+	char				commandArgs[10][FILENAME_MAX];
+	char				*argv[16], *image = NULL;
+	FILE				*in;
+	int					argc, command, cac, r, i;
+
+	// Options of the request apply on top of the ones of the server
+	argc = splitArgs(line, argv, 16);
+	dos33Setup(&opts, "", out, err);
+	opts.force = srv->force;
+	opts.raw = srv->raw;
+	opts.address = srv->address;
+	opts.type = srv->type;
+	opts.formatTracks = srv->formatTracks;
+	opts.formatSectors = srv->formatSectors;
+	opts.repair = srv->repair;
+	opts.format = srv->format;
+	if (parseLine(&opts, argc, argv, &image, &command, &cac,
+			commandArgs) < 0 || NULL == image) {
+		fprintf(err, "Error! Need '[options] <filename> <command>'\n");
+		return 1;
+	}
+	if (command == COMMAND_BATCH) {
+		fprintf(err, "Error! BATCH can not be served, send its lines\n");
+		return 1;
+	}
+	in = fmemopen(input, inputLen, "rb");
+	if (NULL == in) {
+		fprintf(err, "Error allocating memory\n");
+		return 1;
+	}
+	// No more than -j requests run their commands at once
+	pthread_mutex_lock(&srv->lock);
+	while (srv->running >= srv->maxRunning) {
+		pthread_cond_wait(&srv->idle, &srv->lock);
+	}
+	++srv->running;
+	pthread_mutex_unlock(&srv->lock);
+	e = serveAcquire(srv, image);
+	if (NULL == e) {
+		fprintf(err, "Error! Server is stopping\n");
+		r = 1;
+		goto out;
+	}
+	// An image changed by someone else is read again
+	if (NULL != e->d.image.data && (stat(e->d.filename, &st) < 0 ||
+			st.st_dev != e->st.st_dev || st.st_ino != e->st.st_ino ||
+			st.st_size != e->st.st_size ||
+			st.st_mtim.tv_sec != e->st.st_mtim.tv_sec ||
+			st.st_mtim.tv_nsec != e->st.st_mtim.tv_nsec)) {
+		dos33Discard(&e->d);
+	}
+	e->d.force = opts.force;
+	e->d.raw = opts.raw;
+	e->d.address = opts.address;
+	e->d.type = opts.type;
+	e->d.formatTracks = opts.formatTracks;
+	e->d.formatSectors = opts.formatSectors;
+	e->d.repair = opts.repair;
+	e->d.format = opts.format;
+	e->d.threads = srv->threads;
+	e->d.in = in;
+	e->d.out = out;
+	e->d.err = e->d.image.err = err;
+	memset(&e->d.stats, 0, sizeof(e->d.stats));
+	statsPhase(&e->d, &e->d.stats.command, 1);
+	r = runCommand(&e->d, command, cac, commandArgs);
+	statsPhase(&e->d, &e->d.stats.command, 0);
+	// Changes are on disk before the answer, the image stays cached
+	statsPhase(&e->d, &e->d.stats.commit, 1);
+	if (dos33Flush(&e->d) < 0) {
+		r = 1;
+	}
+	statsPhase(&e->d, &e->d.stats.commit, 0);
+	if (NULL != e->d.image.data && stat(e->d.filename, &e->st) < 0) {
+		dos33Discard(&e->d);
+	}
+	if (statsMode != STATS_NONE) {
+		for (i = 0; i < num_commands && commands[i].type != command; i++)
+			;
+		statsPrint(&e->d, err, commands[i].name);
+	}
+	serveRelease(srv, e);
+out:
+	pthread_mutex_lock(&srv->lock);
+	--srv->running;
+	// Requests waiting for a turn and the server stopping wait on it
+	pthread_cond_broadcast(&srv->idle);
+	pthread_mutex_unlock(&srv->lock);
+	fclose(in);
+	return r;
+}
+
+/*****************************************************************************/
+static int serveIo(int fd, void *buffer, size_t len, int sending) {
+	char	*p = (char *)buffer;
+	ssize_t	n;
+
+	while (len > 0) {
+		n = sending ? send(fd, p, len, MSG_NOSIGNAL) : recv(fd, p, len, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
 		}
-		dosBuffer = (char *)malloc(dosSize);
-		r = fread(dosBuffer, 1, dosSize, dosFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
+		if (n <= 0) {
+			return -1;
 		}
-		fclose(dosFile);
+		p += n;
+		len -= n;
 	}
+	return 0;
+}
 
-	dskFile = fopen(dskFilename, "wb");
-	if (NULL == dskFile) {
-		fprintf(stderr,"Error opening disk_image: %s\n", dskFilename);
-		return;
+/*****************************************************************************/
+static char *serveReadFrame(int fd, size_t max, size_t *len) {
+	unsigned char	head[4];
+	char			*frame;
+
+	if (serveIo(fd, head, 4, 0) < 0) {
+		return NULL;
 	}
-	// zero out file
-	memset(buffer, 0, BYTES_PER_SECTOR);
-	for(i = 0; i < TRACKS_PER_DISK * SECTORS_PER_TRACK; i++) {
-		r = fwrite(buffer, 1, BYTES_PER_SECTOR, dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
-		}
+	*len = ((size_t)head[0] << 24) | (head[1] << 16) | (head[2] << 8) |
+		head[3];
+	if (*len > max) {
+		return NULL;
 	}
-	if (dosSize > 0) {
-		fseek(dskFile, 0, SEEK_SET);
-		r = fwrite(dosBuffer, 1, dosSize, dskFile);
-		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
-		}
+	// One more byte, a command line is used as a string
+	frame = (char *)malloc(*len + 1);
+	if (NULL == frame) {
+		return NULL;
 	}
-	// Create VTOC
-	memset(&vtoc, 0, sizeof(vtoc));
-	vtoc.dosRelease = 3;
-	vtoc.catalog.track = VTOC_TRACK;
-	vtoc.catalog.sector = SECTORS_PER_TRACK - 1;
-	vtoc.diskVolume = 254;
-	vtoc.maxTSPairs = TSL_MAX_NUMBER;
-	vtoc.lastAllocTrack = VTOC_TRACK + 1;
-	vtoc.allocDirection = 1;
-	vtoc.numTracks = TRACKS_PER_DISK;
-	vtoc.sectorsPerTrack = SECTORS_PER_TRACK;
-	vtoc.bytesPerSector = BYTES_PER_SECTOR;
-	// reserve track 0
-	// No user data can be stored here as track=0 is special case
-	// end of file indicator
-	for (i = 1; i < TRACKS_PER_DISK; i++) {
-		vtoc.bitmap[i][0] = 0xFF;
-		vtoc.bitmap[i][1] = 0xFF;
-	}
-	// if copying dos reserve anothers tracks/sectors
-	if (dosSize > 0) {
-		neededSectors = dosSize / BYTES_PER_SECTOR;
-		neededSectors -= 1 * SECTORS_PER_TRACK;		// Exclude track 0
-		i = 1;
-		r = 0;
-		while(neededSectors-- > 0) {
-			dos33AllocTs(i, r++);
-			if (r == SECTORS_PER_TRACK) {
-				r = 0;
-				++i;
+	if (serveIo(fd, frame, *len, 0) < 0) {
+		free(frame);
+		return NULL;
+	}
+	frame[*len] = '\0';
+	return frame;
+}
+
+/*****************************************************************************/
+static int serveWriteFrame(int fd, const char *frame, size_t len) {
+	unsigned char head[4];
+
+	head[0] = len >> 24;
+	head[1] = len >> 16;
+	head[2] = len >> 8;
+	head[3] = len;
+	if (serveIo(fd, head, 4, 1) < 0) {
+		return -1;
+	}
+	return serveIo(fd, (void *)frame, len, 1);
+}
+
+/*****************************************************************************/
+static void *serveConnection(void *arg) {
+	struct SserveConn	*conn = (struct SserveConn *)arg;
+	char				*line, *input, *outBuf, *errBuf;
+	char				result[16];
+	size_t				lineLen, inputLen, outLen, errLen;
+	FILE				*out, *err;
+	int					r;
+
+	// Requests follow each other on the connection until the client hangs
+	// up or breaks the protocol
+	for (;;) {
+		line = serveReadFrame(conn->fd, FILENAME_MAX - 1, &lineLen);
+		if (NULL == line) {
+			break;
+		}
+		input = serveReadFrame(conn->fd, SERVE_MAX_INPUT, &inputLen);
+		if (NULL == input) {
+			free(line);
+			break;
+		}
+		outBuf = errBuf = NULL;
+		out = open_memstream(&outBuf, &outLen);
+		err = open_memstream(&errBuf, &errLen);
+		if (NULL == out || NULL == err) {
+			r = -1;
+		} else {
+			snprintf(result, sizeof(result), "%d",
+				serveRequest(conn->srv, line, input, inputLen, out, err));
+			fclose(out);
+			fclose(err);
+			out = err = NULL;
+			r = serveWriteFrame(conn->fd, result, strlen(result));
+			if (r == 0) {
+				r = serveWriteFrame(conn->fd, outBuf, outLen);
+			}
+			if (r == 0) {
+				r = serveWriteFrame(conn->fd, errBuf, errLen);
 			}
 		}
-	}
-	// reserve VTOC track
-	// reserved for vtoc and catalog stuff
-	vtoc.bitmap[VTOC_TRACK][0] = 0;
-	vtoc.bitmap[VTOC_TRACK][1] = 0;
-	dos33SaveVtoc();
-	memset(&header, 0, sizeof(header));
-	// Set catalog next pointers
-	for (i = SECTORS_PER_TRACK - 1; i > 1; i--) {
-		header.nextTs.track = VTOC_TRACK;
-		header.nextTs.sector = i - 1;
-		fseek(dskFile, diskOffset(VTOC_TRACK, i), SEEK_SET);
-		r = fwrite(&header, 1, sizeof(header), dskFile);
+		if (NULL != out) {
+			fclose(out);
+		}
+		if (NULL != err) {
+			fclose(err);
+		}
+		free(outBuf);
+		free(errBuf);
+		free(input);
+		free(line);
 		if (r < 0) {
-			fprintf(stderr, "Error on I/O\n");
-			exit(1);
+			break;
 		}
 	}
-	fclose(dskFile);
+	close(conn->fd);
+	free(conn);
+	return NULL;
 }
 
 /*****************************************************************************/
-static void openRw() {
-	dskFile = fopen(dskFilename, "r+b");
-	if (NULL == dskFile) {
-		fprintf(stderr,"Error opening disk_image: %s\n", dskFilename);
-		exit(1);
-	}
+static void serveSignal(int sig) {
+	serveStopping = 1;
 }
 
 /*****************************************************************************/
-static int lookupCommand(char *name) {
-	int which = COMMAND_UNKNOWN, i;
-
-	for(i = 0; i < num_commands; i++) {
-		if(!strncmp(name, commands[i].name, strlen(commands[i].name))) {
-			which = commands[i].type;
+static int runServe(struct Sserve *srv, char *socketName) {
+	struct sockaddr_un	addr;
+	struct sigaction	sa;
+	struct SserveConn	*conn;
+	pthread_attr_t		attr;
+	pthread_t			thread;
+	sigset_t			block, old;
+	int					fd, i;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketName) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Error! Socket name too long: %s\n", socketName);
+		return 1;
+	}
+	strcpy(addr.sun_path, socketName);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+		return 1;
+	}
+	// A socket left behind by a server that died is reused, a live one
+	// is not taken over
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "Error! %s is already served\n", socketName);
+		close(fd);
+		return 1;
+	}
+	if (errno == ECONNREFUSED) {
+		unlink(socketName);
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "Error listening on %s: %s\n", socketName,
+			strerror(errno));
+		close(fd);
+		return 1;
+	}
+	srv->entries = (struct SserveEntry **)calloc(srv->cacheSize +
+		srv->maxRunning, sizeof(struct SserveEntry *));
+	if (NULL == srv->entries) {
+		fprintf(stderr, "Error allocating memory\n");
+		close(fd);
+		return 1;
+	}
+	pthread_mutex_init(&srv->lock, NULL);
+	pthread_cond_init(&srv->idle, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	// No SA_RESTART, so a signal gets accept() out to stop
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = serveSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	while (!serveStopping) {
+		i = accept(fd, NULL, NULL);
+		if (i < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "Error accepting on %s: %s\n", socketName,
+				strerror(errno));
 			break;
 		}
+		conn = (struct SserveConn *)malloc(sizeof(struct SserveConn));
+		if (NULL == conn) {
+			close(i);
+			continue;
+		}
+		conn->srv = srv;
+		conn->fd = i;
+		// Signals are left to this thread
+		pthread_sigmask(SIG_BLOCK, &block, &old);
+		if (pthread_create(&thread, &attr, serveConnection, conn) != 0) {
+			close(i);
+			free(conn);
+		}
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
 	}
-	return which;
+	close(fd);
+	unlink(socketName);
+	// Requests under way end first, later ones find the server stopping
+	// and no image, so the cache is torn down under the lock
+	pthread_mutex_lock(&srv->lock);
+	srv->stop = 1;
+	while (srv->running > 0) {
+		pthread_cond_wait(&srv->idle, &srv->lock);
+	}
+	for (i = 0; i < srv->numEntries; i++) {
+		dos33Close(&srv->entries[i]->d);
+		pthread_mutex_destroy(&srv->entries[i]->lock);
+		free(srv->entries[i]);
+	}
+	srv->numEntries = 0;
+	free(srv->entries);
+	srv->entries = NULL;
+	pthread_mutex_unlock(&srv->lock);
+	pthread_attr_destroy(&attr);
+	return serveStopping ? 0 : 1;
 }
+#endif
 
 /*****************************************************************************/
-static void usage(char *name, int only_version) {
-	printf("dos33util %s - by FBLabs\n\n", VERSION);
-	if (0 != only_version) {
-		return;
+static int isOption(char *arg) {
+	if (arg[1] == '\0') {
+		return 0;
 	}
-	printf("Usage: %s [options] <filename> <command>\n\n", name);
-	printf("Generic options:\n");
-	printf("\t-h  display this help\n");
-	printf("\t-V  show version and exit\n");
-	printf("\t-f  force operation\n");
-	printf("Command options:\n");
-	printf("\t-r      : raw mode\n");
-	printf("\t-t type : char file type (T|I|A|B|S|R|N|L)\n");
-	printf("\t-a aux  : set auxiliary value (address)\n");
-	printf("\n");
-	printf("List of valid commands:\n");
-	printf("\tCATALOG\n");
-	printf("\tLOAD     [-r] <apple_file> [local_file]\n");
-	printf("\tSAVE     [-r] [-a aux] [-t type] <local_file> [apple_file]\n");
-	printf("\tDELETE   <apple_file>\n");
-	printf("\tUNDELETE <apple_file>\n");
-	printf("\tLOCK     <apple_file>\n");
-	printf("\tUNLOCK   <apple_file>\n");
-	printf("\tRENAME   <apple_file_old> <apple_file_new>\n");
-	printf("\tDUMP\n");
-	printf("\tINIT     [dos_file]\n");
-	printf("\n");
-	return;
+#ifdef _WIN32
+	if (arg[0] == '/') {
+		return 1;
+	}
+#endif
+	return arg[0] == '-';
 }
 
 /*****************************************************************************/
 int main(int argc, char **argv) {
-	char	commandStr[FILENAME_MAX] = "";
-	char	commandArgs[10][FILENAME_MAX];
-	char	appleFilename[FILENAME_MAX] = "";
-	char	newAppleFilename[FILENAME_MAX] = "";
-	char	inputFilename[FILENAME_MAX] = "";
-	char	outputFilename[FILENAME_MAX] = "";
-	char	*endptr, *p;
-	int		command, typeHex, removeSuffix;
-	int		i, c = 1, cac = 0;
-
+	char			commandStr[FILENAME_MAX] = "";
+	char			commandArgs[10][FILENAME_MAX];
+	char			*listFilename = NULL, *outDir = NULL, *serveSocket = NULL;
+	char			**positional, **images = NULL;
+	struct SfanOut	fan;
+#ifndef _WIN32
+	struct Sserve	srv;
+#endif
+	struct Sdos33	d;
+	struct stat		st;
+	int				command, ordered = 0, numWorkers = 0, cacheSize = 0;
+	int				numPositional = 0, numImages = 0, maxImages = 0;
+	int				i, k, c = 1, cac = 0;
+
+	dos33Setup(&d, "", stdout, stderr);
+#ifdef _WIN32
+	// File data may be piped through the standard streams
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	positional = (char **)malloc(argc * sizeof(char *));
 	/* Check command line arguments */
 	while (c < argc) {
 		// Check if is a option
-		if (argv[c][0] == '-' || argv[c][0] == '/') {
-			// Check options w/o parameter
+		if (isOption(argv[c])) {
 			switch(argv[c][1]) {
 				case 'h':
 					usage(argv[0], 0);
@@ -1040,52 +1546,156 @@ int main(int argc, char **argv) {
 				case 'V':
 					usage(argv[0], 1);
 					return 0;
-				
-				case 'f':
-					force = 1;
+
+				case 'O':
+					ordered = 1;
 					break;
 
-				case 'r':
-					raw = 1;
+				case '-':
+					if (0 == strcmp(argv[c], "--stats") ||
+							0 == strcmp(argv[c], "--stats=text")) {
+						statsMode = STATS_TEXT;
+						break;
+					}
+					if (0 == strcmp(argv[c], "--stats=json")) {
+						statsMode = STATS_JSON;
+						break;
+					}
+					if (0 == strcmp(argv[c], "--repair") ||
+							0 == strcmp(argv[c], "--format")) {
+						c = parseOption(&d, argc, argv, c);
+						if (c < 0) {
+							return 1;
+						}
+						break;
+					}
+					if (0 == strcmp(argv[c], "--serve") ||
+							0 == strcmp(argv[c], "--cache")) {
+						if (c+1 == argc) {
+							fprintf(stderr,
+								"ERROR! Missing parameter for option %s\n",
+								argv[c]);
+							return 1;
+						}
+						if (argv[c][2] == 's') {
+							serveSocket = argv[c+1];
+						} else {
+							cacheSize = atoi(argv[c+1]);
+						}
+						++c;
+						break;
+					}
+					if (strcmp(argv[c], "--durability") != 0) {
+						fprintf(stderr, "ERROR! Unknown option %s\n", argv[c]);
+						return 1;
+					}
+					if (c+1 == argc || imageSetDurability(argv[c+1]) < 0) {
+						fprintf(stderr, "ERROR! --durability needs "
+							"none, fsync or atomic\n");
+						return 1;
+					}
+					++c;
 					break;
 
-				default:
-					// Check options with parameters
-					if (c+1 == (int)argc) {
+				case 'j':
+				case 'l':
+				case 'o':
+					if (c+1 == argc) {
 						fprintf(stderr, 
-							"ERROR! Missing parameter for option %s",
+							"ERROR! Missing parameter for option %s\n",
 							argv[c]);
 						return 1;
 					}
-					switch(argv[c][1]) {
-						case 'a':
-							++c;
-							address = strtol(argv[c], &endptr, 0);
-							break;
-
-						case 't':
-							++c;
-							type = argv[c][0];
-							break;
+					if (argv[c][1] == 'j') {
+						// Images at once, or LOADALL threads on one image
+						numWorkers = atoi(argv[c+1]);
+						d.threads = numWorkers;
+					} else if (argv[c][1] == 'l') {
+						listFilename = argv[c+1];
+					} else {
+						outDir = argv[c+1];
+					}
+					++c;
+					break;
 
+				default:
+					c = parseOption(&d, argc, argv, c);
+					if (c < 0) {
+						return 1;
 					}
 			}
 		} else {
-			// Check image and command
-			if (strlen(dskFilename) == 0) {
-				strcpy(dskFilename, argv[c]);
-			} else if (strlen(commandStr) == 0) {
-				strcpy(commandStr, argv[c]);
-			} else {
-				if (cac == 10) {
-					break;
-				}
-				strcpy(commandArgs[cac++], argv[c]);
-			}
+			positional[numPositional++] = argv[c];
 		}
 		++c;
 	}
-	if (strlen(dskFilename) == 0) {
+	// Requests name their own images and commands
+	if (NULL != serveSocket) {
+		free(positional);
+		if (numPositional > 0) {
+			fprintf(stderr,"Error! --serve takes no image nor command\n");
+			return 1;
+		}
+#ifdef _WIN32
+		fprintf(stderr,"Error! --serve is not supported on Windows\n");
+		return 1;
+#else
+		memset(&srv, 0, sizeof(srv));
+		srv.cacheSize = (cacheSize > 0) ? cacheSize : SERVE_CACHE_SIZE;
+		srv.maxRunning = (numWorkers > 0) ? numWorkers :
+			(int)sysconf(_SC_NPROCESSORS_ONLN);
+		if (srv.maxRunning > MAX_WORKERS) {
+			srv.maxRunning = MAX_WORKERS;
+		}
+		if (srv.maxRunning < 1) {
+			srv.maxRunning = 1;
+		}
+		srv.force = d.force;
+		srv.raw = d.raw;
+		srv.address = d.address;
+		srv.type = d.type;
+		srv.formatTracks = d.formatTracks;
+		srv.formatSectors = d.formatSectors;
+		srv.repair = d.repair;
+		srv.format = d.format;
+		srv.threads = d.threads;
+		return runServe(&srv, serveSocket);
+#endif
+	}
+	// Images come before the command, the first known command name ends
+	// them. Without a known one the old '<filename> <command>' form applies
+	k = (NULL != listFilename) ? 0 : 1;
+	for (i = k; i < numPositional; i++) {
+		strncpy(commandStr, positional[i], FILENAME_MAX - 1);
+		for (c = 0; commandStr[c] != '\0'; c++) {
+			commandStr[c] = toupper(commandStr[c]);
+		}
+		if (lookupCommand(commandStr) != COMMAND_UNKNOWN) {
+			k = i;
+			break;
+		}
+	}
+	commandStr[0] = '\0';
+	if (k > numPositional) {
+		k = numPositional;
+	}
+	maxImages = numImages = k;
+	if (k > 0) {
+		images = (char **)malloc(k * sizeof(char *));
+		memcpy(images, positional, k * sizeof(char *));
+	}
+	if (k < numPositional) {
+		strcpy(commandStr, positional[k]);
+	}
+	for (i = k + 1; i < numPositional && cac < 10; i++) {
+		strcpy(commandArgs[cac++], positional[i]);
+	}
+	free(positional);
+	if (NULL != listFilename &&
+			readImageList(listFilename, &images, &numImages, &maxImages) < 0) {
+		return 1;
+	}
+	if (numImages == 0) {
 		fprintf(stderr,"Must specify disk image file!\n\n");
 		usage(argv[0], 0);
 		return 1;
@@ -1100,164 +1710,56 @@ int main(int argc, char **argv) {
 		commandStr[i] = toupper(commandStr[i]);
 	}
 	command = lookupCommand(commandStr);
-	memset(&vtoc, 0, sizeof(vtoc));
-	switch(command) {
-
-		case COMMAND_CATALOG:
-			openRw();
-			cmdCatalog();
-			break;
-
-		case COMMAND_LOAD:
-			if (cac == 0) {
-				fprintf(stderr,"Error! Need apple filename\n");
-				return 1;
-			}
-			openRw();
-			truncateFilename(appleFilename, commandArgs[0]);
-			if (cac > 1) {
-				strcpy(outputFilename, commandArgs[1]);
-			} else {
-				strcpy(outputFilename, appleFilename);
-			}
-			cmdLoad(appleFilename, outputFilename);
-			break;
-
-		case COMMAND_SAVE:
-			if (cac == 0) {
-				fprintf(stderr,"Error! Need filename\n");
-				return 1;
-			}
-			strcpy(inputFilename, commandArgs[0]);
-			// Try get type and auxiliary value from filename
-			removeSuffix = 0;
-			if (!raw) {
-				p = strrchr(inputFilename, '#');
-				if (p) {			
-					sscanf(p+1,"%2X%4X", &typeHex, &address);
-					removeSuffix = 1;
-					type = dos33TypeToLetter(dos33HexToType(typeHex));
-				}
-			}
-			if (cac > 1) {
-				truncateFilename(appleFilename, commandArgs[1]);
-			} else {
-				p = inputFilename + (strlen(inputFilename) - 1);
-				while(p != inputFilename) {
-					if (*p == '/' || *p == '\\') {
-						++p;
-						break;
-					}
-					--p;
-				}
-				truncateFilename(appleFilename, p);
-				if (removeSuffix) {
-					appleFilename[strlen(appleFilename) - 7] = '\0';
-				}
-			}
-			openRw();
-			cmdSave(inputFilename, appleFilename);
-			break;
-
-		case COMMAND_DELETE:
-			if (cac == 0) {
-				fprintf(stderr,"Error! Need apple filename\n");
-				return 1;
-			}
-			truncateFilename(appleFilename, commandArgs[0]);
-			openRw();
-			dos33DeleteFile(appleFilename);
-			break;
-
-		case COMMAND_UNDELETE:
-			if (cac == 0) {
-				fprintf(stderr,"Error! Need apple filename\n");
-				return 1;
-			}
-			truncateFilename(appleFilename, commandArgs[0]);
-			openRw();
-			dos33UndeleteFile(appleFilename);
-			break;
-
-		case COMMAND_LOCK:
-			if (cac == 0) {
-				fprintf(stderr,"Error! Need apple filename\n");
-				return 1;
-			}
-			truncateFilename(appleFilename, commandArgs[0]);
-			openRw();
-			if (!dos33CheckFileExists(appleFilename, 0)) {
-				fprintf(stderr, 
-					"Error! File %s does not exist or has been deleted.\n", 
-					appleFilename);
-				return 1;
-			}
-			catEntry.fileEntry.type |= 0x80;
-			dos33SaveActCatEntry();
-			break;
-
-		case COMMAND_UNLOCK:
-			if (cac == 0) {
-				fprintf(stderr,"Error! Need apple filename\n");
-				return 1;
-			}
-			truncateFilename(appleFilename, commandArgs[0]);
-			openRw();
-			if (!dos33CheckFileExists(appleFilename, 0)) {
-				fprintf(stderr, 
-					"Error! File %s does not exist or has been deleted.\n", 
-					appleFilename);
-				return 1;
-			}
-			catEntry.fileEntry.type &= ~0x80;
-			dos33SaveActCatEntry();
-			break;
-
-		case COMMAND_RENAME:
-			if (cac < 2) {
-				fprintf(stderr,"Error! Need two apple filename\n");
-				return 1;
-			}
-			truncateFilename(appleFilename, commandArgs[0]);
-			truncateFilename(newAppleFilename, commandArgs[1]);
-			openRw();
-			if (!dos33CheckFileExists(appleFilename, 0)) {
-				fprintf(stderr, 
-					"Error! File %s does not exist or has been deleted.\n", 
-					appleFilename);
-				return 1;
-			}
-			for (i = 0; i < strlen(newAppleFilename); i++) {
-				catEntry.fileEntry.name[i] = newAppleFilename[i] | 0x80;
-			}
-			for(i = strlen(newAppleFilename); i < FILE_NAME_SIZE; i++) {
-				catEntry.fileEntry.name[i] = ' ' | 0x80;
-			}
-			dos33SaveActCatEntry();
-			break;
-
-		case COMMAND_DUMP:
-			openRw();
-			cmdDump();
-			break;
-
-		case COMMAND_INIT:
-			if (cac > 0) {
-				strcpy(inputFilename, commandArgs[0]);
-			}
-			cmdInit(inputFilename);
-			break;
-
-		default:
-			fclose(dskFile);
-			fprintf(stderr,"Unknown command '%s'\n", commandStr);
-			usage(argv[0], 0);
-			return 1;
+	if (command == COMMAND_UNKNOWN) {
+		fprintf(stderr,"Unknown command '%s'\n", commandStr);
+		usage(argv[0], 0);
+		return 1;
+	}
+	if (command == COMMAND_BATCH && cac == 0) {
+		fprintf(stderr,"Error! Need script filename\n");
+		return 1;
 	}
 
-	if (dskFile) {
-		fclose(dskFile);
+	// Many images: run the command over all of them on a thread pool
+	if (numImages > 1 || NULL != listFilename || NULL != outDir) {
+		if (command == COMMAND_BATCH && 0 == strcmp(commandArgs[0], "-")) {
+			fprintf(stderr,"Error! BATCH script can not be read from "
+				"stdin for many images\n");
+			return 1;
+		}
+		if (NULL != outDir && stat(outDir, &st) < 0) {
+#ifdef _WIN32
+			mkdir(outDir);
+#else
+			mkdir(outDir, 0777);
+#endif
+		}
+		if (command == COMMAND_LOADALL && cac > 0 &&
+				stat(commandArgs[0], &st) < 0) {
+#ifdef _WIN32
+			mkdir(commandArgs[0]);
+#else
+			mkdir(commandArgs[0], 0777);
+#endif
+		}
+		memset(&fan, 0, sizeof(fan));
+		fan.ordered = ordered;
+		fan.outDir = outDir;
+		fan.command = command;
+		fan.cac = cac;
+		fan.commandArgs = commandArgs;
+		fan.force = d.force;
+		fan.raw = d.raw;
+		fan.address = d.address;
+		fan.type = d.type;
+		fan.formatTracks = d.formatTracks;
+		fan.formatSectors = d.formatSectors;
+		fan.repair = d.repair;
+		fan.format = d.format;
+		return runFanOut(&fan, images, numImages, numWorkers);
 	}
 
-	return 0;
-}
+	strncpy(d.filename, images[0], FILENAME_MAX - 1);
+	free(images);
+	return runImage(&d, command, cac, commandArgs);
+}
\ No newline at end of file
@@ -0,0 +1,1007 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#include "dos33.h"
+#include "utils.h"
+#include "image.h"
+
+// Defines
+#define TRACK_SIZE(__img) ((__img)->sectors * BYTES_PER_SECTOR)
+#define IMAGE_SECTORS(__img) ((__img)->tracks * (__img)->sectors)
+#define IMAGE_SIZE(__img) (IMAGE_SECTORS(__img) * BYTES_PER_SECTOR)
+
+// Constants
+// Place of each DOS 3.3 logical sector in a ProDOS order track
+static const unsigned char dosToProdos[SECTORS_PER_TRACK] = {
+	0, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 15,
+};
+
+// Variables
+// Set once at startup, shared by every image
+static int imageDurability = IMAGE_DURABILITY_NONE;
+#ifndef _WIN32
+static mode_t imageUmask = 022;
+#endif
+
+// Private functions
+
+/*****************************************************************************/
+static void imageSetPerm(struct Simage *img) {
+	int s;
+
+	// ProDOS order only exists for 16 sectors, anything else is as is
+	for (s = 0; s < MAX_SECTORS_PER_TRACK; s++) {
+		img->perm[s] = s;
+		if (img->order == IMAGE_ORDER_PRODOS && img->sectors ==
+				SECTORS_PER_TRACK && s < SECTORS_PER_TRACK) {
+			img->perm[s] = dosToProdos[s];
+		}
+	}
+}
+
+/*****************************************************************************/
+static void imagePermute(struct Simage *img, int track, int toFile) {
+	unsigned char	tmp[MAX_SECTORS_PER_TRACK * BYTES_PER_SECTOR];
+	unsigned char	*p = img->data + track * TRACK_SIZE(img);
+	int				s;
+
+	memcpy(tmp, p, TRACK_SIZE(img));
+	for (s = 0; s < img->sectors; s++) {
+		if (toFile) {
+			memcpy(p + img->perm[s] * BYTES_PER_SECTOR,
+				tmp + s * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+		} else {
+			memcpy(p + s * BYTES_PER_SECTOR,
+				tmp + img->perm[s] * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+		}
+	}
+}
+
+/*****************************************************************************/
+static long imageFilePos(struct Simage *img, int index) {
+	int s = index % img->sectors;
+
+	return img->dataOffset +
+		((long)(index - s) + img->perm[s]) * BYTES_PER_SECTOR;
+}
+
+/*****************************************************************************/
+static int imageAlloc(struct Simage *img, const char *filename, FILE *err,
+		int tracks, int sectors) {
+	memset(img, 0, sizeof(*img));
+	strncpy(img->filename, filename, FILENAME_MAX - 1);
+	img->err = err;
+	img->tracks = tracks;
+	img->sectors = sectors;
+	img->dataLength = -1;
+	imageSetPerm(img);
+	img->data = (unsigned char *)calloc(1, IMAGE_SIZE(img));
+	if (NULL == img->data) {
+		fprintf(img->err, "Error allocating image buffer\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+static void imageFree(struct Simage *img) {
+	if (NULL != img->file) {
+		fclose(img->file);
+		img->file = NULL;
+	}
+	compressFree(img->gz);
+	img->gz = NULL;
+	free(img->data);
+	img->data = NULL;
+	free(img->head);
+	img->head = NULL;
+	free(img->tail);
+	img->tail = NULL;
+	nibbleFree(&img->nib);
+	archiveFree(&img->ar);
+}
+
+/*****************************************************************************/
+static int imageLoadTracks(struct Simage *img, int first, int count) {
+	long	n, pos, len;
+	int		t, r = 0;
+
+	// Past the end of a short file the tracks stay zeroed
+	if (img->nib.kind != NIBBLE_NONE) {
+		for (t = first; t < first + count; t++) {
+			nibbleReadTrack(&img->nib, t, img->data + t * TRACK_SIZE(img),
+				&img->state[t * img->sectors]);
+		}
+	} else if (img->ar.open) {
+		for (t = first; t < first + count; t++) {
+			len = archiveReadTrack(&img->ar, t, img->data + t * TRACK_SIZE(img),
+				img->err);
+			if (len < 0) {
+				r = -1;
+				break;
+			}
+			++img->stats.seeks;
+			img->stats.bytesRead += len;
+		}
+		count = t - first;
+	} else if (NULL != img->file || NULL != img->gz) {
+		pos = (long)first * TRACK_SIZE(img);
+		len = (long)count * TRACK_SIZE(img);
+		if (img->dataLength >= 0 && pos + len > img->dataLength) {
+			len = (pos < img->dataLength) ? img->dataLength - pos : 0;
+		}
+		if (NULL != img->gz) {
+			n = compressRead(img->gz, img->dataOffset + pos, img->data + pos,
+				len);
+			if (n < 0) {
+				n = 0;
+				count = 0;
+				r = -1;
+			}
+		} else {
+			fseek(img->file, img->dataOffset + pos, SEEK_SET);
+			n = fread(img->data + pos, 1, len, img->file);
+			if (n == 0 && ferror(img->file)) {
+				fprintf(img->err, "Error on I/O\n");
+				count = 0;
+				r = -1;
+			}
+		}
+		++img->stats.seeks;
+		img->stats.bytesRead += n;
+		for (t = first; t < first + count && img->order != IMAGE_ORDER_DOS;
+				t++) {
+			imagePermute(img, t, 0);
+		}
+	}
+	// Tracks that could not be read are not loaded, or they would be used
+	// and written back zeroed
+	memset(&img->loaded[first], 1, count);
+	++img->stats.misses;
+	return r;
+}
+
+/*****************************************************************************/
+static int imageTouch(struct Simage *img, int track, int sector) {
+	int off = imageOffset(img, track, sector);
+
+	if (off < 0) {
+		if (track >= img->tracks) {
+			fprintf(img->err, "Error: track > %d\n", img->tracks);
+		} else {
+			fprintf(img->err, "Error: sector > %d\n", img->sectors);
+		}
+		__atomic_fetch_add(&img->invalid, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	if (img->loaded[track]) {
+		// LOADALL workers read the same image at once
+		__atomic_fetch_add(&img->stats.hits, 1, __ATOMIC_RELAXED);
+	} else if (img->failed[track] || imageLoadTracks(img, track, 1) < 0) {
+		// Tried once, the error has been told already
+		img->failed[track] = 1;
+		__atomic_fetch_add(&img->invalid, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	if (img->state[off / BYTES_PER_SECTOR] == NIBBLE_SECTOR_BAD) {
+		fprintf(img->err, "Error: track %d sector %d unreadable\n",
+			track, sector);
+		__atomic_fetch_add(&img->invalid, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	return off;
+}
+
+/*****************************************************************************/
+static unsigned long le32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/*****************************************************************************/
+static void putLe(unsigned char *p, unsigned long value, int bytes) {
+	while (bytes-- > 0) {
+		*p++ = value & 0xFF;
+		value >>= 8;
+	}
+}
+
+/*****************************************************************************/
+static int imageOpen2img(struct Simage *img, long size) {
+	unsigned char	h[IMG2_HEADER_SIZE];
+	unsigned long	format;
+
+	fseek(img->file, 0, SEEK_SET);
+	if (fread(h, 1, sizeof(h), img->file) != sizeof(h)) {
+		fprintf(img->err, "Error: 2IMG header too short\n");
+		return -1;
+	}
+	format = le32(h + 12);
+	img->dataOffset = le32(h + 24);
+	img->dataLength = le32(h + 28);
+	if (format > IMAGE_ORDER_PRODOS) {
+		fprintf(img->err, "Error: only DOS and ProDOS order 2IMG images "
+			"are supported\n");
+		return -1;
+	}
+	if (img->dataOffset < IMG2_HEADER_SIZE ||
+			img->dataOffset + img->dataLength > size) {
+		fprintf(img->err, "Error: 2IMG data outside the file\n");
+		return -1;
+	}
+	// The header says the order, no need to guess it
+	img->order = format;
+	img->orderFixed = 1;
+	imageSetPerm(img);
+	// Header and anything after the data are written back unchanged
+	img->headSize = img->dataOffset;
+	img->tailSize = size - img->dataOffset - img->dataLength;
+	img->head = (unsigned char *)malloc(img->headSize);
+	img->tail = (unsigned char *)malloc(img->tailSize + 1);
+	if (NULL == img->head || NULL == img->tail) {
+		fprintf(img->err, "Error allocating image buffer\n");
+		return -1;
+	}
+	fseek(img->file, 0, SEEK_SET);
+	if (fread(img->head, 1, img->headSize, img->file) !=
+			(size_t)img->headSize) {
+		fprintf(img->err, "Error on I/O\n");
+		return -1;
+	}
+	fseek(img->file, img->dataOffset + img->dataLength, SEEK_SET);
+	if (fread(img->tail, 1, img->tailSize, img->file) !=
+			(size_t)img->tailSize) {
+		fprintf(img->err, "Error on I/O\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+static int imageCreate2img(struct Simage *img) {
+	img->headSize = IMG2_HEADER_SIZE;
+	img->head = (unsigned char *)calloc(1, IMG2_HEADER_SIZE);
+	if (NULL == img->head) {
+		fprintf(img->err, "Error allocating image buffer\n");
+		return -1;
+	}
+	memcpy(img->head, "2IMGdos3", 8);
+	putLe(img->head + 8, IMG2_HEADER_SIZE, 2);
+	putLe(img->head + 10, 1, 2);
+	putLe(img->head + 12, IMAGE_ORDER_DOS, 4);
+	putLe(img->head + 24, IMG2_HEADER_SIZE, 4);
+	putLe(img->head + 28, IMAGE_SIZE(img), 4);
+	img->dataOffset = IMG2_HEADER_SIZE;
+	img->dataLength = IMAGE_SIZE(img);
+	img->orderFixed = 1;
+	return 0;
+}
+
+/*****************************************************************************/
+static int isExtension(const char *filename, const char *ext) {
+	const char *dot = strrchr(filename, '.');
+
+	return NULL != dot && 0 == strcasecmp(dot, ext);
+}
+
+/*****************************************************************************/
+static void imageInnerName(char *name, const char *filename) {
+	char *dot;
+
+	// disk.po.gz is a ProDOS order image once inflated
+	strncpy(name, filename, FILENAME_MAX - 1);
+	name[FILENAME_MAX - 1] = '\0';
+	dot = strrchr(name, '.');
+	if (compressExtension(name) != COMPRESS_NONE) {
+		*dot = '\0';
+	}
+}
+
+// Public functions
+
+/*****************************************************************************/
+int imageOpen(struct Simage *img, const char *filename, FILE *err) {
+	unsigned char	head[COMPRESS_PROBE_SIZE];
+	char			name[FILENAME_MAX];
+	long			size;
+	int				kind, n;
+
+	// Usual geometry until the VTOC tells otherwise
+	if (imageAlloc(img, filename, err, TRACKS_PER_DISK,
+			SECTORS_PER_TRACK) < 0) {
+		return -1;
+	}
+	// Kept open, tracks are read when first used
+	img->file = fopen(filename, "rb");
+	if (NULL == img->file) {
+		fprintf(img->err,"Error opening disk_image: %s\n", filename);
+		imageFree(img);
+		return -1;
+	}
+	n = fread(head, 1, sizeof(head), img->file);
+	fseek(img->file, 0, SEEK_END);
+	size = ftell(img->file);
+	imageInnerName(name, filename);
+	img->compressed = compressProbe(head, n);
+	if (img->compressed != COMPRESS_NONE) {
+		img->gz = compressOpen(img->file, img->compressed, img->err);
+		if (NULL == img->gz) {
+			imageFree(img);
+			return -1;
+		}
+		img->file = NULL;
+		n = compressRead(img->gz, 0, head, sizeof(head));
+		if (n < 0) {
+			imageFree(img);
+			return -1;
+		}
+		// Sector images are inflated as their tracks are read, any other
+		// kind is parsed from a file and inflated whole
+		size = -1;
+		if ((n >= 4 && 0 == memcmp(head, "2IMG", 4)) ||
+				archiveProbe(head, n) ||
+				nibbleProbe(name, head, n, size) != NIBBLE_NONE) {
+			img->file = compressStream(img->gz);
+			if (NULL == img->file) {
+				imageFree(img);
+				return -1;
+			}
+			fseek(img->file, 0, SEEK_END);
+			size = ftell(img->file);
+		}
+	}
+	if (n >= 4 && 0 == memcmp(head, "2IMG", 4)) {
+		if (imageOpen2img(img, size) < 0) {
+			imageFree(img);
+			return -1;
+		}
+		return 0;
+	}
+	// Archived images are only references, read whole
+	if (archiveProbe(head, n)) {
+		if (archiveOpen(&img->ar, filename, img->file, img->err) < 0) {
+			imageFree(img);
+			return -1;
+		}
+		fclose(img->file);
+		img->file = NULL;
+		++img->stats.seeks;
+		img->stats.bytesRead += size;
+		img->fixedSectors = img->ar.sectors;
+		img->orderFixed = 1;
+		if (imageSetGeometry(img, img->ar.tracks, img->ar.sectors) < 0) {
+			imageFree(img);
+			return -1;
+		}
+		return 0;
+	}
+	kind = nibbleProbe(name, head, n, size);
+	if (kind == NIBBLE_NONE) {
+		// The name is a first guess, the VTOC may still tell otherwise
+		if (isExtension(name, ".po")) {
+			imageSetOrder(img, IMAGE_ORDER_PRODOS);
+		}
+		return 0;
+	}
+	// Nibble images are small and read whole, decoded when used
+	if (nibbleOpen(&img->nib, kind, img->file, size, img->err) < 0) {
+		imageFree(img);
+		return -1;
+	}
+	fclose(img->file);
+	img->file = NULL;
+	++img->stats.seeks;
+	img->stats.bytesRead += size;
+	img->fixedSectors = img->nib.sectors;
+	if (imageSetGeometry(img, TRACKS_PER_DISK, img->nib.sectors) < 0) {
+		imageFree(img);
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+int imageCreate(struct Simage *img, const char *filename, FILE *err,
+		int tracks, int sectors) {
+	char name[FILENAME_MAX];
+
+	if (imageAlloc(img, filename, err, tracks, sectors) < 0) {
+		return -1;
+	}
+	imageInnerName(name, filename);
+	img->compressed = compressExtension(filename);
+	if (isExtension(name, ".woz")) {
+		fprintf(img->err, "Error: WOZ images can not be created\n");
+		imageFree(img);
+		return -1;
+	}
+	if (isExtension(name, ".po")) {
+		if (sectors != SECTORS_PER_TRACK) {
+			fprintf(img->err, "Error: ProDOS order images have %d sectors "
+				"per track\n", SECTORS_PER_TRACK);
+			imageFree(img);
+			return -1;
+		}
+		imageSetOrder(img, IMAGE_ORDER_PRODOS);
+	}
+	if ((isExtension(name, ".2mg") || isExtension(name, ".2img")) &&
+			imageCreate2img(img) < 0) {
+		imageFree(img);
+		return -1;
+	}
+	if (isExtension(name, ".nib")) {
+		if (sectors != SECTORS_PER_TRACK) {
+			fprintf(img->err, "Error: nibble images have %d sectors per "
+				"track\n", SECTORS_PER_TRACK);
+			imageFree(img);
+			return -1;
+		}
+		if (nibbleCreate(&img->nib, tracks, img->err) < 0) {
+			imageFree(img);
+			return -1;
+		}
+		img->fixedSectors = sectors;
+	}
+	if (isExtension(name, ".dar")) {
+		archiveCreate(&img->ar, filename, tracks, sectors);
+		img->orderFixed = 1;
+	}
+	img->created = 1;
+	memset(img->loaded, 1, sizeof(img->loaded));
+	return 0;
+}
+
+/*****************************************************************************/
+int imageLoadAll(struct Simage *img) {
+	int		first, track, r = 0;
+
+	// Runs of missing tracks are read with one call each
+	track = 0;
+	while (track < img->tracks) {
+		if (img->loaded[track]) {
+			++track;
+			continue;
+		}
+		first = track;
+		while (track < img->tracks && !img->loaded[track]) {
+			++track;
+		}
+		if (imageLoadTracks(img, first, track - first) < 0) {
+			r = -1;
+		}
+	}
+	return r;
+}
+
+/*****************************************************************************/
+static int imageSync(FILE *f) {
+	if (fflush(f) != 0) {
+		return -1;
+	}
+	if (imageDurability == IMAGE_DURABILITY_NONE) {
+		return 0;
+	}
+#ifdef _WIN32
+	return _commit(_fileno(f));
+#else
+	return fsync(fileno(f));
+#endif
+}
+
+/*****************************************************************************/
+static int imageWriteData(struct Simage *img, FILE *f) {
+	unsigned char	track[MAX_SECTORS_PER_TRACK * BYTES_PER_SECTOR];
+	long			size, pos, len;
+	int				t, s, r = 0;
+
+	if (img->nib.kind != NIBBLE_NONE) {
+		if (nibbleSave(&img->nib, f) < 0) {
+			fprintf(img->err, "Error on I/O\n");
+			return -1;
+		}
+		img->stats.bytesWritten += img->nib.size;
+		return 0;
+	}
+	if (img->ar.open) {
+		size = archiveWrite(&img->ar, f);
+		if (size < 0) {
+			fprintf(img->err, "Error on I/O\n");
+			return -1;
+		}
+		img->stats.bytesWritten += size;
+		return 0;
+	}
+	// A 2IMG keeps its data length, cut or padded with zeros
+	size = (img->dataLength >= 0) ? img->dataLength : IMAGE_SIZE(img);
+	if (img->headSize > 0 &&
+			fwrite(img->head, 1, img->headSize, f) != (size_t)img->headSize) {
+		r = -1;
+	}
+	for (pos = 0; pos < size && r == 0; pos += len) {
+		t = pos / TRACK_SIZE(img);
+		len = (size - pos < TRACK_SIZE(img)) ? size - pos : TRACK_SIZE(img);
+		memset(track, 0, sizeof(track));
+		for (s = 0; s < img->sectors && t < img->tracks; s++) {
+			memcpy(track + img->perm[s] * BYTES_PER_SECTOR,
+				img->data + pos + s * BYTES_PER_SECTOR, BYTES_PER_SECTOR);
+		}
+		if (fwrite(track, 1, len, f) != (size_t)len) {
+			r = -1;
+		}
+	}
+	if (r == 0 && img->tailSize > 0 &&
+			fwrite(img->tail, 1, img->tailSize, f) != (size_t)img->tailSize) {
+		r = -1;
+	}
+	if (r < 0) {
+		fprintf(img->err, "Error on I/O\n");
+		return -1;
+	}
+	img->stats.flushed += IMAGE_SECTORS(img);
+	img->stats.bytesWritten += img->headSize + size + img->tailSize;
+	return 0;
+}
+
+/*****************************************************************************/
+static int imageWriteCompressed(struct Simage *img, FILE *f) {
+	FILE	*mem;
+	char	*buf = NULL;
+	size_t	len = 0;
+	int		r;
+
+	// The image is laid out in memory as usual, then compressed whole
+#ifdef _WIN32
+	mem = tmpfile();
+#else
+	mem = open_memstream(&buf, &len);
+#endif
+	if (NULL == mem) {
+		fprintf(img->err, "Error allocating image buffer\n");
+		return -1;
+	}
+	r = imageWriteData(img, mem);
+#ifdef _WIN32
+	len = ftell(mem);
+	buf = (char *)malloc(len + 1);
+	if (r == 0 && (NULL == buf || fseek(mem, 0, SEEK_SET) != 0 ||
+			fread(buf, 1, len, mem) != len)) {
+		fprintf(img->err, "Error on I/O\n");
+		r = -1;
+	}
+#endif
+	fclose(mem);
+	if (r == 0) {
+		r = compressWrite(img->compressed, f, (unsigned char *)buf, len,
+			img->err);
+	}
+	free(buf);
+	return r;
+}
+
+/*****************************************************************************/
+static int imageWriteWhole(struct Simage *img, FILE *f) {
+	int r;
+
+	if (img->compressed != COMPRESS_NONE) {
+		r = imageWriteCompressed(img, f);
+	} else {
+		r = imageWriteData(img, f);
+	}
+	if (r == 0 && imageSync(f) < 0) {
+		fprintf(img->err, "Error on I/O\n");
+		r = -1;
+	}
+	return r;
+}
+
+/*****************************************************************************/
+static int imageWriteDirty(struct Simage *img, int i) {
+	FILE	*f;
+	long	pos;
+	int		first, r = 0;
+
+	f = fopen(img->filename, "r+b");
+	if (NULL == f) {
+		fprintf(img->err,"Error opening disk_image: %s\n", img->filename);
+		return -1;
+	}
+	// Nibble images are rewritten whole, they keep their size
+	if (img->nib.kind != NIBBLE_NONE) {
+		r = imageWriteWhole(img, f);
+		fclose(f);
+		return r;
+	}
+	// Write back runs of adjacent dirty sectors
+	while (i < IMAGE_SECTORS(img)) {
+		if (!img->dirty[i]) {
+			++i;
+			continue;
+		}
+		// A run also has to be in one piece in the file
+		first = i++;
+		while (i < IMAGE_SECTORS(img) && img->dirty[i] &&
+				imageFilePos(img, i) ==
+				imageFilePos(img, i - 1) + BYTES_PER_SECTOR) {
+			++i;
+		}
+		pos = imageFilePos(img, first);
+		if (img->dataLength >= 0 && pos + (i - first) * BYTES_PER_SECTOR >
+				img->dataOffset + img->dataLength) {
+			fprintf(img->err, "Error: sector past the end of the image "
+				"data\n");
+			r = -1;
+			break;
+		}
+		fseek(f, pos, SEEK_SET);
+		if (fwrite(img->data + first * BYTES_PER_SECTOR, 1,
+				(i - first) * BYTES_PER_SECTOR, f) !=
+				(i - first) * BYTES_PER_SECTOR) {
+			fprintf(img->err, "Error on I/O\n");
+			r = -1;
+			break;
+		}
+		++img->stats.seeks;
+		img->stats.flushed += i - first;
+		img->stats.bytesWritten += (i - first) * BYTES_PER_SECTOR;
+	}
+	if (r == 0 && imageSync(f) < 0) {
+		fprintf(img->err, "Error on I/O\n");
+		r = -1;
+	}
+	fclose(f);
+	return r;
+}
+
+/*****************************************************************************/
+static int imageWriteAtomic(struct Simage *img) {
+	char	tempName[FILENAME_MAX + 8];
+	FILE	*f;
+	int		r;
+#ifndef _WIN32
+	struct stat	st;
+	char	dirName[FILENAME_MAX], *slash;
+	int		fd;
+#endif
+
+	// The whole new image goes to a temp file next to the old one, which
+	// is only replaced by rename() once the copy is safely on disk
+	if (img->nib.kind == NIBBLE_NONE && !img->ar.open &&
+			imageLoadAll(img) < 0) {
+		return -1;
+	}
+	snprintf(tempName, sizeof(tempName), "%s.XXXXXX", img->filename);
+#ifdef _WIN32
+	if (_mktemp_s(tempName, strlen(tempName) + 1) != 0) {
+		fprintf(img->err,"Error creating temp file for %s\n", img->filename);
+		return -1;
+	}
+	f = fopen(tempName, "wb");
+#else
+	fd = mkstemp(tempName);
+	if (fd < 0) {
+		fprintf(img->err,"Error creating temp file for %s\n", img->filename);
+		return -1;
+	}
+	// Keep the permissions of the image being replaced
+	if (stat(img->filename, &st) == 0) {
+		fchmod(fd, st.st_mode & 07777);
+	} else {
+		fchmod(fd, 0666 & ~imageUmask);
+	}
+	f = fdopen(fd, "wb");
+#endif
+	if (NULL == f) {
+		fprintf(img->err,"Error opening disk_image: %s\n", tempName);
+		remove(tempName);
+		return -1;
+	}
+	r = imageWriteWhole(img, f);
+	if (fclose(f) != 0) {
+		r = -1;
+	}
+	if (r == 0) {
+#ifdef _WIN32
+		if (!MoveFileExA(tempName, img->filename,
+				MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+			r = -1;
+		}
+#else
+		if (rename(tempName, img->filename) != 0) {
+			r = -1;
+		}
+#endif
+		if (r < 0) {
+			fprintf(img->err,"Error replacing disk_image: %s\n", img->filename);
+		}
+	}
+	if (r < 0) {
+		remove(tempName);
+		return -1;
+	}
+#ifndef _WIN32
+	// Make the rename itself durable
+	strcpy(dirName, img->filename);
+	slash = strrchr(dirName, '/');
+	if (NULL == slash) {
+		strcpy(dirName, ".");
+	} else if (slash == dirName) {
+		dirName[1] = '\0';
+	} else {
+		*slash = '\0';
+	}
+	fd = open(dirName, O_RDONLY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+#endif
+	return 0;
+}
+
+/*****************************************************************************/
+static int imageEncodeNibbles(struct Simage *img, int i) {
+	int r = 0;
+
+	// Data fields of the changed sectors are encoded again in place
+	for (; i < IMAGE_SECTORS(img); i++) {
+		if (!img->dirty[i] && !img->created) {
+			continue;
+		}
+		if (nibbleWriteSector(&img->nib, i / img->sectors, i % img->sectors,
+				img->data + i * BYTES_PER_SECTOR) < 0) {
+			fprintf(img->err, "Error: track %d sector %d can not be "
+				"rewritten\n", i / img->sectors, i % img->sectors);
+			r = -1;
+		}
+		++img->stats.flushed;
+	}
+	return r;
+}
+
+/*****************************************************************************/
+static int imageStoreArchive(struct Simage *img) {
+	long n;
+
+	// Only new sectors go to the pool, the references are written after
+	n = archiveStore(&img->ar, img->data, img->dirty, img->tracks,
+		img->sectors, img->created, imageDurability != IMAGE_DURABILITY_NONE,
+		img->err);
+	if (n < 0) {
+		return -1;
+	}
+	img->stats.bytesWritten += n;
+	return 0;
+}
+
+/*****************************************************************************/
+int imageSetDurability(const char *mode) {
+	if (0 == strcmp(mode, "none")) {
+		imageDurability = IMAGE_DURABILITY_NONE;
+	} else if (0 == strcmp(mode, "fsync")) {
+		imageDurability = IMAGE_DURABILITY_FSYNC;
+	} else if (0 == strcmp(mode, "atomic")) {
+		imageDurability = IMAGE_DURABILITY_ATOMIC;
+#ifndef _WIN32
+		// New images get the usual permissions, umask can't be read
+		// without setting it so do it before any thread starts
+		imageUmask = umask(0);
+		umask(imageUmask);
+#endif
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+int imageFlush(struct Simage *img) {
+	FILE	*f;
+	int		i, r = 0;
+
+	if (NULL == img->data) {
+		return 0;
+	}
+	// Find first dirty sector, nothing to do if image is clean
+	for (i = 0; i < IMAGE_SECTORS(img) && !img->dirty[i]; i++)
+		;
+	if (img->created || i < IMAGE_SECTORS(img)) {
+		if (img->nib.kind != NIBBLE_NONE &&
+				imageEncodeNibbles(img, img->created ? 0 : i) < 0) {
+			r = -1;
+		} else if (img->ar.open && imageStoreArchive(img) < 0) {
+			r = -1;
+		} else if (NULL != img->gz && img->nib.kind == NIBBLE_NONE &&
+				!img->ar.open && imageLoadAll(img) < 0) {
+			// Anything still compressed is read before it is overwritten
+			r = -1;
+		} else if (imageDurability == IMAGE_DURABILITY_ATOMIC) {
+			r = imageWriteAtomic(img);
+		} else if (img->created || img->ar.open ||
+				img->compressed != COMPRESS_NONE) {
+			f = fopen(img->filename, "wb");
+			if (NULL == f) {
+				fprintf(img->err,"Error opening disk_image: %s\n",
+					img->filename);
+				r = -1;
+			} else {
+				r = imageWriteWhole(img, f);
+				fclose(f);
+			}
+		} else {
+			r = imageWriteDirty(img, i);
+		}
+	}
+	// Written sectors are clean again, a created image now exists
+	if (r == 0) {
+		memset(img->dirty, 0, sizeof(img->dirty));
+		img->created = 0;
+	}
+	return r;
+}
+
+/*****************************************************************************/
+int imageClose(struct Simage *img) {
+	int r = imageFlush(img);
+
+	imageFree(img);
+	return r;
+}
+
+/*****************************************************************************/
+int imageSetGeometry(struct Simage *img, int tracks, int sectors) {
+	unsigned char	*data;
+	int				keep;
+
+	if (tracks == img->tracks && sectors == img->sectors) {
+		return 0;
+	}
+	if (tracks < 1 || tracks > MAX_TRACKS || sectors < 1 ||
+			sectors > MAX_SECTORS_PER_TRACK ||
+			(img->fixedSectors && sectors != img->fixedSectors)) {
+		return -1;
+	}
+	data = (unsigned char *)calloc(tracks * sectors, BYTES_PER_SECTOR);
+	if (NULL == data) {
+		fprintf(img->err, "Error allocating image buffer\n");
+		return -1;
+	}
+	// Tracks already read are still in place when only their number
+	// changes, anything else is read again with the new layout
+	keep = 0;
+	if (sectors == img->sectors) {
+		keep = (tracks < img->tracks) ? tracks : img->tracks;
+		memcpy(data, img->data, keep * TRACK_SIZE(img));
+	}
+	memset(&img->loaded[keep], img->created, MAX_TRACKS - keep);
+	memset(&img->dirty[keep * sectors], 0,
+		IMAGE_MAX_SECTORS - keep * sectors);
+	memset(&img->state[keep * sectors], 0,
+		IMAGE_MAX_SECTORS - keep * sectors);
+	free(img->data);
+	img->data = data;
+	img->tracks = tracks;
+	img->sectors = sectors;
+	imageSetPerm(img);
+	return 0;
+}
+
+/*****************************************************************************/
+int imageSetOrder(struct Simage *img, int order) {
+	int t;
+
+	if (order == img->order) {
+		return 0;
+	}
+	if (img->nib.kind != NIBBLE_NONE || img->orderFixed) {
+		return -1;
+	}
+	// Tracks already read are put in the new order in memory
+	for (t = 0; t < img->tracks; t++) {
+		if (img->loaded[t] && !img->created) {
+			imagePermute(img, t, 1);
+		}
+	}
+	img->order = order;
+	imageSetPerm(img);
+	for (t = 0; t < img->tracks; t++) {
+		if (img->loaded[t] && !img->created) {
+			imagePermute(img, t, 0);
+		}
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+int imageOffset(struct Simage *img, int track, int sector) {
+	return diskOffset(track, sector, img->tracks, img->sectors);
+}
+
+/*****************************************************************************/
+int imageExport(struct Simage *img, const char *filename) {
+	struct Simage	*out;
+	int				r;
+
+	// Everything is read first, the new image is written whole
+	if (imageLoadAll(img) < 0) {
+		return -1;
+	}
+	out = (struct Simage *)malloc(sizeof(struct Simage));
+	if (NULL == out) {
+		fprintf(img->err, "Error allocating image buffer\n");
+		return -1;
+	}
+	if (imageCreate(out, filename, img->err, img->tracks, img->sectors) < 0) {
+		free(out);
+		return -1;
+	}
+	memcpy(out->data, img->data, IMAGE_SIZE(img));
+	r = imageClose(out);
+	img->stats.bytesWritten += out->stats.bytesWritten;
+	img->stats.flushed += out->stats.flushed;
+	free(out);
+	return r;
+}
+
+/*****************************************************************************/
+void imageDiscard(struct Simage *img) {
+	imageFree(img);
+}
+
+/*****************************************************************************/
+unsigned char *imageSector(struct Simage *img, int track, int sector) {
+	int off = imageTouch(img, track, sector);
+
+	// Reads as zeros, so any chain through it ends there
+	if (off < 0) {
+		return img->scratch[0];
+	}
+	return img->data + off;
+}
+
+/*****************************************************************************/
+unsigned char *imageSectorW(struct Simage *img, int track, int sector) {
+	int off = imageTouch(img, track, sector);
+
+	// Data fields with extra bits in them can't be written in place
+	if (off >= 0 &&
+			img->state[off / BYTES_PER_SECTOR] == NIBBLE_SECTOR_READONLY) {
+		fprintf(img->err, "Error: track %d sector %d can not be rewritten\n",
+			track, sector);
+		__atomic_fetch_add(&img->invalid, 1, __ATOMIC_RELAXED);
+		off = -1;
+	}
+	if (off < 0) {
+		return img->scratch[1];
+	}
+	img->dirty[off / BYTES_PER_SECTOR] = 1;
+	return img->data + off;
+}
@@ -0,0 +1,633 @@
+/* dos33util - Apple D.O.S. 3.3 utility
+ *
+ * Copyright (C) 2019-2020  Fabio Belavenuto
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * This code is based on dos33fsutils from:
+ * https://github.com/deater/dos33fsprogs
+ * Copyright Vince Weaver <vince@deater.net>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "dos33.h"
+#include "nibble.h"
+
+// Defines
+#define GCR_INVALID 0xFF
+#define DATA62_NIBBLES 343			// 342 + checksum
+#define DATA53_NIBBLES 411			// 410 + checksum
+#define AUX62_SIZE 86
+#define CHUNK53_SIZE 51
+#define DATA_SEARCH 64				// nibbles from address to data field
+#define WOZ_HEADER_SIZE 12
+#define WOZ_TMAP_SIZE 160
+#define WOZ1_TRACK_SIZE 6656
+#define WOZ1_BITS_SIZE 6646
+#define WOZ_BLOCK_SIZE 512
+#define NIB_GAP1 48
+#define NIB_GAP2 6
+#define NIB_GAP3 27
+
+// Constants
+static const unsigned char gcr62[64] = {
+	0x96, 0x97, 0x9A, 0x9B, 0x9D, 0x9E, 0x9F, 0xA6,
+	0xA7, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF, 0xB2, 0xB3,
+	0xB4, 0xB5, 0xB6, 0xB7, 0xB9, 0xBA, 0xBB, 0xBC,
+	0xBD, 0xBE, 0xBF, 0xCB, 0xCD, 0xCE, 0xCF, 0xD3,
+	0xD6, 0xD7, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE,
+	0xDF, 0xE5, 0xE6, 0xE7, 0xE9, 0xEA, 0xEB, 0xEC,
+	0xED, 0xEE, 0xEF, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6,
+	0xF7, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF,
+};
+
+static const unsigned char gcr53[32] = {
+	0xAB, 0xAD, 0xAE, 0xAF, 0xB5, 0xB6, 0xB7, 0xBA,
+	0xBB, 0xBD, 0xBE, 0xBF, 0xD6, 0xD7, 0xDA, 0xDB,
+	0xDD, 0xDE, 0xDF, 0xEA, 0xEB, 0xED, 0xEE, 0xEF,
+	0xF5, 0xF6, 0xF7, 0xFA, 0xFB, 0xFD, 0xFE, 0xFF,
+};
+
+// DOS 3.3 software skew, physical sector of each logical one
+static const unsigned char dosToPhysical[16] = {
+	0x0, 0xD, 0xB, 0x9, 0x7, 0x5, 0x3, 0x1,
+	0xE, 0xC, 0xA, 0x8, 0x6, 0x4, 0x2, 0xF,
+};
+
+static const unsigned char wozMagic[2][8] = {
+	{ 'W', 'O', 'Z', '1', 0xFF, 0x0A, 0x0D, 0x0A },
+	{ 'W', 'O', 'Z', '2', 0xFF, 0x0A, 0x0D, 0x0A },
+};
+
+// Variables
+// Inverse tables are built once and only read afterwards
+static pthread_once_t nibbleTablesOnce = PTHREAD_ONCE_INIT;
+static unsigned char gcr62Inv[256];
+static unsigned char gcr53Inv[256];
+static unsigned char physicalToDos[16];
+static unsigned int crcTable[256];
+
+// Private functions
+
+/*****************************************************************************/
+static void nibbleBuildTables(void) {
+	unsigned int	c;
+	int				i, k;
+
+	memset(gcr62Inv, GCR_INVALID, sizeof(gcr62Inv));
+	memset(gcr53Inv, GCR_INVALID, sizeof(gcr53Inv));
+	for (i = 0; i < 64; i++) {
+		gcr62Inv[gcr62[i]] = i;
+	}
+	for (i = 0; i < 32; i++) {
+		gcr53Inv[gcr53[i]] = i;
+	}
+	for (i = 0; i < 16; i++) {
+		physicalToDos[dosToPhysical[i]] = i;
+	}
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) {
+			c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		}
+		crcTable[i] = c;
+	}
+}
+
+/*****************************************************************************/
+static unsigned int le16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+/*****************************************************************************/
+static unsigned int le32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+/*****************************************************************************/
+static unsigned int nibbleCrc32(const unsigned char *p, long len) {
+	unsigned int c = 0xFFFFFFFF;
+
+	while (len-- > 0) {
+		c = crcTable[(c ^ *p++) & 0xFF] ^ (c >> 8);
+	}
+	return ~c;
+}
+
+/*****************************************************************************/
+static int bitAt(const unsigned char *bits, int n) {
+	return (bits[n >> 3] >> (7 - (n & 7))) & 1;
+}
+
+/*****************************************************************************/
+static void setBit(unsigned char *bits, int n, int value) {
+	if (value) {
+		bits[n >> 3] |= 0x80 >> (n & 7);
+	} else {
+		bits[n >> 3] &= ~(0x80 >> (n & 7));
+	}
+}
+
+/*****************************************************************************/
+static int nibbleStream(const unsigned char *bits, int bitCount,
+		unsigned char *nibs, int *pos, int max) {
+	int i, b, start = 0, latch = 0, n = 0;
+
+	// Like the disk controller: zeros before the first one are skipped,
+	// a byte is ready once its high bit is set. Two turns so fields
+	// across the end of the track are seen whole
+	for (i = 0; i < 2 * bitCount && n < max; i++) {
+		b = bitAt(bits, i % bitCount);
+		if (latch == 0) {
+			if (!b) {
+				continue;
+			}
+			start = i;
+		}
+		latch = (latch << 1) | b;
+		if (latch & 0x80) {
+			nibs[n] = latch;
+			pos[n++] = start;
+			latch = 0;
+		}
+	}
+	return n;
+}
+
+/*****************************************************************************/
+static int decode44(const unsigned char *p) {
+	return ((p[0] << 1) | 1) & p[1];
+}
+
+/*****************************************************************************/
+static void encode44(unsigned char *p, int value) {
+	p[0] = (value >> 1) | 0xAA;
+	p[1] = value | 0xAA;
+}
+
+/*****************************************************************************/
+static int decode62(const unsigned char *in, unsigned char *out) {
+	unsigned char	buf[DATA62_NIBBLES - 1];
+	int				i, v, prev = 0, aux;
+
+	// Each nibble holds the difference to the previous value
+	for (i = 0; i < DATA62_NIBBLES; i++) {
+		v = gcr62Inv[in[i]];
+		if (v == GCR_INVALID) {
+			return -1;
+		}
+		prev ^= v;
+		if (i < DATA62_NIBBLES - 1) {
+			buf[i] = prev;
+		}
+	}
+	// Checksum leaves the chain at zero
+	if (prev != 0) {
+		return -1;
+	}
+	// Low two bits of byte i are in aux i % 86, swapped
+	for (i = 0; i < BYTES_PER_SECTOR; i++) {
+		aux = buf[i % AUX62_SIZE] >> (2 * (i / AUX62_SIZE));
+		out[i] = (buf[AUX62_SIZE + i] << 2) | ((aux & 1) << 1) |
+			((aux >> 1) & 1);
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+static void encode62(const unsigned char *in, unsigned char *out) {
+	unsigned char	buf[DATA62_NIBBLES - 1];
+	int				i, k, v, prev = 0;
+
+	// Same layout as the RWTS, the last two aux values also carry the
+	// low bits of bytes 0 and 1 on top
+	for (i = 0; i < AUX62_SIZE; i++) {
+		buf[i] = 0;
+		for (k = 2; k >= 0; k--) {
+			v = in[(i + k * AUX62_SIZE) & 0xFF];
+			buf[i] = (buf[i] << 2) | ((v & 1) << 1) | ((v >> 1) & 1);
+		}
+	}
+	for (i = 0; i < BYTES_PER_SECTOR; i++) {
+		buf[AUX62_SIZE + i] = in[i] >> 2;
+	}
+	for (i = 0; i < DATA62_NIBBLES - 1; i++) {
+		out[i] = gcr62[buf[i] ^ prev];
+		prev = buf[i];
+	}
+	out[i] = gcr62[prev];
+}
+
+/*****************************************************************************/
+static int decode53(const unsigned char *in, unsigned char *out) {
+	unsigned char	threes[CHUNK53_SIZE * 3 + 1];
+	int				i, v, prev = 0, t1, t2, t3;
+	unsigned char	*p = out;
+
+	// 154 values with the low bits, backwards, then 256 high five bits
+	for (i = CHUNK53_SIZE * 3; i >= 0; i--) {
+		v = gcr53Inv[*in++];
+		if (v == GCR_INVALID) {
+			return -1;
+		}
+		prev ^= v;
+		threes[i] = prev;
+	}
+	for (i = 0; i < BYTES_PER_SECTOR; i++) {
+		v = gcr53Inv[*in++];
+		if (v == GCR_INVALID) {
+			return -1;
+		}
+		prev ^= v;
+		out[i] = prev << 3;
+	}
+	if (gcr53Inv[*in] == GCR_INVALID || (prev ^ gcr53Inv[*in]) != 0) {
+		return -1;
+	}
+	// Five bytes from each group of three values
+	for (i = CHUNK53_SIZE - 1; i >= 0; i--) {
+		t1 = threes[i];
+		t2 = threes[CHUNK53_SIZE + i];
+		t3 = threes[CHUNK53_SIZE * 2 + i];
+		*p++ |= (t1 >> 2) & 0x07;
+		*p++ |= (t2 >> 2) & 0x07;
+		*p++ |= (t3 >> 2) & 0x07;
+		*p++ |= ((t1 & 0x02) << 1) | (t2 & 0x02) | ((t3 & 0x02) >> 1);
+		*p++ |= ((t1 & 0x01) << 2) | ((t2 & 0x01) << 1) | (t3 & 0x01);
+	}
+	*p |= threes[CHUNK53_SIZE * 3] & 0x07;
+	return 0;
+}
+
+/*****************************************************************************/
+static void encode53(const unsigned char *in, unsigned char *out) {
+	unsigned char	threes[CHUNK53_SIZE * 3 + 1];
+	int				i, prev = 0;
+	const unsigned char	*p = in;
+
+	for (i = CHUNK53_SIZE - 1; i >= 0; i--) {
+		threes[i] = ((p[0] & 0x07) << 2) | ((p[3] & 0x04) >> 1) |
+			((p[4] & 0x04) >> 2);
+		threes[CHUNK53_SIZE + i] = ((p[1] & 0x07) << 2) | (p[3] & 0x02) |
+			((p[4] & 0x02) >> 1);
+		threes[CHUNK53_SIZE * 2 + i] = ((p[2] & 0x07) << 2) |
+			((p[3] & 0x01) << 1) | (p[4] & 0x01);
+		p += 5;
+	}
+	threes[CHUNK53_SIZE * 3] = *p & 0x07;
+	for (i = CHUNK53_SIZE * 3; i >= 0; i--) {
+		*out++ = gcr53[threes[i] ^ prev];
+		prev = threes[i];
+	}
+	for (i = 0; i < BYTES_PER_SECTOR; i++) {
+		*out++ = gcr53[(in[i] >> 3) ^ prev];
+		prev = in[i] >> 3;
+	}
+	*out = gcr53[prev];
+}
+
+/*****************************************************************************/
+static int isPrologue(const unsigned char *p, int third) {
+	return p[0] == 0xD5 && p[1] == 0xAA && p[2] == third;
+}
+
+/*****************************************************************************/
+static int nibbleDetectSectors(struct Snibble *nib) {
+	unsigned char	*nibs;
+	int				*pos, t, i, n, max, r = 0;
+
+	// Address prologue of the first track with data tells 13 or 16
+	for (t = 0; t < nib->tracks && r == 0; t++) {
+		if (nib->track[t].bits <= 0) {
+			continue;
+		}
+		max = nib->track[t].bits / 8 + 8;
+		nibs = (unsigned char *)malloc(max);
+		pos = (int *)malloc(max * sizeof(int));
+		if (NULL != nibs && NULL != pos) {
+			n = nibbleStream(nib->raw + nib->track[t].offset,
+				nib->track[t].bits, nibs, pos, max);
+			for (i = 0; i + 3 <= n && r == 0; i++) {
+				if (isPrologue(&nibs[i], 0x96)) {
+					r = 16;
+				} else if (isPrologue(&nibs[i], 0xB5)) {
+					r = 13;
+				}
+			}
+		}
+		free(nibs);
+		free(pos);
+	}
+	return r ? r : SECTORS_PER_TRACK;
+}
+
+/*****************************************************************************/
+static int nibbleOpenWoz(struct Snibble *nib, FILE *err) {
+	const unsigned char	*info = NULL, *tmap = NULL, *trks = NULL, *e;
+	long				off, len, trksLen = 0, start;
+	int					t, idx;
+
+	for (off = WOZ_HEADER_SIZE; off + 8 <= nib->size; off += 8 + len) {
+		len = le32(nib->raw + off + 4);
+		if (len > nib->size - off - 8) {
+			break;
+		}
+		if (0 == memcmp(nib->raw + off, "INFO", 4)) {
+			info = nib->raw + off + 8;
+		} else if (0 == memcmp(nib->raw + off, "TMAP", 4) &&
+				len >= WOZ_TMAP_SIZE) {
+			tmap = nib->raw + off + 8;
+		} else if (0 == memcmp(nib->raw + off, "TRKS", 4)) {
+			trks = nib->raw + off + 8;
+			trksLen = len;
+		}
+	}
+	if (NULL == info || NULL == tmap || NULL == trks) {
+		fprintf(err, "Error: WOZ image without INFO, TMAP or TRKS\n");
+		return -1;
+	}
+	if (info[1] != 1) {
+		fprintf(err, "Error: WOZ image is not a 5.25 disk\n");
+		return -1;
+	}
+	// Whole tracks only, quarter tracks in between are not used by DOS
+	for (t = 0; t < MAX_TRACKS && t * 4 < WOZ_TMAP_SIZE; t++) {
+		idx = tmap[t * 4];
+		if (idx == 0xFF) {
+			continue;
+		}
+		if (nib->kind == NIBBLE_WOZ1) {
+			if ((idx + 1) * WOZ1_TRACK_SIZE > trksLen) {
+				continue;
+			}
+			e = trks + idx * WOZ1_TRACK_SIZE;
+			start = e - nib->raw;
+			len = le16(e + WOZ1_BITS_SIZE + 2);
+			if (len > WOZ1_BITS_SIZE * 8) {
+				continue;
+			}
+		} else {
+			if ((idx + 1) * 8 > trksLen) {
+				continue;
+			}
+			e = trks + idx * 8;
+			start = (long)le16(e) * WOZ_BLOCK_SIZE;
+			len = le32(e + 4);
+			if (len > (nib->size - start) * 8 || start <= 0) {
+				continue;
+			}
+		}
+		nib->track[t].offset = start;
+		nib->track[t].bits = len;
+		nib->tracks = t + 1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+static void nibbleFormatTrack(struct Snibble *nib, int track) {
+	unsigned char	*p = nib->raw + track * NIB_TRACK_SIZE;
+	unsigned char	zero[BYTES_PER_SECTOR];
+	int				i, s;
+
+	// Standard 16 sector layout, gaps of sync bytes between the fields
+	memset(p, 0xFF, NIB_TRACK_SIZE);
+	memset(zero, 0, sizeof(zero));
+	nib->track[track].offset = track * NIB_TRACK_SIZE;
+	nib->track[track].bits = NIB_TRACK_SIZE * 8;
+	i = NIB_GAP1;
+	for (s = 0; s < SECTORS_PER_TRACK; s++) {
+		p[i++] = 0xD5; p[i++] = 0xAA; p[i++] = 0x96;
+		encode44(&p[i], 254);
+		encode44(&p[i + 2], track);
+		encode44(&p[i + 4], s);
+		encode44(&p[i + 6], 254 ^ track ^ s);
+		i += 8;
+		p[i++] = 0xDE; p[i++] = 0xAA; p[i++] = 0xEB;
+		i += NIB_GAP2;
+		p[i++] = 0xD5; p[i++] = 0xAA; p[i++] = 0xAD;
+		nib->track[track].dataBit[physicalToDos[s]] = i * 8;
+		encode62(zero, &p[i]);
+		i += DATA62_NIBBLES;
+		p[i++] = 0xDE; p[i++] = 0xAA; p[i++] = 0xEB;
+		i += NIB_GAP3;
+	}
+}
+
+// Public functions
+
+/*****************************************************************************/
+int nibbleProbe(const char *filename, const unsigned char *head, int headLen,
+		long size) {
+	const char *ext = strrchr(filename, '.');
+
+	if (headLen >= 8 && 0 == memcmp(head, wozMagic[0], 8)) {
+		return NIBBLE_WOZ1;
+	}
+	if (headLen >= 8 && 0 == memcmp(head, wozMagic[1], 8)) {
+		return NIBBLE_WOZ2;
+	}
+	if ((NULL != ext && 0 == strcasecmp(ext, ".nib")) ||
+			size == TRACKS_PER_DISK * NIB_TRACK_SIZE) {
+		return NIBBLE_NIB;
+	}
+	return NIBBLE_NONE;
+}
+
+/*****************************************************************************/
+int nibbleOpen(struct Snibble *nib, int kind, FILE *f, long size, FILE *err) {
+	int t;
+
+	pthread_once(&nibbleTablesOnce, nibbleBuildTables);
+	memset(nib, 0, sizeof(*nib));
+	nib->kind = kind;
+	nib->size = size;
+	nib->raw = (unsigned char *)malloc(size > 0 ? size : 1);
+	if (NULL == nib->raw) {
+		fprintf(err, "Error allocating image buffer\n");
+		return -1;
+	}
+	fseek(f, 0, SEEK_SET);
+	if (fread(nib->raw, 1, size, f) != (size_t)size) {
+		fprintf(err, "Error on I/O\n");
+		nibbleFree(nib);
+		return -1;
+	}
+	if (kind == NIBBLE_NIB) {
+		nib->tracks = size / NIB_TRACK_SIZE;
+		if (nib->tracks > MAX_TRACKS) {
+			nib->tracks = MAX_TRACKS;
+		}
+		for (t = 0; t < nib->tracks; t++) {
+			nib->track[t].offset = (long)t * NIB_TRACK_SIZE;
+			nib->track[t].bits = NIB_TRACK_SIZE * 8;
+		}
+	} else if (nibbleOpenWoz(nib, err) < 0) {
+		nibbleFree(nib);
+		return -1;
+	}
+	nib->sectors = nibbleDetectSectors(nib);
+	return 0;
+}
+
+/*****************************************************************************/
+int nibbleCreate(struct Snibble *nib, int tracks, FILE *err) {
+	int t;
+
+	pthread_once(&nibbleTablesOnce, nibbleBuildTables);
+	memset(nib, 0, sizeof(*nib));
+	nib->kind = NIBBLE_NIB;
+	nib->size = (long)tracks * NIB_TRACK_SIZE;
+	nib->tracks = tracks;
+	nib->sectors = SECTORS_PER_TRACK;
+	nib->raw = (unsigned char *)malloc(nib->size);
+	if (NULL == nib->raw) {
+		fprintf(err, "Error allocating image buffer\n");
+		return -1;
+	}
+	for (t = 0; t < tracks; t++) {
+		nibbleFormatTrack(nib, t);
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+int nibbleReadTrack(struct Snibble *nib, int track, unsigned char *data,
+		unsigned char *state) {
+	struct SnibbleTrack	*t = &nib->track[track];
+	unsigned char		*nibs;
+	int					*pos, i, j, n, max, count, missing;
+	int					addr, sector, start, logical;
+
+	memset(data, 0, nib->sectors * BYTES_PER_SECTOR);
+	memset(state, NIBBLE_SECTOR_BAD, nib->sectors);
+	if (track >= nib->tracks || t->bits <= 0) {
+		return nib->sectors;
+	}
+	for (i = 0; i < nib->sectors; i++) {
+		t->dataBit[i] = -1;
+	}
+	addr = (nib->sectors == 13) ? 0xB5 : 0x96;
+	count = (nib->sectors == 13) ? DATA53_NIBBLES : DATA62_NIBBLES;
+	max = 2 * (t->bits / 8 + 1);
+	nibs = (unsigned char *)malloc(max);
+	pos = (int *)malloc(max * sizeof(int));
+	if (NULL == nibs || NULL == pos) {
+		free(nibs);
+		free(pos);
+		return nib->sectors;
+	}
+	n = nibbleStream(nib->raw + t->offset, t->bits, nibs, pos, max);
+	// Address fields starting in the first turn, each followed by its data
+	for (i = 0; i + 11 <= n && pos[i] < t->bits; i++) {
+		if (!isPrologue(&nibs[i], addr) ||
+				(decode44(&nibs[i + 3]) ^ decode44(&nibs[i + 5]) ^
+				decode44(&nibs[i + 7]) ^ decode44(&nibs[i + 9])) != 0 ||
+				decode44(&nibs[i + 5]) != track) {
+			continue;
+		}
+		sector = decode44(&nibs[i + 7]);
+		if (sector >= nib->sectors) {
+			continue;
+		}
+		logical = (nib->sectors == 16) ? physicalToDos[sector] : sector;
+		if (state[logical] != NIBBLE_SECTOR_BAD) {
+			continue;
+		}
+		for (j = i + 11; j + 3 <= n && j < i + 11 + DATA_SEARCH; j++) {
+			if (isPrologue(&nibs[j], 0xAD) || isPrologue(&nibs[j], addr)) {
+				break;
+			}
+		}
+		start = j + 3;
+		if (start + count > n || !isPrologue(&nibs[j], 0xAD)) {
+			continue;
+		}
+		if (((count == DATA53_NIBBLES) ?
+				decode53(&nibs[start], data + logical * BYTES_PER_SECTOR) :
+				decode62(&nibs[start], data + logical * BYTES_PER_SECTOR)) < 0) {
+			continue;
+		}
+		// Rewritten in place only when the field has no extra bits in it
+		if (pos[start + count - 1] - pos[start] == (count - 1) * 8) {
+			t->dataBit[logical] = pos[start] % t->bits;
+			state[logical] = NIBBLE_SECTOR_OK;
+		} else {
+			state[logical] = NIBBLE_SECTOR_READONLY;
+		}
+	}
+	free(nibs);
+	free(pos);
+	for (i = missing = 0; i < nib->sectors; i++) {
+		missing += (state[i] == NIBBLE_SECTOR_BAD);
+	}
+	return missing;
+}
+
+/*****************************************************************************/
+int nibbleWriteSector(struct Snibble *nib, int track, int sector,
+		const unsigned char *data) {
+	struct SnibbleTrack	*t = &nib->track[track];
+	unsigned char		gcr[DATA53_NIBBLES], *bits;
+	int					i, b, count, bit;
+
+	if (track >= nib->tracks || t->dataBit[sector] < 0) {
+		return -1;
+	}
+	if (nib->sectors == 13) {
+		encode53(data, gcr);
+		count = DATA53_NIBBLES;
+	} else {
+		encode62(data, gcr);
+		count = DATA62_NIBBLES;
+	}
+	bits = nib->raw + t->offset;
+	bit = t->dataBit[sector];
+	for (i = 0; i < count; i++) {
+		for (b = 7; b >= 0; b--) {
+			setBit(bits, bit, (gcr[i] >> b) & 1);
+			bit = (bit + 1) % t->bits;
+		}
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+int nibbleSave(struct Snibble *nib, FILE *f) {
+	unsigned int crc;
+
+	// A zero CRC means the file has none
+	if (nib->kind != NIBBLE_NIB && nib->size > WOZ_HEADER_SIZE &&
+			le32(nib->raw + 8) != 0) {
+		crc = nibbleCrc32(nib->raw + WOZ_HEADER_SIZE,
+			nib->size - WOZ_HEADER_SIZE);
+		nib->raw[8] = crc;
+		nib->raw[9] = crc >> 8;
+		nib->raw[10] = crc >> 16;
+		nib->raw[11] = crc >> 24;
+	}
+	if (fwrite(nib->raw, 1, nib->size, f) != (size_t)nib->size) {
+		return -1;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+void nibbleFree(struct Snibble *nib) {
+	free(nib->raw);
+	nib->raw = NULL;
+}
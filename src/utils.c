@@ -24,28 +24,25 @@
 #include <stdio.h>
 #include <string.h>
 #include "dos33.h"
+#include "utils.h"
 
 // Functions
 
 /*****************************************************************************/
-int diskOffset(unsigned char track, unsigned char sector) {
-	if (track >= TRACKS_PER_DISK) {
-		fprintf(stderr, "Error: track > %d\n", TRACKS_PER_DISK);
-		exit(1);
-	}
-	if (sector >= SECTORS_PER_TRACK) {
-		fprintf(stderr, "Error: sector > %d\n", SECTORS_PER_TRACK);
-		exit(1);
+int diskOffset(int track, int sector, int tracks, int sectors) {
+	// Callers decide what an address outside the disk means
+	if (track < 0 || track >= tracks || sector < 0 || sector >= sectors) {
+		return -1;
 	}
-	return (track * SECTORS_PER_TRACK + sector) * BYTES_PER_SECTOR;
+	return (track * sectors + sector) * BYTES_PER_SECTOR;
 }
 
 /*****************************************************************************/
-int checkAppleFilename(char *filename) {
+int checkAppleFilename(FILE *err, char *filename) {
 	int i;
 
 	if (filename[0] < 64) {
-		fprintf(stderr,"Error! First char of filename "
+		fprintf(err,"Error! First char of filename "
 				"must be ASCII 64 or above!\n");
 		return 0;
 	}
@@ -53,7 +50,7 @@ int checkAppleFilename(char *filename) {
 	// Check for comma in filename
 	for(i = 0; i < strlen(filename); i++) {
 		if (filename[i] == ',') {
-			fprintf(stderr,"Error! "
+			fprintf(err,"Error! "
 				"Cannot have ',' in a filename!\n");
 			return 0;
 		}
@@ -62,12 +59,12 @@ int checkAppleFilename(char *filename) {
 }
 
 /*****************************************************************************/
-int truncateFilename(char *out, char *in) {
+int truncateFilename(FILE *err, char *out, char *in) {
 	int truncated = 0;
 
 	/* Truncate filename if too long */
 	if (strlen(in) > 30) {
-		fprintf(stderr, "Warning!  Truncating %s to 30 chars\n", in);
+		fprintf(err, "Warning!  Truncating %s to 30 chars\n", in);
 		truncated = 1;
 	}
 	strncpy(out, in, 30);
@@ -92,6 +89,20 @@ char *dos33FilenameToAscii(char *dest, unsigned char *src, int len) {
 	return dest;
 }
 
+/*****************************************************************************/
+void dos33AsciiToFilename(unsigned char *dest, char *src) {
+	int i;
+
+	// copy over filename
+	for (i = 0; i < FILE_NAME_SIZE && src[i] != '\0'; i++) {
+		dest[i] = src[i] | 0x80;
+	}
+	// pad out the filename with spaces
+	for(; i < FILE_NAME_SIZE; i++) {
+		dest[i] = ' ' | 0x80;
+	}
+}
+
 /*****************************************************************************/
 char dos33TypeToLetter(int value) {
 
@@ -254,3 +265,33 @@ int findFirstOne(unsigned char byte) {
 	}
 	return i;
 }
+
+/*****************************************************************************/
+int splitArgs(char *line, char **argv, int max) {
+	int		argc = 0;
+	char	*p = line, *q;
+
+	while (argc < max) {
+		// Skip blanks
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			++p;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		// Quoted argument may contain blanks
+		if (*p == '"') {
+			argv[argc++] = ++p;
+			q = strchr(p, '"');
+		} else {
+			argv[argc++] = p;
+			q = strpbrk(p, " \t\r\n");
+		}
+		if (q == NULL) {
+			break;
+		}
+		*q = '\0';
+		p = q + 1;
+	}
+	return argc;
+}